@@ -0,0 +1,331 @@
+#include <pthread.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "admin.h"
+#include "chatroom.h"
+#include "logger.h"
+#include "metrics.h"
+#include "slab.h"
+
+#define ADMIN_REQUEST_WAIT_MS   (200)   // plain nc sends nothing, answer anyway after this
+#define ADMIN_BACKLOG       (8)
+#define ADMIN_REQUEST_SIZE  (4096)
+
+typedef struct admin_buff_s {
+    char* data;
+    size_t len;
+    size_t capacity;
+} admin_buff_t;
+
+// Rooms are copied out first so each metric family can be written in one block
+typedef struct room_snapshot_s {
+    char name[32];
+    room_stats_t stats;
+} room_snapshot_t;
+
+typedef struct room_list_s {
+    room_snapshot_t* rooms;
+    uint32_t count;
+    uint32_t capacity;
+} room_list_t;
+
+static int adminFds[2] = {-1, -1};
+
+static void buff_printf(admin_buff_t* buff, const char* fmt, ...)
+{
+    while(1) {
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(buff->data + buff->len, buff->capacity - buff->len, fmt, args);
+        va_end(args);
+        if(len < 0) {
+            return;
+        }
+        if(buff->len + len < buff->capacity) {
+            buff->len += len;
+            return;
+        }
+
+        size_t capacity = buff->capacity == 0 ? 16384 : buff->capacity*2;
+        while(capacity <= buff->len + len) {
+            capacity *= 2;
+        }
+        char* data = (char*)realloc(buff->data, capacity);
+        if(data == NULL) {
+            return;
+        }
+        buff->data = data;
+        buff->capacity = capacity;
+    }
+}
+
+// Label values escape backslash and double quote
+static void buff_label(admin_buff_t* buff, const char* value)
+{
+    for(; *value != '\0'; value++) {
+        if(*value == '\\' || *value == '"') {
+            buff_printf(buff, "\\%c", *value);
+        } else {
+            buff_printf(buff, "%c", *value);
+        }
+    }
+}
+
+static void buff_family(admin_buff_t* buff, const char* name, const char* type, const char* help)
+{
+    buff_printf(buff, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void collect_room(const room_stats_t* stats, void* ctx)
+{
+    room_list_t* list = (room_list_t*)ctx;
+    if(list->count == list->capacity) {
+        uint32_t capacity = list->capacity == 0 ? 64 : list->capacity*2;
+        room_snapshot_t* rooms = (room_snapshot_t*)realloc(list->rooms, capacity * sizeof(room_snapshot_t));
+        if(rooms == NULL) {
+            return;
+        }
+        list->rooms = rooms;
+        list->capacity = capacity;
+    }
+
+    room_snapshot_t* room = &list->rooms[list->count++];
+    snprintf(room->name, sizeof(room->name), "%s", stats->name);
+    room->stats = *stats;
+    room->stats.name = room->name;
+}
+
+static void render_room_family(admin_buff_t* buff, const room_list_t* list, const char* name, const char* type,
+                               const char* help, size_t offset, uint8_t is64)
+{
+    buff_family(buff, name, type, help);
+    for(uint32_t i = 0; i < list->count; i++) {
+        const char* field = (const char*)&list->rooms[i].stats + offset;
+        uint64_t value = is64 ? *(const uint64_t*)field : *(const uint32_t*)field;
+        buff_printf(buff, "%s{room=\"", name);
+        buff_label(buff, list->rooms[i].name);
+        buff_printf(buff, "\"} %" PRIu64 "\n", value);
+    }
+}
+
+static void render_client(const client_stats_t* stats, void* ctx)
+{
+    admin_buff_t* buff = (admin_buff_t*)ctx;
+    buff_printf(buff, "yak_client_send_backlog{room=\"");
+    buff_label(buff, stats->room);
+    buff_printf(buff, "\",client=\"");
+    buff_label(buff, stats->name);
+    buff_printf(buff, "\"} %u\n", stats->queuedMsgs);
+}
+
+static void render_metrics(admin_buff_t* buff)
+{
+    uint64_t values[NUM_METRICS];
+    metrics_snapshot(values);
+    for(uint32_t i = 0; i < NUM_METRICS; i++) {
+        const metric_info_t* info = metrics_info((metric_t)i);
+        buff_family(buff, info->name, "counter", info->help);
+        buff_printf(buff, "%s %" PRIu64 "\n", info->name, values[i]);
+    }
+
+    slow_consumer_stats_t slow;
+    chatroom_get_slow_consumer_stats(&slow);
+    buff_family(buff, "yak_slow_consumer_actions_total", "counter", "Slow consumer policy actions taken");
+    buff_printf(buff, "yak_slow_consumer_actions_total{action=\"drop_oldest\"} %" PRIu64 "\n", slow.droppedOldest);
+    buff_printf(buff, "yak_slow_consumer_actions_total{action=\"drop_newest\"} %" PRIu64 "\n", slow.droppedNewest);
+    buff_printf(buff, "yak_slow_consumer_actions_total{action=\"disconnect\"} %" PRIu64 "\n", slow.disconnected);
+
+    buff_family(buff, "yak_slab_reserved_bytes", "gauge", "Bytes reserved by the frame slabs");
+    buff_printf(buff, "yak_slab_reserved_bytes %" PRIu64 "\n", slab_reserved_bytes());
+
+    room_list_t list = {NULL, 0, 0};
+    chatroom_foreach_room_stats(collect_room, &list);
+    render_room_family(buff, &list, "yak_room_members", "gauge", "Members in the room",
+                       offsetof(room_stats_t, numClients), 0);
+    render_room_family(buff, &list, "yak_room_msgs_total", "counter", "Msgs broadcast in the room",
+                       offsetof(room_stats_t, msgsOut), 1);
+    render_room_family(buff, &list, "yak_room_msg_bytes_total", "counter", "Bytes of msgs broadcast in the room",
+                       offsetof(room_stats_t, bytesOut), 1);
+    render_room_family(buff, &list, "yak_room_send_buff_used", "gauge", "Occupied slots of the room's send ring",
+                       offsetof(room_stats_t, sendBuffUsed), 0);
+    render_room_family(buff, &list, "yak_room_send_buff_size", "gauge", "Slots in the room's send ring",
+                       offsetof(room_stats_t, sendBuffLen), 0);
+    render_room_family(buff, &list, "yak_room_memory_bytes", "gauge", "Memory held on behalf of the room",
+                       offsetof(room_stats_t, memBytes), 1);
+    free(list.rooms);
+
+    buff_family(buff, "yak_client_send_backlog", "gauge", "Msgs queued for a member waiting on its socket");
+    chatroom_foreach_client_stats(render_client, buff);
+}
+
+// Waits briefly for a request so HTTP scrapers get a proper response and raw readers get the text
+static void serve_scrape(int fd)
+{
+    char request[ADMIN_REQUEST_SIZE];
+    ssize_t numBytes = 0;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if(poll(&pfd, 1, ADMIN_REQUEST_WAIT_MS) > 0) {
+        numBytes = recv(fd, request, sizeof(request)-1, 0);
+    }
+    uint8_t isHttp = numBytes >= 4 && memcmp(request, "GET ", 4) == 0;
+
+    admin_buff_t body = {NULL, 0, 0};
+    render_metrics(&body);
+
+    admin_buff_t response = {NULL, 0, 0};
+    if(isHttp) {
+        buff_printf(&response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+    }
+    size_t headerLen = response.len;
+    const char* parts[2] = {response.data, body.data};
+    size_t lens[2] = {headerLen, body.len};
+    for(uint32_t i = 0; i < 2; i++) {
+        size_t sent = 0;
+        while(sent < lens[i]) {
+            ssize_t ret = send(fd, parts[i] + sent, lens[i] - sent, MSG_NOSIGNAL);
+            if(ret < 0 && errno == EINTR) {
+                continue;
+            } else if(ret <= 0) {
+                break;
+            }
+            sent += ret;
+        }
+    }
+
+    free(response.data);
+    free(body.data);
+}
+
+// Scrapes are rare, one thread serves every admin listener in turn
+static void* admin_loop(void* input)
+{
+    struct pollfd pfds[2];
+    uint32_t numFds = 0;
+    for(uint32_t i = 0; i < 2; i++) {
+        if(adminFds[i] >= 0) {
+            pfds[numFds].fd = adminFds[i];
+            pfds[numFds].events = POLLIN;
+            numFds++;
+        }
+    }
+
+    while(1) {
+        if(poll(pfds, numFds, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            LOG_ERROR("Admin listener failed to poll with err=%d", err);
+            return NULL;
+        }
+
+        for(uint32_t i = 0; i < numFds; i++) {
+            if(!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            int fd = accept(pfds[i].fd, NULL, NULL);
+            if(fd < 0) {
+                continue;
+            }
+            serve_scrape(fd);
+            close(fd);
+        }
+    }
+
+    return NULL;
+}
+
+static int open_tcp_listener(uint32_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Loopback only, metrics aren't for the outside world
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, ADMIN_BACKLOG) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to open admin port %u with err=%d", port, err);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int open_unix_listener(const char* path)
+{
+    struct sockaddr_un addr;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Admin socket path too long %s", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // Left behind by a previous run
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, ADMIN_BACKLOG) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to open admin socket %s with err=%d", path, err);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int8_t admin_start(uint32_t port, const char* unixPath)
+{
+    if(port == 0 && unixPath == NULL) {
+        return 0;
+    }
+
+    if(port != 0 && (adminFds[0] = open_tcp_listener(port)) < 0) {
+        return -1;
+    }
+    if(unixPath != NULL && (adminFds[1] = open_unix_listener(unixPath)) < 0) {
+        return -1;
+    }
+
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, admin_loop, NULL) != 0) {
+        LOG_ERROR("Failed to start admin thread");
+        return -1;
+    }
+    pthread_detach(tid);
+
+    if(port != 0) {
+        LOG_INFO("Serving metrics on 127.0.0.1:%u", port);
+    }
+    if(unixPath != NULL) {
+        LOG_INFO("Serving metrics on %s", unixPath);
+    }
+    return 0;
+}
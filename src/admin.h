@@ -0,0 +1,10 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdint.h>
+
+// Serves metrics in Prometheus text format on localhost:port and/or a Unix socket
+// A port of 0 or a NULL path leaves that listener off
+int8_t admin_start(uint32_t port, const char* unixPath);
+
+#endif
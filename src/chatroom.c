@@ -1,784 +1,2867 @@
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/random.h>
 #include <time.h>
 #include <unistd.h>
-#include <semaphore.h>
+#include <sys/epoll.h>
 
 #include "chatroom.h"
+#include "fanout.h"
+#include "frame.h"
+#include "framing.h"
+#include "logger.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "roomlog.h"
+#include "senders.h"
+#include "zerocopy.h"
 #define CONN_TIMEOUT_SECS   (30)
+#define DEFAULT_SEND_STALL_SECS (60)
+#define PING_MSG            "PING\n"
+#define PONG_MSG            "PONG"
+#define JOIN_CMD            "JOIN"
+#define RESUME_CMD          "RESUME"
+#define SESSION_MSG         "SESSION"
+#define GAP_MSG             "GAP"
 
 #define SEND_BUFF_LEN       (32)
+#define SEND_BUFF_RETRY_MS  (1)   // a producer that found the ring full offers again after this
 #define MAX_MSG_SIZE        (20000)
+#define RECV_RING_SIZE      (32768) // power of 2 above MAX_MSG_SIZE
 #define MIN_JOIN_MSG_LEN    (8)
-#define MAX_JOIN_MSG_LEN    (MAX_NAME_LEN*2 + strlen("JOIN") + 3) // +4 for two spaces and \r\n
+#define MAX_JOIN_MSG_LEN    (MAX_NAME_LEN*2 + (sizeof(RESUME_CMD)-1) + 3) // longest command, +4 for two spaces and \r\n
 #define JOIN_BUFF_SIZE      (MAX_JOIN_MSG_LEN)
 #define MAX_NAME_LEN        (20)
-#define SEM_PSHARE          (0) // semaphore within a process
+#define DEFAULT_OUT_QUEUE_HIGH_WATERMARK    (1024)
+#define OUT_QUEUE_INIT_LEN  (16)
+#define CLIENT_EVENTS       (EPOLLIN | EPOLLRDHUP)
+#define ROOM_DIR_BUCKETS    (1 << 16)
+#define ROOM_DIR_STRIPES    (256)   // divides ROOM_DIR_BUCKETS, bucket b is guarded by stripe b % ROOM_DIR_STRIPES
+#define ROOM_LINGER_MS      (5000)  // a dormant room rejoined within this is revived instead of rebuilt
+#define ROOM_SWEEP_MS       (1000)
+#define FLUSH_IOV_MAX       (64)    // queued frames coalesced into one sendmsg
+#define DEFAULT_LARGE_ROOM_THRESHOLD        (1024)
+#define FANOUT_MIN_PARTITION    (256)   // fewer members than this per worker isn't worth the handoff
+#define FANOUT_MAX_PARTS    (MAX_FANOUT_WORKERS+1)
+#define DEFAULT_SCROLLBACK_BYTES    (64*1024)
+#define CLIENT_POOL_MAX     (4096)  // idle clients kept for reuse, the rest are freed
+#define CLIENT_POOLED       (0xa5)  // isActive of a client in the pool, anything else means it was written after release
+#define CLIENT_RELEASE_DEFERRED (1u << 31)  // errorsPending flag, released by the sender once its last error msg is handled
+#define ROOM_POOL_MAX       (1024)  // idle rooms kept for reuse, on top of the dormant ones
+#define MEMBER_TABLE_INIT_LEN   (16)
+#define ZEROCOPY_PIN_INIT_LEN   (FLUSH_IOV_MAX)
+#define ZEROCOPY_REAP_MS        (500)   // backstop for completions the error queue readiness didn't deliver
+#define MEMBER_PREFETCH     (8)     // members ahead of the fan-out scan whose out queue is pulled in
+#define SEQ_PREFIX_LEN      (21)    // room seq stamped ahead of a broadcast, 20 digits and a space
+#define RESUME_HISTORY_MSGS (1024)  // broadcasts each room keeps for resuming sessions, on top of -b
+#define SESSION_BUCKETS     (4096)
 
 typedef struct client_s client_t;
 
 typedef enum {
     BROADCAST_MSG,
+    NOTICE_MSG,     // broadcast but left out of the scrollback, e.g. has joined
     ERROR_MSG,
     NUM_MSG_TYPE,
 } msg_type_t;
 
 typedef struct send_buff_item_s {
-    char msg[MAX_MSG_SIZE];
-    uint16_t size;
+    atomic_uint seq;    // == position+1 once published, position+SEND_BUFF_LEN once free again
+    msg_frame_t* frame;   // formatted once, the ring's reference is dropped after fan-out
     msg_type_t type;
     client_t* client;     // ignored for broadcast msg
 } send_buff_item_t;
 
+// Bounded lock-free ring, many reactor producers and the room's sender task as single consumer
+// The task is only scheduled on its shared sender when it isn't queued already
 typedef struct send_buff_s {
     send_buff_item_t buff[SEND_BUFF_LEN];
-    pthread_mutex_t insertMutex; // only single consumer, so mutex protects writes to buff only
-    sem_t empty;
-    sem_t full;
-    uint8_t insertIdx;
-    uint8_t removeIdx;
+    atomic_uint insertIdx;
+    atomic_uint removeIdx;      // written by the consumer only, atomic so the stats can read it
+    sender_task_t consumer;
 } send_buff_t;
 
+typedef enum {
+    JOIN_PARSE_CMD,
+    JOIN_PARSE_ROOM,
+    JOIN_PARSE_NAME,
+} join_parse_state_t;
+
+// Incremental JOIN parser, resumed on every readiness event
+typedef struct join_parser_s {
+    char buff[JOIN_BUFF_SIZE+1]; // +1 so we can add null char
+    uint16_t len;       // bytes received
+    uint16_t scanIdx;   // bytes already parsed
+    uint16_t fieldIdx;  // start of the field being parsed
+    join_parse_state_t state;
+    uint8_t isResume;   // RESUME token seq, the two fields land in roomName and clientName
+    char* roomName;
+    char* clientName;
+    uint16_t msgLen;    // length of the complete JOIN msg, the rest is chat
+    uint64_t resumeToken;
+    uint64_t resumeSeq; // newest broadcast the client saw before it dropped
+} join_parser_t;
+
+// Frame a zerocopy send took bytes from, its reference is dropped once the kernel is done with the send
+typedef struct zerocopy_pin_s {
+    uint32_t id;
+    msg_frame_t* frame;     // NULL once released, completions may come out of order
+} zerocopy_pin_t;
+
+// Frames pending for one client, the room sender appends and the reactor flushes
+// Each slot holds a reference on a frame shared with the rest of the room
+typedef struct out_queue_s {
+    pthread_mutex_t mutex;  // also guards the client's epoll registration
+    msg_frame_t** frames;   // ring, grows up to the high watermark
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    uint32_t headSent;      // bytes of head already written to the socket
+    uint32_t numInflight;   // io_uring backend, frames from head on pinned by the send in flight
+    uint8_t isFlushPosted;  // io_uring backend, flush task waiting on the reactor
+    uint8_t isClosed;       // io_uring backend, removed while the reactor still held it, freed there
+    zerocopy_pin_t* pins;   // ring, in send order
+    uint32_t pinCapacity;
+    uint32_t pinHead;
+    uint32_t pinCount;
+    uint32_t nextZerocopyId;    // what the kernel numbers the socket's next zerocopy send
+    uint8_t isZerocopyOff;  // the socket can't do it, or the kernel copied anyway and would again
+    uint64_t bytesSent;     // only compared by the send stall check, no clock on the send path
+} out_queue_t;
+
 typedef struct client_s {
     char name[MAX_NAME_LEN+2]; // add space for ':' and ' '
     int fd;
-    struct client_s* next;
-    struct client_s* prev;
-    pthread_t tid;
+    uint32_t memberIdx;     // slot in the room's member table, follows it when members leave
+    struct client_s* next;  // client pool link
+    atomic_uint errorsPending;  // error msgs in the room's ring that point at the client, it can't be released before they are handled
+    reactor_t* reactor;
+    reactor_handle_t handle;
+    reactor_task_t startTask;
+    reactor_deadline_t joinDeadline;
+    join_parser_t joinParser;   // only used until the JOIN completes
+    recv_ring_t recvRing;   // partial message carried between reads
+    out_queue_t outQueue;
+    reactor_task_t flushTask;   // io_uring backend, sends are issued from the reactor thread
+    reactor_send_t sendReq;
+    struct iovec sendIov[FLUSH_IOV_MAX];
+    uint8_t isWatched;  // registered with the reactor
     uint8_t isActive;
+    uint8_t isReadPaused;   // over a rate limit, guarded by the out queue mutex like the registration
+    uint8_t isKicked;   // broke the protocol, its session ends with the connection
+    uint8_t isJoinPending;  // has joined notice not queued yet, the room's ring was full
+    uint64_t sessionToken;  // 0 unless sessions can be resumed
+    token_bucket_t msgBucket;
+    token_bucket_t byteBucket;
+    reactor_deadline_t resumeDeadline;  // reads restart once the tokens are back or the ring has space
+    reactor_deadline_t errorDeadline;   // error msg offered again while the room's ring is full
+    msg_frame_t* errorFrame;
+    reactor_deadline_t livenessDeadline;    // idle, keepalive and send stall checks once joined
+    uint64_t lastRecvMs;    // reactor loop time, nothing is re-armed per read
+    uint64_t lastPingMs;
+    uint64_t stallCheckMs;  // last check that found the out queue empty or moving
+    uint64_t stallCheckBytes;
+    char* heldData;     // io_uring backend, received while paused and more than the recv ring takes
+    uint32_t heldLen;
     send_buff_t* sendBuff;
+    mem_account_t* memAccount;  // the room's, charged for frames and queue slots
+    token_bucket_t* roomMsgBucket;  // the room's, shared by every member
+    token_bucket_t* roomByteBucket;
 } client_t;
 
+typedef enum {
+    MEMBER_LIVE,
+    MEMBER_GONE,    // disconnected during fan-out, skipped until its error msg removes it
+} member_state_t;
+
+// Members in dense parallel arrays so fan-out is a linear scan instead of a pointer chase
+// A leaving member's slot is filled from the tail, the client is the stable handle
+typedef struct member_table_s {
+    client_t** clients;     // out queue owners
+    uint8_t* states;        // member_state_t, 64 members to a cache line
+    uint32_t count;
+    uint32_t capacity;
+} member_table_t;
+
 typedef struct chatroom_s {
     char name[MAX_NAME_LEN+1];
+    uint32_t hash;
     send_buff_t sendBuff;
+    mem_account_t memAccount;
     pthread_mutex_t clientListMutex;
-    client_t* clientList;
-    client_t* clientListTail;
-    pthread_t tid;
-    struct chatroom_s* next;
-    struct chatroom_s* prev;
+    member_table_t members;
+    msg_frame_t* stagedFrames[SEND_BUFF_LEN];   // broadcasts of the current batch, in ring order
+    uint32_t numStaged;
+    fanout_group_t fanoutGroup;
+    atomic_uint_fast64_t msgsOut;   // only written by the sender
+    atomic_uint_fast64_t bytesOut;
+    msg_frame_t** history;      // ring of the newest broadcasts, shares the frames fanned out live
+    uint32_t historyHead;
+    uint32_t historyCount;
+    uint64_t historyBytes;
+    room_log_t* log;            // durable copy of the broadcasts, NULL unless logging to disk
+    token_bucket_t msgBucket;   // what all members together may send
+    token_bucket_t byteBucket;
+    uint64_t lastSeq;           // stamped on the newest broadcast, the history holds the ones right before it
+    atomic_uint numDetached;    // sessions waiting to be resumed, the room is kept until they expire
+    uint8_t isDormant;          // empty and off its sender, waiting to be revived or reclaimed
+    uint64_t dormantSinceMs;
+    struct chatroom_s* hashNext;
 } chatroom_t;
 
+// Lets a dropped client come back within the grace period without a leave and join
+// Held by the connection using it, or detached until it is resumed or expires
+typedef struct session_s {
+    uint64_t token;
+    chatroom_t* room;   // kept alive by the holder's membership or the room's detached count
+    client_t* client;   // holder, NULL while detached
+    char name[MAX_NAME_LEN+1];
+    uint64_t expiresMs;
+    struct session_s* next;
+} session_t;
+
+// Contiguous run of a large room's members, delivered by one fan-out worker
+typedef struct fanout_part_s {
+    fanout_job_t job;
+    chatroom_t* room;
+    uint32_t first;
+    uint32_t numMembers;
+} fanout_part_t;
+
+
+// Room directory, a fixed hash table with chained buckets guarded by striped locks
+// A room is only linked, revived, unlinked or freed while holding its stripe
+static chatroom_t* roomBuckets[ROOM_DIR_BUCKETS];
+static pthread_mutex_t roomStripes[ROOM_DIR_STRIPES] = {
+    [0 ... ROOM_DIR_STRIPES-1] = PTHREAD_MUTEX_INITIALIZER,
+};
+static reactor_task_t sweepTask;
+static reactor_deadline_t sweepDeadline;
+
+// Sessions by token, only touched on joins, leaves and resumes
+// Locked after a room's stripe and its client list
+static struct {
+    pthread_mutex_t mutex;
+    session_t* buckets[SESSION_BUCKETS];
+    uint32_t numDetached;
+} sessions = {PTHREAD_MUTEX_INITIALIZER, {NULL}, 0};
+
+// Released clients and rooms keep their locks and buffers, linked through their next pointers
+static struct {
+    pthread_mutex_t mutex;
+    client_t* head;
+    uint32_t count;
+} clientPool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+static struct {
+    pthread_mutex_t mutex;
+    struct chatroom_s* head;
+    uint32_t count;
+} roomPool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+static chatroom_config_t config = {
+    .slowConsumerPolicy = SLOW_CONSUMER_DISCONNECT,
+    .outQueueHighWatermark = DEFAULT_OUT_QUEUE_HIGH_WATERMARK,
+};
+
+static uint8_t isRateLimited = 0;
+static uint32_t historyLen = 0;     // broadcasts a room keeps, for joiners and resumed sessions
+
+static struct {
+    atomic_uint_fast64_t droppedOldest;
+    atomic_uint_fast64_t droppedNewest;
+    atomic_uint_fast64_t disconnected;
+} slowConsumerStats;
+
+void chatroom_default_config(chatroom_config_t* out)
+{
+    out->slowConsumerPolicy = SLOW_CONSUMER_DISCONNECT;
+    out->outQueueHighWatermark = DEFAULT_OUT_QUEUE_HIGH_WATERMARK;
+    out->isSharded = 0;
+    out->largeRoomThreshold = DEFAULT_LARGE_ROOM_THRESHOLD;
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    out->fanoutWorkers = numCpus < 1 ? 1 : (numCpus > MAX_FANOUT_WORKERS ? MAX_FANOUT_WORKERS : numCpus);
+    out->scrollbackMsgs = 0;
+    out->scrollbackBytes = DEFAULT_SCROLLBACK_BYTES;
+    out->clientMsgRate = 0;
+    out->clientByteRate = 0;
+    out->roomMsgRate = 0;
+    out->roomByteRate = 0;
+    out->roomSenders = numCpus < 1 ? 1 : (numCpus > MAX_SENDERS ? MAX_SENDERS : numCpus);
+    out->zerocopyThreshold = 0;
+    out->idleSecs = 0;
+    out->keepaliveSecs = 0;
+    out->sendStallSecs = DEFAULT_SEND_STALL_SECS;
+    out->resumeGraceSecs = 0;
+}
 
-static chatroom_t* chatroom_list_head = NULL;
-static chatroom_t* chatroom_list_tail = NULL;
+// Call before the first connection
+void chatroom_configure(const chatroom_config_t* in)
+{
+    config = *in;
+    if(config.outQueueHighWatermark == 0) {
+        config.outQueueHighWatermark = 1;
+    }
+    isRateLimited = config.clientMsgRate > 0 || config.clientByteRate > 0 ||
+                    config.roomMsgRate > 0 || config.roomByteRate > 0;
+    historyLen = config.scrollbackMsgs;
+    if(config.resumeGraceSecs > 0 && historyLen < RESUME_HISTORY_MSGS) {
+        historyLen = RESUME_HISTORY_MSGS;
+    }
+}
 
-static void close_chatroom(chatroom_t* room)
+// Bursts of up to a second's worth, and never less than the largest msg
+static void init_rate_limits(token_bucket_t* msgBucket, token_bucket_t* byteBucket, uint32_t msgRate, uint32_t byteRate)
+{
+    token_bucket_init(msgBucket, msgRate, msgRate);
+    token_bucket_init(byteBucket, byteRate, byteRate > MAX_MSG_SIZE ? byteRate : MAX_MSG_SIZE);
+}
+
+void chatroom_get_slow_consumer_stats(slow_consumer_stats_t* stats)
+{
+    stats->droppedOldest = atomic_load_explicit(&slowConsumerStats.droppedOldest, memory_order_relaxed);
+    stats->droppedNewest = atomic_load_explicit(&slowConsumerStats.droppedNewest, memory_order_relaxed);
+    stats->disconnected = atomic_load_explicit(&slowConsumerStats.disconnected, memory_order_relaxed);
+}
+
+// Drop frames nobody picked up, only once no member is left to publish more
+static void drop_send_buff(send_buff_t* sendBuff)
+{
+    uint32_t idx = atomic_load_explicit(&sendBuff->removeIdx, memory_order_relaxed);
+    send_buff_item_t* item = &sendBuff->buff[idx % SEND_BUFF_LEN];
+    while(atomic_load_explicit(&item->seq, memory_order_acquire) == idx+1) {
+        if(item->frame != NULL) {
+            frame_unref(item->frame);
+        }
+        atomic_store_explicit(&item->seq, idx + SEND_BUFF_LEN, memory_order_release);
+        idx++;
+        item = &sendBuff->buff[idx % SEND_BUFF_LEN];
+    }
+    atomic_store_explicit(&sendBuff->removeIdx, idx, memory_order_relaxed);
+}
+
+static void destroy_chatroom(chatroom_t* room)
 {
-    sem_destroy(&room->sendBuff.empty);
-    sem_destroy(&room->sendBuff.full);
+    free(room->members.clients);
+    free(room->members.states);
+    free(room->history);
+    fanout_group_destroy(&room->fanoutGroup);
     pthread_mutex_destroy(&room->clientListMutex);
-    pthread_mutex_destroy(&room->sendBuff.insertMutex);
     free(room);
 }
 
-static void delete_client(client_t* client)
+// Back to the pool with its lock, fan-out group, scrollback and member arrays, the rest is reset on reuse
+static void close_chatroom(chatroom_t* room)
 {
-    close(client->fd);
-    client->isActive = 0;
+    drop_send_buff(&room->sendBuff);
+    if(room->log != NULL) {
+        // Writer holds references charged to this room until then
+        roomlog_release(room->log);
+        room->log = NULL;
+    }
+    for(uint32_t i = 0; i < room->historyCount; i++) {
+        frame_unref(room->history[(room->historyHead+i) % historyLen]);
+    }
+    room->historyCount = 0;
+    if(room->history != NULL) {
+        mem_account_charge(&room->memAccount, -(int64_t)(historyLen * sizeof(msg_frame_t*)));
+    }
+    // Like out queues, the member table only keeps its first allocation
+    member_table_t* members = &room->members;
+    mem_account_charge(&room->memAccount, -(int64_t)(members->capacity * (sizeof(client_t*)+1)));
+    if(members->capacity > MEMBER_TABLE_INIT_LEN) {
+        free(members->clients);
+        free(members->states);
+        members->clients = NULL;
+        members->states = NULL;
+        members->capacity = 0;
+    }
+
+    pthread_mutex_lock(&roomPool.mutex);
+    if(roomPool.count < ROOM_POOL_MAX) {
+        room->hashNext = roomPool.head;
+        roomPool.head = room;
+        roomPool.count++;
+        room = NULL;
+    }
+    pthread_mutex_unlock(&roomPool.mutex);
+
+    if(room != NULL) {
+        destroy_chatroom(room);
+    }
+}
+
+static void destroy_client(client_t* client)
+{
+    free(client->outQueue.frames);
+    pthread_mutex_destroy(&client->outQueue.mutex);
+    recv_ring_free(&client->recvRing);
     free(client);
 }
 
-// room becomes invalidated
-static void remove_chatroom(chatroom_t* room)
+// Client with its out queue lock and recv ring set up, from the pool when there is one
+static client_t* acquire_client(void)
 {
-    if(room == NULL) {
-        return;
+    pthread_mutex_lock(&clientPool.mutex);
+    client_t* client = clientPool.head;
+    if(client != NULL) {
+        clientPool.head = client->next;
+        clientPool.count--;
+    }
+    pthread_mutex_unlock(&clientPool.mutex);
+    if(client != NULL) {
+        if(client->isActive != CLIENT_POOLED) {
+            LOG_ERROR("Pooled client was written after its release");
+        }
+        client->isActive = 0;
+        return client;
     }
 
-    if(room->prev == NULL && room->next == NULL) {
-        // 1 element list
-        chatroom_list_head = NULL;
-        chatroom_list_tail = NULL;
-    } else if(room->prev == NULL) {
-        // room is pointing to head
-        chatroom_list_head = room->next;
-        room->next->prev = NULL;
-    } else if(room->next == NULL) {
-        // room is pointing to tail
-        chatroom_list_tail = room->prev;
-        room->prev->next = NULL;
-    } else {
-        room->prev->next = room->next;
-        room->next->prev = room->prev;
+    client = (client_t*)calloc(1, sizeof(client_t));
+    if(client == NULL) {
+        return NULL;
+    }
+    if(pthread_mutex_init(&client->outQueue.mutex, NULL) != 0) {
+        free(client);
+        return NULL;
+    }
+    if(recv_ring_init(&client->recvRing, RECV_RING_SIZE) != 0) {
+        pthread_mutex_destroy(&client->outQueue.mutex);
+        free(client);
+        return NULL;
     }
 
-    close_chatroom(room);
+    return client;
 }
 
-// Return NULL if none found
-static chatroom_t* find_chatroom(char* name)
+// Drop what the connection held and put the client back in the pool
+// The out queue keeps its first allocation, anything it grew past that is freed
+// Deferred while an error msg still points at the client, the sender then removes and releases it
+static void release_client(client_t* client)
 {
-    if(chatroom_list_head == NULL) {
-        return NULL;
+    if(atomic_fetch_or_explicit(&client->errorsPending, CLIENT_RELEASE_DEFERRED, memory_order_acq_rel) & ~CLIENT_RELEASE_DEFERRED) {
+        return;
+    }
+    atomic_store_explicit(&client->errorsPending, 0, memory_order_relaxed);
+    client->isActive = 0;
+    out_queue_t* queue = &client->outQueue;
+    for(uint32_t i = 0; i < queue->count; i++) {
+        frame_unref(queue->frames[(queue->head+i) % queue->capacity]);
     }
+    mem_account_charge(client->memAccount, -(int64_t)(queue->capacity * sizeof(msg_frame_t*)));
+    if(queue->capacity > OUT_QUEUE_INIT_LEN) {
+        free(queue->frames);
+        queue->frames = NULL;
+        queue->capacity = 0;
+    }
+    queue->head = 0;
+    queue->count = 0;
+    queue->headSent = 0;
+    queue->numInflight = 0;
+    queue->isFlushPosted = 0;
+    queue->isClosed = 0;
+    // The socket is closed, whatever it still had in flight goes with it
+    for(uint32_t i = 0; i < queue->pinCount; i++) {
+        msg_frame_t* frame = queue->pins[(queue->pinHead+i) % queue->pinCapacity].frame;
+        if(frame != NULL) {
+            frame_unref(frame);
+        }
+    }
+    mem_account_charge(client->memAccount, -(int64_t)(queue->pinCapacity * sizeof(zerocopy_pin_t)));
+    free(queue->pins);
+    queue->pins = NULL;
+    queue->pinCapacity = 0;
+    queue->pinHead = 0;
+    queue->pinCount = 0;
+    queue->nextZerocopyId = 0;
+    queue->isZerocopyOff = 0;
+    queue->bytesSent = 0;
+    free(client->heldData);
+    client->heldData = NULL;
+    client->heldLen = 0;
+    recv_ring_reset(&client->recvRing);
+    memset(&client->joinParser, 0, sizeof(client->joinParser));
+    memset(&client->handle, 0, sizeof(client->handle));
+    memset(&client->joinDeadline, 0, sizeof(client->joinDeadline));
+    memset(&client->resumeDeadline, 0, sizeof(client->resumeDeadline));
+    memset(&client->errorDeadline, 0, sizeof(client->errorDeadline));
+    client->errorFrame = NULL;
+    memset(&client->livenessDeadline, 0, sizeof(client->livenessDeadline));
+    client->isWatched = 0;
+    client->isReadPaused = 0;
+    client->isKicked = 0;
+    client->isJoinPending = 0;
+    client->sessionToken = 0;
+    client->memAccount = NULL;
+
+    pthread_mutex_lock(&clientPool.mutex);
+    if(clientPool.count < CLIENT_POOL_MAX) {
+        client->isActive = CLIENT_POOLED;
+        client->next = clientPool.head;
+        clientPool.head = client;
+        clientPool.count++;
+        client = NULL;
+    }
+    pthread_mutex_unlock(&clientPool.mutex);
 
-    chatroom_t* it = chatroom_list_head;
-    // insert new chatroom in list
-    while(it != NULL) {
-        // Check if active chatroom with matching name exists
-        if(strcmp(name, it->name) == 0 && it->clientList != NULL) {
-            // Found active chatroom
-            break;
+    if(client != NULL) {
+        destroy_client(client);
+    }
+}
+
+static void free_client(client_t* client)
+{
+    close(client->fd);
+    release_client(client);
+}
+
+static void delete_client(client_t* client)
+{
+    if(reactor_backend() == REACTOR_BACKEND_URING) {
+        // A send in flight still points into the queue, the reactor frees the client once it completes
+        out_queue_t* queue = &client->outQueue;
+        pthread_mutex_lock(&queue->mutex);
+        if(queue->numInflight > 0 || queue->isFlushPosted) {
+            queue->isClosed = 1;
+            client->isActive = 0;
+            // Fails a send parked on a full socket
+            shutdown(client->fd, SHUT_RDWR);
+            pthread_mutex_unlock(&queue->mutex);
+            return;
         }
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    free_client(client);
+}
+
+// FNV-1a
+static uint32_t hash_room_name(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    while(*name != '\0') {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Shard that owns the room's members and sender in sharded mode
+static reactor_t* room_shard(uint32_t hash)
+{
+    return reactor_get(hash % reactor_count());
+}
+
+static pthread_mutex_t* room_stripe(uint32_t hash)
+{
+    return &roomStripes[hash % ROOM_DIR_STRIPES];
+}
+
+static chatroom_t** room_bucket(uint32_t hash)
+{
+    return &roomBuckets[hash % ROOM_DIR_BUCKETS];
+}
 
-        // If dormant chatroom, delete it
-        if(it->clientList == NULL) {
-            chatroom_t* remove = it;
-            it = it->next;
-            remove_chatroom(remove);
-            close_chatroom(remove);
+static uint8_t is_reclaimable(chatroom_t* room, uint64_t now)
+{
+    return room->isDormant && now - room->dormantSinceMs >= ROOM_LINGER_MS &&
+           atomic_load_explicit(&room->numDetached, memory_order_relaxed) == 0;
+}
+
+// Unlink and free lingering dormant rooms in one bucket
+// Caller holds the bucket's stripe
+static void reclaim_bucket(chatroom_t** bucket, uint64_t now)
+{
+    chatroom_t** link = bucket;
+    while(*link != NULL) {
+        chatroom_t* room = *link;
+        if(is_reclaimable(room, now)) {
+            *link = room->hashNext;
+            close_chatroom(room);
         } else {
-            it = it->next;
+            link = &room->hashNext;
+        }
+    }
+}
+
+// Return NULL if none found, dormant rooms are returned so they can be revived
+// Caller holds the stripe for hash
+static chatroom_t* find_chatroom(char* name, uint32_t hash)
+{
+    chatroom_t** bucket = room_bucket(hash);
+    reclaim_bucket(bucket, reactor_now_ms());
+
+    chatroom_t* it = *bucket;
+    while(it != NULL) {
+        if(it->hash == hash && strcmp(name, it->name) == 0) {
+            break;
         }
+        it = it->hashNext;
     }
     
     return it;
 }
 
-static void insert_left_room_msg(chatroom_t* room, char* name)
+// The reactor must not touch the client afterwards
+// Reactor thread only
+static void stop_watching(client_t* client)
 {
-    if(sem_wait(&room->sendBuff.empty) < 0) {
-        printf("ERROR: Failed to wait on empty sem room %s\n", room->name);
-        return;
+    reactor_deadline_cancel(client->reactor, &client->resumeDeadline);
+    reactor_deadline_cancel(client->reactor, &client->livenessDeadline);
+    pthread_mutex_lock(&client->outQueue.mutex);
+    if(client->isWatched) {
+        reactor_del(client->reactor, &client->handle);
+        client->isWatched = 0;
     }
+    pthread_mutex_unlock(&client->outQueue.mutex);
+}
 
-    pthread_mutex_lock(&room->sendBuff.insertMutex);
-    uint8_t idx = room->sendBuff.insertIdx;
-    send_buff_item_t* item = &room->sendBuff.buff[idx];
-    char* insert = item->msg;
-    
-    // Construct message "user: msg"
-    strcpy(insert, name);
-    insert += strlen(name);
-    strcpy(insert, " has left\n");
-    
-    item->type = BROADCAST_MSG;
-    item->size = strlen(item->msg);
-    room->sendBuff.insertIdx = (idx+1)%SEND_BUFF_LEN;
-    pthread_mutex_unlock(&room->sendBuff.insertMutex);
+// Wake the reactor with EOF, it queues the error msg that removes the client
+static void disconnect_client(client_t* client)
+{
+    client->isActive = 0;
+    shutdown(client->fd, SHUT_RDWR);
+}
 
-    if(sem_post(&room->sendBuff.full) < 0) {
-        printf("ERROR: Failed to wait on empty sem room %s\n", room->name);
-        return;
+// Retire every frame that went out in full
+// Caller holds the out queue mutex
+static void retire_sent(out_queue_t* queue, size_t numBytes)
+{
+    queue->bytesSent += numBytes;
+    size_t remaining = numBytes;
+    while(remaining > 0) {
+        msg_frame_t* frame = queue->frames[queue->head];
+        size_t unsent = frame->size - queue->headSent;
+        if(remaining < unsent) {
+            queue->headSent += remaining;
+            break;
+        }
+        remaining -= unsent;
+        queue->head = (queue->head+1) % queue->capacity;
+        queue->count--;
+        queue->headSent = 0;
+        frame_unref(frame);
     }
 }
 
-// client becomes invalidated
-static void remove_client(client_t* client, chatroom_t* room)
+// Release the frames of every send in lo..hi
+static void release_zerocopy_pins(uint32_t lo, uint32_t hi, uint8_t isCopied, void* ctx)
 {
-    if(client == NULL) {
-        return;
+    out_queue_t* queue = &((client_t*)ctx)->outQueue;
+    for(uint32_t i = 0; i < queue->pinCount; i++) {
+        zerocopy_pin_t* pin = &queue->pins[(queue->pinHead+i) % queue->pinCapacity];
+        if((int32_t)(pin->id - hi) > 0) {
+            break;
+        }
+        if(pin->frame != NULL && (int32_t)(pin->id - lo) >= 0) {
+            frame_unref(pin->frame);
+            pin->frame = NULL;
+        }
+    }
+    while(queue->pinCount > 0 && queue->pins[queue->pinHead].frame == NULL) {
+        queue->pinHead = (queue->pinHead+1) % queue->pinCapacity;
+        queue->pinCount--;
     }
 
-    if(client->prev == NULL && client->next == NULL) {
-        // 1 element list
-        room->clientList = NULL;
-        room->clientListTail = NULL;
-    } else if(client->prev == NULL) {
-        // client is pointing to head
-        room->clientList = client->next;
-        client->next->prev = NULL;
-    } else if(room->next == NULL) {
-        // room is pointing to tail
-        room->clientListTail = client->prev;
-        client->prev->next = NULL;
-    } else {
-        client->prev->next = client->next;
-        client->next->prev = client->prev;
+    // Copying after pinning is slower than a plain send, e.g. over loopback
+    if(isCopied) {
+        queue->isZerocopyOff = 1;
+        metrics_add(METRIC_ZEROCOPY_COPIED, hi-lo+1);
     }
+}
 
-    // If there are remaining clients, send the "left room" msg
-    if(room->clientList != NULL) {
-        insert_left_room_msg(room, client->name);
+// Caller holds the out queue mutex
+static int32_t reap_zerocopy(client_t* client)
+{
+    if(client->outQueue.pinCount == 0) {
+        return 0;
     }
+    return zerocopy_reap(client->fd, release_zerocopy_pins, client);
+}
 
-    delete_client(client);
+// Room for numPins more pins, so a zerocopy send never has to be followed by a failed allocation
+// Caller holds the out queue mutex
+static int8_t reserve_zerocopy_pins(out_queue_t* queue, uint32_t numPins, mem_account_t* account)
+{
+    if(queue->pinCapacity - queue->pinCount >= numPins) {
+        return 0;
+    }
+
+    uint32_t capacity = queue->pinCapacity == 0 ? ZEROCOPY_PIN_INIT_LEN : queue->pinCapacity*2;
+    while(capacity - queue->pinCount < numPins) {
+        capacity *= 2;
+    }
+    zerocopy_pin_t* pins = (zerocopy_pin_t*)malloc(capacity * sizeof(zerocopy_pin_t));
+    if(pins == NULL) {
+        return -1;
+    }
+
+    // Unwrap the ring so head starts at 0
+    for(uint32_t i = 0; i < queue->pinCount; i++) {
+        pins[i] = queue->pins[(queue->pinHead+i) % queue->pinCapacity];
+    }
+    free(queue->pins);
+    mem_account_charge(account, (int64_t)(capacity - queue->pinCapacity) * sizeof(zerocopy_pin_t));
+    queue->pins = pins;
+    queue->pinCapacity = capacity;
+    queue->pinHead = 0;
+
+    return 0;
 }
 
-void* chatroom_sender(void* input)
+// Pin every frame the zerocopy send took bytes from, before retire_sent drops the queue's references
+// Caller holds the out queue mutex
+static void pin_zerocopy_sent(out_queue_t* queue, size_t numBytes)
 {
-    chatroom_t* room = (chatroom_t*)input;
+    uint32_t id = queue->nextZerocopyId++;
+    size_t remaining = numBytes;
+    for(uint32_t i = 0; remaining > 0; i++) {
+        msg_frame_t* frame = queue->frames[(queue->head+i) % queue->capacity];
+        size_t unsent = frame->size - (i == 0 ? queue->headSent : 0);
+        remaining -= remaining < unsent ? remaining : unsent;
+
+        frame_ref(frame);
+        zerocopy_pin_t* pin = &queue->pins[(queue->pinHead+queue->pinCount) % queue->pinCapacity];
+        pin->id = id;
+        pin->frame = frame;
+        queue->pinCount++;
+    }
+    metrics_add(METRIC_ZEROCOPY_BYTES, numBytes);
+}
 
-    while(1) {        
-        // Pick up new messages from the buffer
-        if(sem_wait(&room->sendBuff.full) < 0) {
-            printf("ERROR: Failed to wait on empty sem client in room %s\n", room->name);
-            return NULL;
-        }
-        uint8_t idx = room->sendBuff.removeIdx;
-        send_buff_item_t* item = &room->sendBuff.buff[idx];
-
-        if(item->type == ERROR_MSG) {
-            if(item->client->isActive == 1) {
-                // Send error message to specified client
-                if(send(item->client->fd, item->msg, item->size, MSG_NOSIGNAL) != 0) {
-                    int err = errno; 
-                    printf("ERROR: Failed to send error msg on socket to client in room %s with err=%d\n", 
-                            room->name, err);
-                    pthread_cancel(item->client->tid);
-                    remove_client(item->client, room);
-                }
+static uint8_t is_zerocopy_frame(msg_frame_t* frame)
+{
+    return config.zerocopyThreshold > 0 && frame->size >= config.zerocopyThreshold;
+}
+
+// Write as much of the queue as the socket takes
+// Large frames go out zerocopy and the rest copied, never mixed in one sendmsg
+// MSG_MORE on all but the last sendmsg packs small lines into full segments
+// Caller holds the out queue mutex
+// Returns -1 if the socket failed
+static int8_t flush_out_queue(client_t* client)
+{
+    out_queue_t* queue = &client->outQueue;
+    struct iovec iov[FLUSH_IOV_MAX];
+    // Frames the kernel is done with are released before more get pinned
+    reap_zerocopy(client);
+    uint8_t canZerocopy = config.zerocopyThreshold > 0 && !queue->isZerocopyOff;
+    while(queue->count > 0) {
+        // Gather from the partially written head onwards
+        uint32_t maxIov = queue->count < FLUSH_IOV_MAX ? queue->count : FLUSH_IOV_MAX;
+        uint8_t isZerocopy = canZerocopy && is_zerocopy_frame(queue->frames[queue->head]);
+        if(isZerocopy && reserve_zerocopy_pins(queue, maxIov, client->memAccount) != 0) {
+            // Only as many frames as there are free pins, the rest go out with the next sendmsg
+            uint32_t freePins = queue->pinCapacity - queue->pinCount;
+            if(freePins > 0) {
+                maxIov = freePins;
             } else {
-                remove_client(item->client, room);
+                isZerocopy = 0;
             }
-            
-        } else if(item->type == BROADCAST_MSG) {
-            // Iterate through the client list and broadcast to all clients
-            pthread_mutex_lock(&room->clientListMutex);
-            client_t* it = room->clientList;
-            while(it != NULL) {
-                if(it->isActive == 1) {
-                    if(send(it->fd, item->msg, item->size, MSG_NOSIGNAL) < 0) {
-                        int err = errno; 
-                        printf("ERROR: Failed to send msg on socket to client %s in room %s with err=%d\n", 
-                            it->name, room->name, err);
-                        // Close the client
-                        pthread_cancel(it->tid);
-                        remove_client(it, room);
-                        it = it->next;
-                        continue;
-                    }
-                } else {
-                    // Client disconnected, delete it
-                    remove_client(it, room);
-                    it = it->next;
-                    continue;
-                }
-                it = it->next;            
+        }
+        uint32_t numIov = 0;
+        size_t totalSize = 0;
+        for(; numIov < maxIov; numIov++) {
+            msg_frame_t* frame = queue->frames[(queue->head+numIov) % queue->capacity];
+            if(canZerocopy && numIov > 0 && is_zerocopy_frame(frame) != isZerocopy) {
+                break;
             }
-            pthread_mutex_unlock(&room->clientListMutex);
+            uint32_t offset = numIov == 0 ? queue->headSent : 0;
+            iov[numIov].iov_base = frame->data + offset;
+            iov[numIov].iov_len = frame->size - offset;
+            totalSize += iov[numIov].iov_len;
         }
-        
-        room->sendBuff.removeIdx = (idx+1)%SEND_BUFF_LEN;
-        if(sem_post(&room->sendBuff.empty) < 0) {
-            printf("ERROR: Failed to wait on empty sem client in room %s\n", room->name);
-            break;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = numIov;
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        if(queue->count > numIov) {
+            flags |= MSG_MORE;
+        }
+        if(isZerocopy) {
+            flags |= MSG_ZEROCOPY;
+        }
+        ssize_t numBytes = sendmsg(client->fd, &msg, flags);
+        if(numBytes < 0) {
+            int err = errno;
+            if(err == EAGAIN || err == EWOULDBLOCK) {
+                break;
+            } else if(err == EINTR) {
+                continue;
+            } else if(err == ENOBUFS && isZerocopy) {
+                // Out of option memory for pending completions, copy until the next flush
+                canZerocopy = 0;
+                continue;
+            }
+            LOG_ERROR("Failed to send msg on socket to client %s with err=%d", client->name, err);
+            return -1;
+        }
+
+        metrics_add(METRIC_BYTES_SENT, numBytes);
+        if(isZerocopy && numBytes > 0) {
+            pin_zerocopy_sent(queue, (size_t)numBytes);
         }
+        retire_sent(queue, (size_t)numBytes);
 
-        // Check if there are remaining clients
-        if(room->clientList == NULL) {
-            // No more client, exit
+        if((size_t)numBytes < totalSize) {
+            // Socket is full
             break;
         }
     }
-    remove_chatroom(room);
-    return NULL;
+
+    return 0;
+}
+
+// io_uring backend, hand the front of a backed up queue to the reactor as one blocking sendmsg
+// Runs on the reactor thread, caller holds the out queue mutex
+static void submit_send(client_t* client)
+{
+    out_queue_t* queue = &client->outQueue;
+    uint32_t numIov = queue->count < FLUSH_IOV_MAX ? queue->count : FLUSH_IOV_MAX;
+    for(uint32_t i = 0; i < numIov; i++) {
+        msg_frame_t* frame = queue->frames[(queue->head+i) % queue->capacity];
+        uint32_t offset = i == 0 ? queue->headSent : 0;
+        client->sendIov[i].iov_base = frame->data + offset;
+        client->sendIov[i].iov_len = frame->size - offset;
+    }
+    memset(&client->sendReq.msg, 0, sizeof(client->sendReq.msg));
+    client->sendReq.msg.msg_iov = client->sendIov;
+    client->sendReq.msg.msg_iovlen = numIov;
+    // The completion submits the rest right away
+    client->sendReq.flags = queue->count > numIov ? MSG_MORE : 0;
+    queue->numInflight = numIov;
+    reactor_send(client->reactor, &client->sendReq);
+}
+
+// Send completion, frames the room queued meanwhile go out with the next one
+static void client_sent(reactor_t* reactor, void* ctx, int32_t result)
+{
+    client_t* client = (client_t*)ctx;
+    out_queue_t* queue = &client->outQueue;
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->numInflight = 0;
+    if(queue->isClosed) {
+        uint8_t isDone = !queue->isFlushPosted;
+        pthread_mutex_unlock(&queue->mutex);
+        if(isDone) {
+            free_client(client);
+        }
+        return;
+    }
+
+    int8_t failed = 0;
+    if(result == -EAGAIN || result == -EINTR) {
+        submit_send(client);
+    } else if(result < 0) {
+        LOG_ERROR("Failed to send msg on socket to client %s with err=%d", client->name, -result);
+        failed = 1;
+    } else {
+        metrics_add(METRIC_BYTES_SENT, result);
+        retire_sent(queue, (size_t)result);
+        if(queue->count > 0) {
+            submit_send(client);
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if(failed) {
+        disconnect_client(client);
+    }
+}
+
+// Posted by watch_writable, runs on the client's reactor
+static void flush_client(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
+    out_queue_t* queue = &client->outQueue;
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->isFlushPosted = 0;
+    if(queue->isClosed) {
+        uint8_t isDone = queue->numInflight == 0;
+        pthread_mutex_unlock(&queue->mutex);
+        if(isDone) {
+            free_client(client);
+        }
+        return;
+    }
+    if(queue->numInflight == 0 && queue->count > 0) {
+        submit_send(client);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// The socket backed up and the reactor finishes the job, either on EPOLLOUT or with a parked io_uring send
+// Caller holds the out queue mutex
+static uint8_t is_waiting_writable(client_t* client)
+{
+    if(reactor_backend() == REACTOR_BACKEND_URING) {
+        return client->outQueue.numInflight > 0 || client->outQueue.isFlushPosted;
+    }
+    return (client->handle.events & EPOLLOUT) != 0;
+}
+
+// Epoll events for the client, reads are left out while it is rate limited
+// Caller holds the out queue mutex
+static uint32_t client_events(client_t* client, uint8_t writable)
+{
+    uint32_t events = client->isReadPaused ? 0 : CLIENT_EVENTS;
+    return writable ? (events | EPOLLOUT) : events;
+}
+
+// Caller holds the client's out queue mutex
+static void watch_writable(client_t* client, uint8_t enable)
+{
+    if(reactor_backend() == REACTOR_BACKEND_URING) {
+        // The send parks in the kernel until the socket drains, no readiness round trip
+        out_queue_t* queue = &client->outQueue;
+        if(enable && !is_waiting_writable(client)) {
+            queue->isFlushPosted = 1;
+            reactor_post(client->reactor, &client->flushTask);
+        }
+        return;
+    }
+
+    uint32_t events = client_events(client, enable);
+    if(client->isWatched && client->handle.events != events) {
+        reactor_mod(client->reactor, &client->handle, events);
+    }
+}
+
+// Make room in a full queue according to the slow consumer policy
+// Caller holds the out queue mutex
+// Returns 1 if the new msg should be dropped, -1 if the client should be disconnected
+static int8_t apply_slow_consumer_policy(client_t* client)
+{
+    out_queue_t* queue = &client->outQueue;
+    switch(config.slowConsumerPolicy) {
+    case SLOW_CONSUMER_DROP_OLDEST: {
+        // A partially written head, or the frames of a send in flight, have to finish
+        // or the stream gets corrupted
+        uint32_t pinned = queue->numInflight > 0 ? queue->numInflight : (queue->headSent != 0);
+        if(queue->count <= pinned) {
+            atomic_fetch_add_explicit(&slowConsumerStats.droppedNewest, 1, memory_order_relaxed);
+            return 1;
+        }
+        // Slide the pinned run one slot forward over the victim
+        msg_frame_t* dropped = queue->frames[(queue->head+pinned) % queue->capacity];
+        for(uint32_t i = pinned; i > 0; i--) {
+            queue->frames[(queue->head+i) % queue->capacity] = queue->frames[(queue->head+i-1) % queue->capacity];
+        }
+        queue->frames[queue->head] = dropped;
+        frame_unref(queue->frames[queue->head]);
+        queue->head = (queue->head+1) % queue->capacity;
+        queue->count--;
+        atomic_fetch_add_explicit(&slowConsumerStats.droppedOldest, 1, memory_order_relaxed);
+        return 0;
+    }
+    case SLOW_CONSUMER_DROP_NEWEST:
+        atomic_fetch_add_explicit(&slowConsumerStats.droppedNewest, 1, memory_order_relaxed);
+        return 1;
+    default:
+        atomic_fetch_add_explicit(&slowConsumerStats.disconnected, 1, memory_order_relaxed);
+        LOG_WARN("Disconnecting slow client %s with %u queued msgs", client->name, queue->count);
+        return -1;
+    }
+}
+
+// Caller holds the out queue mutex
+static int8_t grow_out_queue(out_queue_t* queue, mem_account_t* account)
+{
+    uint32_t capacity = queue->capacity == 0 ? OUT_QUEUE_INIT_LEN : queue->capacity*2;
+    msg_frame_t** frames = (msg_frame_t**)malloc(capacity * sizeof(msg_frame_t*));
+    if(frames == NULL) {
+        return -1;
+    }
+
+    // Unwrap the ring so head starts at 0
+    for(uint32_t i = 0; i < queue->count; i++) {
+        frames[i] = queue->frames[(queue->head+i) % queue->capacity];
+    }
+    free(queue->frames);
+    mem_account_charge(account, (int64_t)(capacity - queue->capacity) * sizeof(msg_frame_t*));
+    queue->frames = frames;
+    queue->capacity = capacity;
+    queue->head = 0;
+
+    return 0;
+}
+
+// Queue a shared frame for the client
+// Caller holds the out queue mutex
+// Returns -1 if the client should be disconnected
+static int8_t enqueue_client_frame(client_t* client, msg_frame_t* frame)
+{
+    out_queue_t* queue = &client->outQueue;
+    if(queue->count >= config.outQueueHighWatermark) {
+        int8_t ret = apply_slow_consumer_policy(client);
+        if(ret != 0) {
+            return ret < 0 ? -1 : 0;
+        }
+    }
+
+    if(queue->count == queue->capacity && grow_out_queue(queue, client->memAccount) != 0) {
+        // No memory for a bigger queue, so it is full as far as the policy goes
+        LOG_ERROR("Failed to grow out queue for client %s", client->name);
+        int8_t ret = apply_slow_consumer_policy(client);
+        if(ret != 0) {
+            return ret < 0 ? -1 : 0;
+        }
+    }
+
+    frame_ref(frame);
+    queue->frames[(queue->head+queue->count) % queue->capacity] = frame;
+    queue->count++;
+
+    return 0;
+}
+
+// Queue the whole batch on one member and write it out with one sendmsg
+// Clients whose socket backed up are left to their reactor
+// Returns -1 if the client was disconnected
+static int8_t deliver_frames(client_t* client, msg_frame_t** frames, uint32_t numFrames)
+{
+    // Inactive clients are removed when their error msg is picked up
+    if(client->isActive != 1) {
+        return 0;
+    }
+
+    out_queue_t* queue = &client->outQueue;
+    pthread_mutex_lock(&queue->mutex);
+    int8_t ret = 0;
+    for(uint32_t i = 0; i < numFrames && ret == 0; i++) {
+        ret = enqueue_client_frame(client, frames[i]);
+    }
+    metrics_add(METRIC_FRAMES_QUEUED, numFrames);
+    if(ret == 0 && queue->count > 0 && !is_waiting_writable(client)) {
+        ret = flush_out_queue(client);
+        // Let the reactor finish the job once the socket drains
+        watch_writable(client, queue->count > 0);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if(ret != 0) {
+        disconnect_client(client);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs on a fan-out worker or the sender, each member is in exactly one partition per batch
+// so the partition's slots of the state array are only written here
+static void deliver_partition(void* ctx)
+{
+    fanout_part_t* part = (fanout_part_t*)ctx;
+    member_table_t* members = &part->room->members;
+    uint32_t end = part->first + part->numMembers;
+    for(uint32_t i = part->first; i < end; i++) {
+        if(i + MEMBER_PREFETCH < end) {
+            __builtin_prefetch(&members->clients[i+MEMBER_PREFETCH]->outQueue);
+        }
+        if(members->states[i] != MEMBER_LIVE) {
+            continue;
+        }
+        if(deliver_frames(members->clients[i], part->room->stagedFrames, part->room->numStaged) != 0) {
+            members->states[i] = MEMBER_GONE;
+        }
+    }
+}
+
+// Hand the staged frames to every member, split across the fan-out workers for large rooms
+// Returns only once every member has them, so the next batch can't overtake this one
+// Caller holds clientListMutex
+static void deliver_staged(chatroom_t* room)
+{
+    if(room->numStaged == 0) {
+        return;
+    }
+
+    uint32_t numMembers = room->members.count;
+    uint32_t numParts = 1;
+    if(numMembers >= config.largeRoomThreshold) {
+        numParts = (numMembers + FANOUT_MIN_PARTITION-1) / FANOUT_MIN_PARTITION;
+        if(numParts > fanout_num_workers()+1) {
+            numParts = fanout_num_workers()+1;
+        }
+    }
+
+    fanout_part_t parts[FANOUT_MAX_PARTS];
+    uint32_t perPart = (numMembers + numParts-1) / numParts;
+    uint32_t first = 0;
+    for(uint32_t i = 0; i < numParts; i++) {
+        parts[i].room = room;
+        parts[i].first = first;
+        parts[i].numMembers = numMembers - first < perPart ? numMembers - first : perPart;
+        first += parts[i].numMembers;
+        parts[i].job.fn = deliver_partition;
+        parts[i].job.ctx = &parts[i];
+        if(i > 0) {
+            fanout_submit(&room->fanoutGroup, &parts[i].job);
+        }
+    }
+
+    // Sender takes the first partition itself
+    deliver_partition(&parts[0]);
+    if(numParts > 1) {
+        fanout_wait(&room->fanoutGroup);
+    }
+
+    for(uint32_t i = 0; i < room->numStaged; i++) {
+        frame_unref(room->stagedFrames[i]);
+    }
+    room->numStaged = 0;
+}
+
+// Caller holds clientListMutex
+static void broadcast_frame(chatroom_t* room, msg_frame_t* frame)
+{
+    if(room->numStaged == SEND_BUFF_LEN) {
+        deliver_staged(room);
+    }
+
+    frame_ref(frame);
+    room->stagedFrames[room->numStaged++] = frame;
+}
+
+// Keep a reference for joiners, evicting the oldest past either cap
+// Caller holds clientListMutex
+static void record_history(chatroom_t* room, msg_frame_t* frame)
+{
+    if(room->history == NULL) {
+        return;
+    }
+
+    if(room->historyCount == historyLen) {
+        msg_frame_t* oldest = room->history[room->historyHead];
+        room->historyBytes -= oldest->size;
+        room->historyHead = (room->historyHead+1) % historyLen;
+        room->historyCount--;
+        frame_unref(oldest);
+    }
+
+    frame_ref(frame);
+    room->history[(room->historyHead+room->historyCount) % historyLen] = frame;
+    room->historyCount++;
+    room->historyBytes += frame->size;
+
+    while(room->historyCount > 0 && room->historyBytes > config.scrollbackBytes) {
+        msg_frame_t* oldest = room->history[room->historyHead];
+        room->historyBytes -= oldest->size;
+        room->historyHead = (room->historyHead+1) % historyLen;
+        room->historyCount--;
+        frame_unref(oldest);
+    }
+}
+
+// Most of the history a member can be sent, leaving it headroom under the slow consumer limit
+// Caller holds clientListMutex
+static uint32_t replayable_history(chatroom_t* room)
+{
+    uint32_t maxFrames = config.outQueueHighWatermark/2;
+    return room->historyCount < maxFrames ? room->historyCount : maxFrames;
+}
+
+// Queue the newest msgs of the history ahead of anything the member gets live, it goes out with the first flush
+// Scrollback for a joiner, what a resumed session missed
+// Caller holds clientListMutex so no batch is half delivered
+static void replay_history(client_t* client, chatroom_t* room, uint64_t numFrames)
+{
+    if(numFrames > replayable_history(room)) {
+        numFrames = replayable_history(room);
+    }
+    if(numFrames == 0) {
+        return;
+    }
+
+    out_queue_t* queue = &client->outQueue;
+    uint32_t first = room->historyHead + room->historyCount - numFrames;
+    pthread_mutex_lock(&queue->mutex);
+    for(uint32_t i = 0; i < numFrames; i++) {
+        enqueue_client_frame(client, room->history[(first+i) % historyLen]);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static session_t** session_bucket(uint64_t token)
+{
+    return &sessions.buckets[token % SESSION_BUCKETS];
+}
+
+// Caller holds the sessions mutex
+static session_t* find_session(uint64_t token)
+{
+    session_t* it = *session_bucket(token);
+    while(it != NULL && it->token != token) {
+        it = it->next;
+    }
+
+    return it;
+}
+
+// Caller holds the sessions mutex
+static void unlink_session(session_t* session)
+{
+    session_t** link = session_bucket(session->token);
+    while(*link != session) {
+        link = &(*link)->next;
+    }
+    *link = session->next;
+}
+
+// Start a session held by the joining client, it resumes with the token
+// A client that doesn't get one can still chat, it just can't resume
+// Caller holds clientListMutex
+static void open_session(client_t* client, chatroom_t* room)
+{
+    session_t* session = (session_t*)calloc(1, sizeof(session_t));
+    if(session == NULL) {
+        LOG_ERROR("Failed to allocate session for client %s", client->name);
+        return;
+    }
+    if(getrandom(&session->token, sizeof(session->token), 0) != sizeof(session->token)) {
+        int err = errno;
+        LOG_ERROR("Failed to draw session token for client %s with err=%d", client->name, err);
+        free(session);
+        return;
+    }
+    session->room = room;
+    session->client = client;
+    strcpy(session->name, client->name);
+
+    pthread_mutex_lock(&sessions.mutex);
+    // 0 means no session, a zero or repeated draw is one in 2^64 and just goes without
+    if(session->token == 0 || find_session(session->token) != NULL) {
+        pthread_mutex_unlock(&sessions.mutex);
+        free(session);
+        return;
+    }
+    session_t** bucket = session_bucket(session->token);
+    session->next = *bucket;
+    *bucket = session;
+    pthread_mutex_unlock(&sessions.mutex);
+
+    client->sessionToken = session->token;
+}
+
+// Queued for the member alone, ahead of any replay
+// Caller holds clientListMutex
+static void send_member_msg(client_t* client, const char* msg, uint32_t len)
+{
+    msg_frame_t* frame = frame_alloc(len, client->memAccount);
+    if(frame == NULL) {
+        LOG_ERROR("Failed to allocate msg for client %s", client->name);
+        return;
+    }
+    memcpy(frame->data, msg, len);
+
+    pthread_mutex_lock(&client->outQueue.mutex);
+    enqueue_client_frame(client, frame);
+    pthread_mutex_unlock(&client->outQueue.mutex);
+    frame_unref(frame);
+}
+
+// The member's token and the seq it is caught up to
+// Caller holds clientListMutex
+static void send_session_msg(client_t* client, chatroom_t* room)
+{
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), SESSION_MSG " %016" PRIx64 " %" PRIu64 "\n", client->sessionToken, room->lastSeq);
+    send_member_msg(client, msg, len);
+}
+
+// How many msgs a resumed member is replayed
+// If the history no longer reaches back to lastSeq it is told which seqs it lost with "GAP first last"
+// and gets the scrollback a joiner would instead
+// Caller holds clientListMutex
+static uint64_t resume_replay_len(client_t* client, chatroom_t* room, uint64_t lastSeq)
+{
+    uint64_t numMissed = lastSeq < room->lastSeq ? room->lastSeq - lastSeq : 0;
+    if(numMissed <= replayable_history(room)) {
+        return numMissed;
+    }
+
+    uint64_t numFrames = config.scrollbackMsgs < replayable_history(room) ? config.scrollbackMsgs : replayable_history(room);
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), GAP_MSG " %" PRIu64 " %" PRIu64 "\n", lastSeq+1, room->lastSeq - numFrames);
+    send_member_msg(client, msg, len);
+    metrics_add(METRIC_SESSIONS_GAPPED, 1);
+    LOG_INFO("Client %s resumed %s %" PRIu64 " msgs behind, past the room's history", client->name, room->name, numMissed);
+
+    return numFrames;
+}
+
+// The holder's connection is gone, its session waits out the grace period unless it was kicked
+// Returns 1 if the room isn't told the client left, 0 if it is told now
+// Caller holds clientListMutex
+static uint8_t close_session(client_t* client, chatroom_t* room)
+{
+    pthread_mutex_lock(&sessions.mutex);
+    session_t* session = find_session(client->sessionToken);
+    if(session == NULL || session->client != client) {
+        // A resumed connection took over, as far as the room knows the client never left
+        pthread_mutex_unlock(&sessions.mutex);
+        return 1;
+    }
+    if(client->isKicked) {
+        unlink_session(session);
+        pthread_mutex_unlock(&sessions.mutex);
+        free(session);
+        return 0;
+    }
+
+    session->client = NULL;
+    session->expiresMs = reactor_now_ms() + config.resumeGraceSecs*1000ull;
+    sessions.numDetached++;
+    atomic_fetch_add_explicit(&room->numDetached, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&sessions.mutex);
+
+    return 1;
+}
+
+// client becomes invalidated
+static void remove_client(client_t* client, chatroom_t* room)
+{
+    if(client == NULL) {
+        return;
+    }
+
+    // Swap the last member into the hole
+    member_table_t* members = &room->members;
+    uint32_t last = --members->count;
+    members->clients[client->memberIdx] = members->clients[last];
+    members->states[client->memberIdx] = members->states[last];
+    members->clients[client->memberIdx]->memberIdx = client->memberIdx;
+
+    // A session defers the "left room" msg until it expires
+    uint8_t isLeaveDeferred = client->sessionToken != 0 && close_session(client, room);
+
+    // If there are remaining clients, send the "left room" msg
+    if(!isLeaveDeferred && members->count > 0) {
+        msg_frame_t* frame = frame_alloc(MAX_NAME_LEN+30, &room->memAccount);
+        if(frame != NULL) {
+            frame->size = sprintf(frame->data, "%s has left\n", client->name);
+            broadcast_frame(room, frame);
+            frame_unref(frame);
+        }
+    }
+
+    delete_client(client);
+}
+
+// Producer side, never waits on the sender
+// Returns -1 if the ring is full, the caller keeps the frame and backs off
+static int8_t push_send_buff(send_buff_t* sendBuff, msg_frame_t* frame, msg_type_t type, client_t* client)
+{
+    uint32_t pos = atomic_load_explicit(&sendBuff->insertIdx, memory_order_relaxed);
+    send_buff_item_t* item;
+    while(1) {
+        item = &sendBuff->buff[pos % SEND_BUFF_LEN];
+        uint32_t seq = atomic_load_explicit(&item->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if(diff == 0) {
+            // Slot is free, claim the position
+            if(atomic_compare_exchange_weak_explicit(&sendBuff->insertIdx, &pos, pos+1, 
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // Full, the sender hasn't freed the slot yet
+            metrics_add(METRIC_SEND_BUFF_FULL, 1);
+            return -1;
+        } else {
+            // Another producer took it
+            pos = atomic_load_explicit(&sendBuff->insertIdx, memory_order_relaxed);
+        }
+    }
+
+    item->frame = frame;
+    item->type = type;
+    item->client = client;
+    atomic_store_explicit(&item->seq, pos+1, memory_order_release);
+
+    // Either the sender's next run sees the item or it gets queued again
+    senders_schedule(&sendBuff->consumer);
+
+    return 0;
+}
+
+// Consumer side, never blocks
+// Returns NULL if the next slot isn't published yet
+static send_buff_item_t* peek_send_buff(send_buff_t* sendBuff)
+{
+    uint32_t pos = atomic_load_explicit(&sendBuff->removeIdx, memory_order_relaxed);
+    send_buff_item_t* item = &sendBuff->buff[pos % SEND_BUFF_LEN];
+    if(atomic_load_explicit(&item->seq, memory_order_acquire) != pos+1) {
+        return NULL;
+    }
+
+    return item;
+}
+
+// Hand the slot back to the producers
+static void release_send_buff(send_buff_t* sendBuff, send_buff_item_t* item)
+{
+    uint32_t pos = atomic_load_explicit(&sendBuff->removeIdx, memory_order_relaxed);
+    atomic_store_explicit(&item->seq, pos+SEND_BUFF_LEN, memory_order_release);
+    atomic_store_explicit(&sendBuff->removeIdx, pos+1, memory_order_relaxed);
+}
+
+// Detached sessions past their grace period, the room finally hears the client left
+static void expire_sessions(uint64_t now)
+{
+    session_t* expired = NULL;
+    pthread_mutex_lock(&sessions.mutex);
+    for(uint32_t b = 0; b < SESSION_BUCKETS && sessions.numDetached > 0; b++) {
+        session_t** link = &sessions.buckets[b];
+        while(*link != NULL) {
+            session_t* session = *link;
+            if(session->client == NULL && now >= session->expiresMs) {
+                *link = session->next;
+                session->next = expired;
+                expired = session;
+                sessions.numDetached--;
+            } else {
+                link = &session->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sessions.mutex);
+
+    while(expired != NULL) {
+        session_t* session = expired;
+        expired = session->next;
+        chatroom_t* room = session->room;
+        pthread_mutex_t* stripe = room_stripe(room->hash);
+        pthread_mutex_lock(stripe);
+        // A dormant room has nobody left to tell
+        if(!room->isDormant) {
+            msg_frame_t* frame = frame_alloc(MAX_NAME_LEN+30, &room->memAccount);
+            if(frame != NULL) {
+                frame->size = sprintf(frame->data, "%s has left\n", session->name);
+                if(push_send_buff(&room->sendBuff, frame, NOTICE_MSG, NULL) != 0) {
+                    // Ring is full, still expired so the next sweep tries again
+                    frame_unref(frame);
+                    pthread_mutex_unlock(stripe);
+                    pthread_mutex_lock(&sessions.mutex);
+                    session_t** bucket = session_bucket(session->token);
+                    session->next = *bucket;
+                    *bucket = session;
+                    sessions.numDetached++;
+                    pthread_mutex_unlock(&sessions.mutex);
+                    continue;
+                }
+            }
+        }
+        // Counted until here so the room outlives the session
+        atomic_fetch_sub_explicit(&room->numDetached, 1, memory_order_relaxed);
+        pthread_mutex_unlock(stripe);
+        metrics_add(METRIC_SESSIONS_EXPIRED, 1);
+        free(session);
+    }
+}
+
+// Periodic pass on a reactor so dormant rooms nobody looks up again are freed too
+static void sweep_dormant_rooms(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    uint64_t now = reactor_now_ms();
+    // First, so rooms whose last session expires can go with this pass
+    if(config.resumeGraceSecs > 0) {
+        expire_sessions(now);
+    }
+    for(uint32_t stripe = 0; stripe < ROOM_DIR_STRIPES; stripe++) {
+        pthread_mutex_lock(&roomStripes[stripe]);
+        for(uint32_t b = stripe; b < ROOM_DIR_BUCKETS; b += ROOM_DIR_STRIPES) {
+            if(roomBuckets[b] != NULL) {
+                reclaim_bucket(&roomBuckets[b], now);
+            }
+        }
+        pthread_mutex_unlock(&roomStripes[stripe]);
+    }
+
+    reactor_deadline_arm(reactor, &sweepDeadline, ROOM_SWEEP_MS);
+}
+
+int8_t chatroom_start(void)
+{
+    // io_uring sends would need their own zerocopy op and notifications
+    if(config.zerocopyThreshold > 0 && reactor_backend() == REACTOR_BACKEND_URING) {
+        LOG_WARN("Zerocopy sends are only supported with the epoll backend, sending copied");
+        config.zerocopyThreshold = 0;
+    }
+
+    if(fanout_start(config.fanoutWorkers) != 0) {
+        return -1;
+    }
+
+    // Sharded, each shard gets its own sender on its core, next to the reactor reading the members' sockets
+    uint32_t numSenders = config.isSharded ? reactor_count() : config.roomSenders;
+    if(senders_start(numSenders) != 0) {
+        return -1;
+    }
+    if(config.isSharded) {
+        for(uint32_t i = 0; i < numSenders; i++) {
+            reactor_pin_thread(reactor_get(i), senders_tid(i));
+        }
+    }
+
+    sweepDeadline.cb = sweep_dormant_rooms;
+    sweepTask.cb = sweep_dormant_rooms;
+    return reactor_post(reactor_pick(), &sweepTask);
+}
+
+// Only the sender still holds the frame, so it can be written before fan-out
+// The producer left SEQ_PREFIX_LEN bytes of room at the end
+static void stamp_seq(msg_frame_t* frame, uint64_t seq)
+{
+    char prefix[SEQ_PREFIX_LEN+1];
+    int len = snprintf(prefix, sizeof(prefix), "%" PRIu64 " ", seq);
+    memmove(frame->data + len, frame->data, frame->size);
+    memcpy(frame->data, prefix, len);
+    frame->size += len;
+}
+
+// The sender is done with one of the client's error msgs
+// Returns 1 for the last one, the caller then removes the client, which releases it
+static uint8_t drop_error_hold(client_t* client)
+{
+    uint32_t prev = atomic_fetch_sub_explicit(&client->errorsPending, 1, memory_order_acq_rel);
+    if((prev & ~CLIENT_RELEASE_DEFERRED) > 1) {
+        return 0;
+    }
+    // A release that came in meanwhile was deferred, the removal carries it out
+    atomic_fetch_and_explicit(&client->errorsPending, ~CLIENT_RELEASE_DEFERRED, memory_order_relaxed);
+    return 1;
+}
+
+// Runs on the room's shared sender whenever members published something
+// One batch per run so a busy room takes turns with the others on the same sender
+static void run_room(void* ctx)
+{
+    chatroom_t* room = (chatroom_t*)ctx;
+
+    // Drain whatever is already published so each member gets the burst in one write
+    send_buff_item_t* item = peek_send_buff(&room->sendBuff);
+    if(item != NULL) {
+        uint32_t batchLen = 0;
+        pthread_mutex_lock(&room->clientListMutex);
+        do {
+            if(item->type == ERROR_MSG && !drop_error_hold(item->client)) {
+                // Another error msg for the client is still queued, the last one removes it
+
+            } else if(item->type == ERROR_MSG) {
+                // Queued behind the frames staged ahead of it so it never lands mid-line
+                // Best effort since the client is dropped next
+                deliver_staged(room);
+                if(item->frame != NULL) {
+                    deliver_frames(item->client, &item->frame, 1);
+                }
+                // Reactor no longer watches the client once it queued the error msg
+                remove_client(item->client, room);
+
+            } else if(item->type == BROADCAST_MSG || item->type == NOTICE_MSG) {
+                if(item->type == BROADCAST_MSG && config.resumeGraceSecs > 0) {
+                    stamp_seq(item->frame, ++room->lastSeq);
+                }
+                // Staged for every client, never blocks on a slow reader
+                broadcast_frame(room, item->frame);
+                if(item->type == BROADCAST_MSG) {
+                    record_history(room, item->frame);
+                    if(room->log != NULL) {
+                        roomlog_append(room->log, item->frame);
+                    }
+                }
+                uint64_t msgsOut = atomic_load_explicit(&room->msgsOut, memory_order_relaxed);
+                uint64_t bytesOut = atomic_load_explicit(&room->bytesOut, memory_order_relaxed);
+                atomic_store_explicit(&room->msgsOut, msgsOut+1, memory_order_relaxed);
+                atomic_store_explicit(&room->bytesOut, bytesOut+item->frame->size, memory_order_relaxed);
+            }
+            if(item->frame != NULL) {
+                frame_unref(item->frame);
+                item->frame = NULL;
+            }
+            release_send_buff(&room->sendBuff, item);
+            item = ++batchLen < SEND_BUFF_LEN ? peek_send_buff(&room->sendBuff) : NULL;
+        } while(item != NULL);
+        deliver_staged(room);
+        pthread_mutex_unlock(&room->clientListMutex);
+
+        if(peek_send_buff(&room->sendBuff) != NULL) {
+            // More than a batch was waiting, go to the back of the line
+            senders_schedule(&room->sendBuff.consumer);
+            return;
+        }
+    }
+
+    // Check if there are remaining clients
+    if(room->members.count == 0) {
+        // Joiners only add clients while holding the stripe, so re-check under it
+        pthread_mutex_t* stripe = room_stripe(room->hash);
+        pthread_mutex_lock(stripe);
+        // A run still queued checks again, the room must not be reclaimed under it
+        if(room->members.count == 0 && !senders_is_queued(&room->sendBuff.consumer)) {
+            // No more client, leave the room for a quick rejoin or the sweep
+            drop_send_buff(&room->sendBuff);
+            room->isDormant = 1;
+            room->dormantSinceMs = reactor_now_ms();
+        }
+        pthread_mutex_unlock(stripe);
+    }
+}
+
+// Line may be split in two where it wraps around the recv ring
+static int8_t insert_broadcast_msg(client_t* client, const recv_line_t* line, uint8_t appendName)
+{
+    size_t len = line->len[0] + line->len[1];
+    if(len > (MAX_MSG_SIZE-1)-(strlen(client->name)+1)) { // -1 compensates for extra \n
+        LOG_ERROR("Message size too large from %s", client->name);
+        return -1;
+    }
+
+    if(len == 0) {
+        // Discard empty msg but don't fail
+        return 0;
+    }
+
+    // Construct message "user: msg" once, every recipient shares it
+    // With sessions on, leave space for the seq the sender puts in front
+    size_t nameLen = appendName ? strlen(client->name) : 0;
+    size_t seqLen = appendName && config.resumeGraceSecs > 0 ? SEQ_PREFIX_LEN : 0;
+    msg_frame_t* frame = frame_alloc(nameLen + 1 + len + 1 + seqLen, client->memAccount);
+    if(frame == NULL) {
+        LOG_ERROR("Failed to allocate frame for client %s", client->name);
+        return -1;
+    }
+    char* insert = frame->data;
+    frame->size = len;
+    if(appendName) {
+        memcpy(insert, client->name, nameLen);
+        insert += nameLen;
+        *insert = ':';
+        insert++;
+        frame->size += nameLen + 1;
+    }    
+    memcpy(insert, line->part[0], line->len[0]);
+    memcpy(insert + line->len[0], line->part[1], line->len[1]);
+
+    // Check if ends in new line
+    if(insert[len-1] != '\n') {
+        insert[len] = '\n';
+        frame->size++;
+    }
+    
+    if(push_send_buff(client->sendBuff, frame, appendName ? BROADCAST_MSG : NOTICE_MSG, NULL) != 0) {
+        frame_unref(frame);
+        return 1;
+    }
+    if(appendName) {
+        metrics_add(METRIC_MSGS_IN, 1);
+        metrics_add(METRIC_BYTES_IN, len);
+    }
+
+    return 0;
+}
+
+// The room's ring was full when the error msg was first offered
+// Reactor thread only
+static void retry_error_msg(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
+    if(push_send_buff(client->sendBuff, client->errorFrame, ERROR_MSG, client) != 0) {
+        reactor_deadline_arm(reactor, &client->errorDeadline, SEND_BUFF_RETRY_MS);
+    }
+}
+
+// The sender may remove and free the client as soon as the msg is published
+// Callers finish with the client first, including clearing isActive if the socket is gone
+// Reactor thread only
+static int8_t insert_error_msg(client_t* client, char* msg, uint32_t len)
+{
+    // Always queued even without a frame, the sender removes the client on this msg
+    msg_frame_t* frame = frame_alloc(len, client->memAccount);
+    if(frame != NULL) {
+        memcpy(frame->data, msg, len);
+    }
+
+    // Kept for the retry, set first since a successful push hands the client over
+    // Held until the sender is done with the msg, a retry is still the same msg
+    client->errorFrame = frame;
+    atomic_fetch_add_explicit(&client->errorsPending, 1, memory_order_relaxed);
+    if(push_send_buff(client->sendBuff, frame, ERROR_MSG, client) != 0) {
+        reactor_deadline_arm(client->reactor, &client->errorDeadline, SEND_BUFF_RETRY_MS);
+    }
+
+    return 0;
+}
+
+// Returns 0 if the member's and the room's buckets all have the tokens, otherwise how long until they do
+static uint64_t msg_tokens_wait(client_t* client, uint32_t len, uint64_t nowNs)
+{
+    token_bucket_t* buckets[] = {&client->msgBucket, &client->byteBucket, client->roomMsgBucket, client->roomByteBucket};
+    uint32_t costs[] = {1, len, 1, len};
+
+    uint64_t waitNs = 0;
+    for(uint32_t i = 0; i < sizeof(buckets)/sizeof(buckets[0]); i++) {
+        uint64_t bucketWaitNs = token_bucket_wait_ns(buckets[i], costs[i], nowNs);
+        if(bucketWaitNs > waitNs) {
+            waitNs = bucketWaitNs;
+        }
+    }
+    return waitNs;
+}
+
+// Only once msg_tokens_wait found them all and the msg is queued
+static void take_msg_tokens(client_t* client, uint32_t len, uint64_t nowNs)
+{
+    token_bucket_t* buckets[] = {&client->msgBucket, &client->byteBucket, client->roomMsgBucket, client->roomByteBucket};
+    uint32_t costs[] = {1, len, 1, len};
+
+    for(uint32_t i = 0; i < sizeof(buckets)/sizeof(buckets[0]); i++) {
+        token_bucket_take(buckets[i], costs[i], nowNs);
+    }
+}
+
+// Stop reading until the tokens are back or the room's ring has space, TCP pushes back on the sender
+// Reactor thread only
+static void pause_reads(client_t* client, uint64_t waitNs)
+{
+    metrics_add(METRIC_READS_PAUSED, 1);
+
+    out_queue_t* queue = &client->outQueue;
+    pthread_mutex_lock(&queue->mutex);
+    client->isReadPaused = 1;
+    if(client->isWatched) {
+        if(reactor_backend() == REACTOR_BACKEND_URING) {
+            reactor_recv_pause(client->reactor, &client->handle);
+        } else {
+            reactor_mod(client->reactor, &client->handle, client_events(client, (client->handle.events & EPOLLOUT) != 0));
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    reactor_deadline_arm(client->reactor, &client->resumeDeadline, (waitNs + 999999) / 1000000);
+}
+
+// Keepalive answer, wrapped around the ring or not
+static uint8_t is_pong_line(const recv_line_t* line)
+{
+    if(line->len[0] + line->len[1] != sizeof(PONG_MSG)-1) {
+        return 0;
+    }
+    return memcmp(line->part[0], PONG_MSG, line->len[0]) == 0 &&
+           (line->len[1] == 0 || memcmp(line->part[1], PONG_MSG + line->len[0], line->len[1]) == 0);
+}
+
+// Queue the has joined msg
+// Returns 1 if the room's ring is full
+static int8_t announce_client(client_t* client)
+{
+    char sendBuff[MAX_NAME_LEN+30];
+    int joinMsgSize = sprintf(sendBuff, "%s has joined\n", client->name);
+    if(joinMsgSize < 0) {
+        LOG_ERROR("Client %s failed to construct has joined msg", client->name);
+        return 0;
+    }
+    recv_line_t joinLine = {{sendBuff, NULL}, {joinMsgSize, 0}};
+    return insert_broadcast_msg(client, &joinLine, 0) > 0 ? 1 : 0;
+}
+
+// Broadcast every complete line in the recv ring, each byte is scanned once
+// Lines over a rate limit or that find the room's ring full stay in the ring and the client's reads are paused
+// Returns -1 if a msg is too long
+static int8_t tokenize_msg(client_t* client)
+{
+    if(client->isJoinPending) {
+        if(announce_client(client) != 0) {
+            pause_reads(client, SEND_BUFF_RETRY_MS*1000000ull);
+            return 0;
+        }
+        client->isJoinPending = 0;
+    }
+
+    uint64_t nowNs = isRateLimited ? metrics_now_ns() : 0;
+    recv_line_t line;
+    while(recv_ring_peek_line(&client->recvRing, &line)) {
+        if(config.keepaliveSecs > 0 && is_pong_line(&line)) {
+            // Keepalive answer, the read already counted as activity
+            recv_ring_consume_line(&client->recvRing);
+            continue;
+        }
+        uint32_t len = line.len[0] + line.len[1];
+        if(isRateLimited) {
+            uint64_t waitNs = msg_tokens_wait(client, len, nowNs);
+            if(waitNs > 0) {
+                pause_reads(client, waitNs);
+                return 0;
+            }
+        }
+        // Consumed only once queued, a full ring leaves the line for the retry
+        int8_t ret = insert_broadcast_msg(client, &line, 1);
+        if(ret > 0) {
+            pause_reads(client, SEND_BUFF_RETRY_MS*1000000ull);
+            return 0;
+        }
+        if(ret != 0) {
+            LOG_ERROR("Failed to add broadcast msg to buffer for client %s", client->name);
+            return -1;
+        }
+        recv_ring_consume_line(&client->recvRing);
+        if(isRateLimited) {
+            take_msg_tokens(client, len, nowNs);
+        }
+    }
+
+    // Partial line can't grow past the max msg size
+    if(recv_ring_pending(&client->recvRing) >= MAX_MSG_SIZE-1) {
+        LOG_ERROR("Message size too large from %s", client->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Runs on the client's reactor thread, one recv per readiness event
+static void chatroom_client(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
+
+    if(events & EPOLLOUT) {
+        // Socket drained, push out what the room sender queued
+        pthread_mutex_lock(&client->outQueue.mutex);
+        if(flush_out_queue(client) != 0) {
+            disconnect_client(client);
+        }
+        watch_writable(client, client->outQueue.count > 0);
+        pthread_mutex_unlock(&client->outQueue.mutex);
+
+        if(!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            return;
+        }
+    }
+
+    if(events & EPOLLERR) {
+        // Zerocopy completions wake us through the error queue, a flush may have reaped them first
+        pthread_mutex_lock(&client->outQueue.mutex);
+        int32_t numDone = reap_zerocopy(client);
+        pthread_mutex_unlock(&client->outQueue.mutex);
+        if(!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+            // Nothing to read, so only a pending socket error means the client is gone
+            int sockErr = 0;
+            socklen_t errLen = sizeof(sockErr);
+            if(numDone > 0 || getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &sockErr, &errLen) != 0 || sockErr == 0) {
+                return;
+            }
+            LOG_ERROR("Client %s socket failed with err=%d", client->name, sockErr);
+            stop_watching(client);
+            char error_msg[] = "ERROR\n";
+            client->isActive = 0;
+            insert_error_msg(client, error_msg, strlen(error_msg));
+            return;
+        }
+    }
+
+    // Straight into the free space of the ring, wrapping included
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = recv_ring_write_iov(&client->recvRing, iov);
+    ssize_t numBytes = recvmsg(client->fd, &msg, MSG_DONTWAIT);
+    if(numBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    // Only a hangup is reported while reads are paused, the client goes with whatever it had left
+    if(numBytes <= 0 || client->isReadPaused) {
+        int err = errno;
+        LOG_ERROR("Client %s failed to recv with ret=%ld and err=%d", client->name, numBytes, err);
+        // Stop watching before handing the client to the sender for removal
+        stop_watching(client);
+        char error_msg[] = "ERROR\n";
+        client->isActive = 0;
+        insert_error_msg(client, error_msg, strlen(error_msg));
+        return;
+    }
+    recv_ring_commit(&client->recvRing, numBytes);
+    client->lastRecvMs = reactor_loop_ms(reactor);
+
+    // Split recvd data into messages
+    if(tokenize_msg(client) != 0) {
+        // Message too long
+        client->isKicked = 1;
+        stop_watching(client);
+        char error_msg[] = "ERROR\n";
+        insert_error_msg(client, error_msg, strlen(error_msg));
+        return;
+    }
+}
+
+// io_uring backend, keep what a paused client received until its reads resume
+static int8_t hold_data(client_t* client, const char* data, uint32_t len)
+{
+    char* heldData = (char*)realloc(client->heldData, client->heldLen + len);
+    if(heldData == NULL) {
+        LOG_ERROR("Failed to hold %u bytes for paused client %s", len, client->name);
+        return -1;
+    }
+    memcpy(heldData + client->heldLen, data, len);
+    client->heldData = heldData;
+    client->heldLen += len;
+
+    return 0;
+}
+
+// io_uring backend, feed received bytes through the recv ring
+// Returns -1 if a msg is too long or held data could not be kept
+static int8_t consume_data(client_t* client, const char* data, uint32_t len)
+{
+    // A chunk can be larger than the ring's free space, tokenizing makes room for the rest
+    uint32_t consumed = 0;
+    while(consumed < len) {
+        if(client->isReadPaused) {
+            // Chunks already completed keep arriving until the paused recv ends
+            return hold_data(client, data+consumed, len-consumed);
+        }
+        consumed += recv_ring_append(&client->recvRing, data+consumed, len-consumed);
+        if(tokenize_msg(client) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// io_uring backend, every chunk the multishot recv picked up for the client
+static void chatroom_client_data(reactor_t* reactor, void* ctx, const char* data, int32_t len)
+{
+    client_t* client = (client_t*)ctx;
+
+    if(len <= 0) {
+        LOG_ERROR("Client %s failed to recv with ret=%d", client->name, len);
+        stop_watching(client);
+        char error_msg[] = "ERROR\n";
+        client->isActive = 0;
+        insert_error_msg(client, error_msg, strlen(error_msg));
+        return;
+    }
+
+    client->lastRecvMs = reactor_loop_ms(reactor);
+    if(consume_data(client, data, len) != 0) {
+        client->isKicked = 1;
+        stop_watching(client);
+        char error_msg[] = "ERROR\n";
+        insert_error_msg(client, error_msg, strlen(error_msg));
+        return;
+    }
+}
+
+// Tokens are back, catch up on what was received meanwhile before reading again
+static void resume_reads(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
+    out_queue_t* queue = &client->outQueue;
+
+    pthread_mutex_lock(&queue->mutex);
+    client->isReadPaused = 0;
+    pthread_mutex_unlock(&queue->mutex);
+
+    // Either may pause the client again
+    int8_t ret = tokenize_msg(client);
+    if(ret == 0 && client->heldData != NULL) {
+        char* heldData = client->heldData;
+        uint32_t heldLen = client->heldLen;
+        client->heldData = NULL;
+        client->heldLen = 0;
+        ret = consume_data(client, heldData, heldLen);
+        free(heldData);
+    }
+    if(ret != 0) {
+        client->isKicked = 1;
+        stop_watching(client);
+        char error_msg[] = "ERROR\n";
+        insert_error_msg(client, error_msg, strlen(error_msg));
+        return;
+    }
+    if(client->isReadPaused) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    if(reactor_backend() == REACTOR_BACKEND_URING) {
+        ret = reactor_recv_resume(reactor, &client->handle);
+    } else {
+        ret = reactor_mod(reactor, &client->handle, client_events(client, (client->handle.events & EPOLLOUT) != 0));
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    if(ret != 0) {
+        stop_watching(client);
+        char error_msg[] = "ERROR\n";
+        client->isActive = 0;
+        insert_error_msg(client, error_msg, strlen(error_msg));
+    }
 }
 
-static int8_t insert_broadcast_msg(client_t* client, char* msg, uint8_t appendName)
+// Double both arrays, the old slots keep their members
+// Caller holds clientListMutex
+static int8_t grow_member_table(member_table_t* members, mem_account_t* account)
 {
-    size_t len = strlen(msg);
-    if(len > (MAX_MSG_SIZE-1)-(strlen(client->name)+1)) { // -1 compensates for extra \n
-        printf("ERROR: Message size too large from %s\n", client->name);
+    uint32_t capacity = members->capacity == 0 ? MEMBER_TABLE_INIT_LEN : members->capacity*2;
+    client_t** clients = (client_t**)realloc(members->clients, capacity * sizeof(client_t*));
+    if(clients == NULL) {
         return -1;
     }
-
-    if(len == 0) {
-        // Discard empty msg but don't fail
-        return 0;
-    }
-    
-    if(sem_wait(&client->sendBuff->empty) < 0) {
-        printf("ERROR: Failed to wait on empty sem client %s\n", client->name);
+    members->clients = clients;
+    // On failure the clients array is just larger than it needs to be
+    uint8_t* states = (uint8_t*)realloc(members->states, capacity);
+    if(states == NULL) {
         return -1;
     }
+    members->states = states;
+    mem_account_charge(account, (int64_t)(capacity - members->capacity) * (sizeof(client_t*)+1));
+    members->capacity = capacity;
+
+    return 0;
+}
 
-    if(pthread_mutex_lock(&client->sendBuff->insertMutex) < 0) {
-        printf("ERROR: Failed to lock mutex client %s\n", client->name);
+// Append the client to the room's members
+// A resumed client is sent what came after lastSeq instead of the scrollback, if the history still has it
+// Caller holds the room's stripe so the room can't go dormant in between
+static int8_t add_client(client_t* client, chatroom_t* room, char* name, uint8_t isResume, uint64_t lastSeq)
+{
+    if(room == NULL || client->fd < 0 || strlen(name) > MAX_NAME_LEN) {
+        LOG_ERROR("Invalid args to add_client for client %s", name);
         return -1;
     }
 
-    uint8_t idx = client->sendBuff->insertIdx;
-    send_buff_item_t* item = &client->sendBuff->buff[idx];
-    char* insert = item->msg;
-    
-    
-    // Construct message "user: msg"
-    item->size = len;
-    if(appendName) {
-        size_t nameLen = strlen(client->name);
-        strcpy(insert, client->name);
-        insert += nameLen;
-        *insert = ':';
-        insert++;
-        item->size += nameLen + 1;
-    }    
-    memcpy(insert, msg, len);
-
-    // Check if ends in new line
-    if(insert[len-1] != '\n') {
-        insert[len] = '\n';
-        item->size++;
+    if(pthread_mutex_lock(&room->clientListMutex) < 0) {
+        LOG_ERROR("Failed to lock client list mutex room %s", room->name);
+        return -1;
     }
-    
-    item->type = BROADCAST_MSG;
-    client->sendBuff->insertIdx = (idx+1)%SEND_BUFF_LEN;
-    if(pthread_mutex_unlock(&client->sendBuff->insertMutex) < 0) {
-        printf("ERROR: Failed to unlock mutex client %s\n", client->name);
+    member_table_t* members = &room->members;
+    if(members->count == members->capacity && grow_member_table(members, &room->memAccount) != 0) {
+        LOG_ERROR("Failed to grow member table for room %s", room->name);
+        pthread_mutex_unlock(&room->clientListMutex);
         return -1;
     }
-    
 
-    if(sem_post(&client->sendBuff->full) < 0) {
-        printf("ERROR: Failed to wait on empty sem client %s\n", client->name);
-        return -1;
+    client->isActive = 1;
+    client->next = NULL;
+    strcpy(client->name, name);
+    client->sendBuff = &room->sendBuff;
+    client->memAccount = &room->memAccount;
+    // The out queue a pooled client kept is charged to its new room
+    mem_account_charge(client->memAccount, (int64_t)client->outQueue.capacity * sizeof(msg_frame_t*));
+    init_rate_limits(&client->msgBucket, &client->byteBucket, config.clientMsgRate, config.clientByteRate);
+    client->roomMsgBucket = &room->msgBucket;
+    client->roomByteBucket = &room->byteBucket;
+
+    client->memberIdx = members->count++;
+    members->clients[client->memberIdx] = client;
+    members->states[client->memberIdx] = MEMBER_LIVE;
+    if(config.resumeGraceSecs > 0) {
+        if(!isResume) {
+            open_session(client, room);
+        }
+        if(client->sessionToken != 0) {
+            send_session_msg(client, room);
+        }
     }
+    replay_history(client, room, isResume ? resume_replay_len(client, room, lastSeq) : config.scrollbackMsgs);
+    pthread_mutex_unlock(&room->clientListMutex);
 
     return 0;
 }
 
-static int8_t insert_error_msg(client_t* client, char* msg, uint32_t len)
+// Queued straight onto the client's out queue, it lands between two whole frames
+static void send_ping(client_t* client)
 {
-    if(sem_wait(&client->sendBuff->empty) < 0) {
-        printf("ERROR: Failed to wait on empty sem client %s\n", client->name);
-        return -1;
+    msg_frame_t* frame = frame_alloc(sizeof(PING_MSG)-1, client->memAccount);
+    if(frame == NULL) {
+        return;
     }
-
-    if(pthread_mutex_lock(&client->sendBuff->insertMutex) < 0) {
-        printf("ERROR: Failed to lock mutex client %s\n", client->name);
-        return -1;
+    memcpy(frame->data, PING_MSG, sizeof(PING_MSG)-1);
+    frame->size = sizeof(PING_MSG)-1;
+
+    out_queue_t* queue = &client->outQueue;
+    pthread_mutex_lock(&queue->mutex);
+    int8_t ret = enqueue_client_frame(client, frame);
+    if(ret == 0 && !is_waiting_writable(client)) {
+        ret = flush_out_queue(client);
+        watch_writable(client, queue->count > 0);
     }
+    pthread_mutex_unlock(&queue->mutex);
+    frame_unref(frame);
 
-    uint8_t idx = client->sendBuff->insertIdx;
-    send_buff_item_t* item = &client->sendBuff->buff[idx];
-
-    strcpy(item->msg, msg);
-
-    item->type = ERROR_MSG;
-    item->size = len;
-    item->client = client;
-    client->sendBuff->insertIdx = (idx+1)%SEND_BUFF_LEN;
-    if(pthread_mutex_unlock(&client->sendBuff->insertMutex) < 0) {
-        printf("ERROR: Failed to unlock mutex client %s\n", client->name);
-        return -1;
+    if(ret != 0) {
+        disconnect_client(client);
     }
+}
 
-
-    if(sem_post(&client->sendBuff->full) < 0) {
-        printf("ERROR: Failed to wait on empty sem client %s\n", client->name);
-        return -1;
+// One deadline per client covers every check, set for whichever is due first
+// Reads only record the time, a read since arming just makes the next check find nothing to do
+// Frames still pinned by zerocopy sends are reaped again soon after
+static void arm_liveness(reactor_t* reactor, client_t* client, uint64_t now, uint8_t isPinning)
+{
+    uint64_t next = UINT64_MAX;
+    if(config.idleSecs > 0) {
+        next = client->lastRecvMs + config.idleSecs*1000ull;
+    }
+    if(config.keepaliveSecs > 0) {
+        uint64_t lastHeard = client->lastRecvMs > client->lastPingMs ? client->lastRecvMs : client->lastPingMs;
+        uint64_t pingAt = lastHeard + config.keepaliveSecs*1000ull;
+        next = pingAt < next ? pingAt : next;
+    }
+    if(config.sendStallSecs > 0) {
+        // Sampled twice per window, so a stall is caught within 1.5 windows
+        uint64_t sampleAt = now + config.sendStallSecs*500ull;
+        next = sampleAt < next ? sampleAt : next;
+    }
+    if(isPinning) {
+        uint64_t reapAt = now + ZEROCOPY_REAP_MS;
+        next = reapAt < next ? reapAt : next;
+    }
+    if(next == UINT64_MAX) {
+        return;
     }
 
-    return 0;
+    reactor_deadline_arm(reactor, &client->livenessDeadline, next > now ? (uint32_t)(next - now) : 0);
 }
 
-// Expects C-string input (with terminating null)
-// Returns leftover bytes which are not full message
-static int32_t tokenize_msg(client_t* client, char* buff, uint32_t len)
+static void check_liveness(reactor_t* reactor, void* ctx, uint32_t events)
 {
-    uint32_t lenRemain = len;
-    char* store = buff;
-    char* token = strtok(buff, "\n");
-    while(token != NULL) {
-        size_t tokenSize = strlen(token);
-        if(tokenSize == lenRemain) {
-            // Handle if there are no \n in the whole string
-            break;
-        }
-        lenRemain -= tokenSize+1; // +1 for the NULL char inputted
-        store += tokenSize+1;
+    client_t* client = (client_t*)ctx;
+    uint64_t now = reactor_now_ms();
 
-        // Handle carriage return
-        if(token[tokenSize-1] == '\r') {
-            token[tokenSize-1] = '\0';
-            tokenSize--;
-        }
-        
-        if(insert_broadcast_msg(client, token, 1) != 0) {
-            printf("ERROR: Failed to add broadcast msg to buffer for client %s\n", client->name);
-            return -1;
-        }        
-        token = strtok(NULL, "\n");
+    // Silent because its reads are paused, not because it's gone
+    if(client->isReadPaused) {
+        client->lastRecvMs = now;
     }
 
-    // move the remaining chars to front of buffer
-    if(store != buff) {
-        memmove(buff, store, lenRemain);
+    out_queue_t* queue = &client->outQueue;
+    uint8_t isStalled = 0;
+    pthread_mutex_lock(&queue->mutex);
+    // An idle client's last zerocopy sends would otherwise stay pinned until its next flush
+    reap_zerocopy(client);
+    uint8_t isPinning = queue->pinCount > 0;
+    if(queue->count == 0 || queue->bytesSent != client->stallCheckBytes) {
+        client->stallCheckBytes = queue->bytesSent;
+        client->stallCheckMs = now;
+    } else if(config.sendStallSecs > 0 && now - client->stallCheckMs >= config.sendStallSecs*1000ull) {
+        isStalled = 1;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    uint64_t silentMs = now - client->lastRecvMs;
+    if(isStalled || (config.idleSecs > 0 && silentMs >= config.idleSecs*1000ull)) {
+        LOG_WARN("Dropping client %s, %s", client->name, isStalled ? "its msgs stopped draining" : "idle");
+        metrics_add(METRIC_CLIENTS_TIMED_OUT, 1);
+        // Its reactor picks up the hangup and removes it like any other
+        disconnect_client(client);
+        return;
     }
 
-    return lenRemain;
+    if(config.keepaliveSecs > 0 && silentMs >= config.keepaliveSecs*1000ull &&
+       now - client->lastPingMs >= config.keepaliveSecs*1000ull) {
+        send_ping(client);
+        client->lastPingMs = now;
+    }
+    arm_liveness(reactor, client, now, isPinning);
 }
 
-void* chatroom_client(void* input)
+// Announce the client and switch its socket from the JOIN handshake to chat msgs
+// A resumed client never left, so it isn't announced
+static void start_client(client_t* client, uint8_t isResume, char* buff, uint32_t len)
 {
-    client_t* client = (client_t*)input;
-    char recvBuff[MAX_MSG_SIZE];
-    
-    ssize_t numBytes = 0;
-    int32_t leftOver = 0;
-    while(1) {
-        // MAX_MSG_SIZE-1 so we can append null char
-        numBytes = recv(client->fd, recvBuff+leftOver, (MAX_MSG_SIZE-1)-leftOver, 0);
-        if(numBytes <= 0) {
-            int err = errno;
-            printf("ERROR: Client %s failed to recv with ret=%lu and err=%d\n", client->name, numBytes, err);
+    // Goes out ahead of its first msg, tokenize_msg retries it while the room's ring is full
+    client->isJoinPending = !isResume;
+
+    client->handle.cb = chatroom_client;
+
+    out_queue_t* queue = &client->outQueue;
+    pthread_mutex_lock(&queue->mutex);
+    if(reactor_backend() == REACTOR_BACKEND_URING) {
+        // Chat msgs come in through multishot recv instead of readiness polls
+        reactor_del(client->reactor, &client->handle);
+        client->handle.dataCb = chatroom_client_data;
+        if(reactor_recv_start(client->reactor, &client->handle) != 0) {
+            client->isWatched = 0;
+            pthread_mutex_unlock(&queue->mutex);
             char error_msg[] = "ERROR\n";
-            insert_error_msg(client, error_msg, strlen(error_msg));
             client->isActive = 0;
-            break;
-        }
-        uint32_t totalSize = leftOver+numBytes;        
-        // Append null char
-        recvBuff[totalSize] = '\0';
-        //printf("Recvd: %s\n", recvBuff+leftOver);
-
-        // Split recvd data into messages
-        leftOver = tokenize_msg(client, recvBuff, totalSize);
-        if(leftOver < 0) {
-            // Message too long
-            char error_msg[] = "ERROR\n";
             insert_error_msg(client, error_msg, strlen(error_msg));
-            break;
+            return;
+        }
+    }
+    // Scrollback queued by add_client goes out as one write
+    if(queue->count > 0 && !is_waiting_writable(client)) {
+        if(flush_out_queue(client) != 0) {
+            disconnect_client(client);
         }
+        watch_writable(client, queue->count > 0);
     }
+    pthread_mutex_unlock(&queue->mutex);
+
+    client->lastRecvMs = reactor_now_ms();
+    client->lastPingMs = 0;
+    client->stallCheckMs = client->lastRecvMs;
+    client->stallCheckBytes = 0;
+    arm_liveness(client->reactor, client, client->lastRecvMs, 0);
+
+    // Send any initial messages, keep the partial tail for the next read
+    // Only once reads are set up for chat, a rate limit may pause them right away
+    recv_ring_append(&client->recvRing, buff, len);
+    if(tokenize_msg(client) != 0) {
+        client->isKicked = 1;
+        stop_watching(client);
+        char error_msg[] = "ERROR\n";
+        insert_error_msg(client, error_msg, strlen(error_msg));
+        return;
+    }
+}
 
-    return NULL;
+static void report_room_stats(chatroom_t* room, room_stats_cb_t cb, void* ctx)
+{
+    room_stats_t stats;
+    stats.name = room->name;
+    pthread_mutex_lock(&room->clientListMutex);
+    stats.numClients = room->members.count;
+    pthread_mutex_unlock(&room->clientListMutex);
+
+    stats.memBytes = sizeof(chatroom_t) + atomic_load_explicit(&room->memAccount.bytes, memory_order_relaxed);
+    stats.numFrames = atomic_load_explicit(&room->memAccount.frames, memory_order_relaxed);
+    stats.msgsOut = atomic_load_explicit(&room->msgsOut, memory_order_relaxed);
+    stats.bytesOut = atomic_load_explicit(&room->bytesOut, memory_order_relaxed);
+    // Racy but bounded, claimed slots minus consumed ones
+    uint32_t used = atomic_load_explicit(&room->sendBuff.insertIdx, memory_order_relaxed) -
+                    atomic_load_explicit(&room->sendBuff.removeIdx, memory_order_relaxed);
+    stats.sendBuffUsed = used > SEND_BUFF_LEN ? SEND_BUFF_LEN : used;
+    stats.sendBuffLen = SEND_BUFF_LEN;
+    cb(&stats, ctx);
 }
 
-int8_t add_client(int fd, chatroom_t* room, char* name, char* buff)
+// Snapshot of every live room, taken one stripe at a time
+void chatroom_foreach_room_stats(room_stats_cb_t cb, void* ctx)
 {
-    if(room == NULL || fd < 0 || strlen(name) > MAX_NAME_LEN) {
-        printf("ERROR: Invalid args to add_client for client %s\n", name);
-        return -1;
+    for(uint32_t stripe = 0; stripe < ROOM_DIR_STRIPES; stripe++) {
+        pthread_mutex_lock(&roomStripes[stripe]);
+        for(uint32_t b = stripe; b < ROOM_DIR_BUCKETS; b += ROOM_DIR_STRIPES) {
+            for(chatroom_t* room = roomBuckets[b]; room != NULL; room = room->hashNext) {
+                if(!room->isDormant) {
+                    report_room_stats(room, cb, ctx);
+                }
+            }
+        }
+        pthread_mutex_unlock(&roomStripes[stripe]);
     }
+}
 
-    client_t* newClient = (client_t*)calloc(1, sizeof(client_t));
-    newClient->fd = fd;
-    newClient->isActive = 1;
-    newClient->prev = NULL;
-    newClient->next = NULL;
-    strcpy(newClient->name, name);
-    newClient->sendBuff = &room->sendBuff;
-
-    // Add to client list
-    if(pthread_mutex_lock(&room->clientListMutex) < 0) {
-        printf("ERROR: Failed to lock client list mutex room %s\n", room->name);
-        delete_client(newClient);
-        return -1;
-    }
-    if(room->clientList == NULL) {
-        // Initializing client list
-        room->clientList = newClient;
-        room->clientListTail = newClient;
-    } else {
-        room->clientListTail->next = newClient;
-        newClient->prev = room->clientListTail;
-        room->clientListTail = newClient;
-    }
-    if(pthread_mutex_unlock(&room->clientListMutex) < 0) {
-        printf("ERROR: Failed to unlock client list mutex room %s\n", room->name);
-        remove_client(newClient, room);
-        return -1;
-    }
+// Walks every member of every live room, meant for scrapes rather than hot paths
+void chatroom_foreach_client_stats(client_stats_cb_t cb, void* ctx)
+{
+    for(uint32_t stripe = 0; stripe < ROOM_DIR_STRIPES; stripe++) {
+        pthread_mutex_lock(&roomStripes[stripe]);
+        for(uint32_t b = stripe; b < ROOM_DIR_BUCKETS; b += ROOM_DIR_STRIPES) {
+            for(chatroom_t* room = roomBuckets[b]; room != NULL; room = room->hashNext) {
+                if(room->isDormant) {
+                    continue;
+                }
 
-    // Spawn thread
-    if(pthread_create(&newClient->tid, NULL, chatroom_client, newClient)) {
-        printf("ERROR: Failed to start client thread for %s\n", name);
-        remove_client(newClient, room);
-        return -1;
+                pthread_mutex_lock(&room->clientListMutex);
+                for(uint32_t i = 0; i < room->members.count; i++) {
+                    client_t* it = room->members.clients[i];
+                    client_stats_t stats;
+                    stats.room = room->name;
+                    stats.name = it->name;
+                    pthread_mutex_lock(&it->outQueue.mutex);
+                    stats.queuedMsgs = it->outQueue.count;
+                    pthread_mutex_unlock(&it->outQueue.mutex);
+                    cb(&stats, ctx);
+                }
+                pthread_mutex_unlock(&room->clientListMutex);
+            }
+        }
+        pthread_mutex_unlock(&roomStripes[stripe]);
     }
+}
 
-    // Send the has joined message
-    char sendBuff[MAX_NAME_LEN+30];
-    int joinMsgSize = sprintf(sendBuff, "%s has joined\n", newClient->name);
-    if(joinMsgSize < 0) {
-        printf("ERROR: Client %s failed to construct has joined msg\n", newClient->name);
-        remove_client(newClient, room);
-        return -1;
+// Caller holds the stripe for the room's hash
+static void add_chatroom(chatroom_t* room)
+{
+    if(room == NULL) {
+        return;
     }
-    insert_broadcast_msg(newClient, sendBuff, 0);
 
-    // Send any initial messages
-    tokenize_msg(newClient, buff, strlen(buff));
+    chatroom_t** bucket = room_bucket(room->hash);
+    room->hashNext = *bucket;
+    *bucket = room;
+}
 
-    return 0;
+// Refill the scrollback of a recreated room from its log
+static void restore_history_msg(const char* data, uint32_t len, void* ctx)
+{
+    chatroom_t* room = (chatroom_t*)ctx;
+    msg_frame_t* frame = frame_alloc(len, &room->memAccount);
+    if(frame == NULL) {
+        return;
+    }
+    memcpy(frame->data, data, len);
+    record_history(room, frame);
+    frame_unref(frame);
+
+    // Carry on from the seq the msg was stamped with, names can't hold the space that ends it
+    uint64_t seq = 0;
+    uint32_t numDigits = 0;
+    while(numDigits < len && numDigits < SEQ_PREFIX_LEN-1 && data[numDigits] >= '0' && data[numDigits] <= '9') {
+        seq = seq*10 + (data[numDigits++] - '0');
+    }
+    room->lastSeq = numDigits > 0 && numDigits < len && data[numDigits] == ' ' ? seq : room->lastSeq+1;
 }
 
-static void add_chatroom(chatroom_t* room)
+// Fresh room with its lock, fan-out group and scrollback array, kept when it goes back to the pool
+// The member table is allocated by the first join
+static chatroom_t* alloc_chatroom(void)
 {
+    chatroom_t* room = (chatroom_t*)calloc(1, sizeof(chatroom_t));
     if(room == NULL) {
-        return;
+        return NULL;
     }
 
-    if(pthread_mutex_lock(&room->clientListMutex) < 0) {
-        printf("ERROR: Failed to lock client list mutex room %s\n", room->name);
-        return;
+    if(pthread_mutex_init(&room->clientListMutex, NULL) != 0) {
+        free(room);
+        return NULL;
     }
 
-    // Empty list
-    if(chatroom_list_head == NULL) {
-        chatroom_list_head = room;
-        chatroom_list_tail = room;
-        room->prev = NULL;
-        room->next = NULL;
-    } else {
-        chatroom_list_tail->next = room;
-        room->prev = chatroom_list_tail;
-        chatroom_list_tail = room;
-        room->next = NULL;
+    if(fanout_group_init(&room->fanoutGroup) != 0) {
+        pthread_mutex_destroy(&room->clientListMutex);
+        free(room);
+        return NULL;
     }
 
-    if(pthread_mutex_unlock(&room->clientListMutex) < 0) {
-        printf("ERROR: Failed to unlock client list mutex room %s\n", room->name);
-        return;
+    if(historyLen > 0) {
+        room->history = (msg_frame_t**)malloc(historyLen * sizeof(msg_frame_t*));
+        if(room->history == NULL) {
+            fanout_group_destroy(&room->fanoutGroup);
+            pthread_mutex_destroy(&room->clientListMutex);
+            free(room);
+            return NULL;
+        }
     }
+
+    room->sendBuff.consumer.fn = run_room;
+    room->sendBuff.consumer.ctx = room;
+
+    return room;
 }
 
-// initialize chatroom
-static chatroom_t* init_chatroom(int fd, char* name)
+// initialize chatroom from the pool, it is only scheduled on its sender once it has a client
+static chatroom_t* init_chatroom(char* name, uint32_t hash)
 {
-    // Add new room to room list
-    chatroom_t* newRoom = (chatroom_t*)calloc(1, sizeof(chatroom_t));
+    pthread_mutex_lock(&roomPool.mutex);
+    chatroom_t* newRoom = roomPool.head;
+    if(newRoom != NULL) {
+        roomPool.head = newRoom->hashNext;
+        roomPool.count--;
+    }
+    pthread_mutex_unlock(&roomPool.mutex);
 
-    // Initialize mutexes and semaphores
-    if(pthread_mutex_init(&newRoom->sendBuff.insertMutex, NULL) != 0) {
-        printf("ERROR: Failed to initialize send buffer mutex %s\n", name);
-        free(newRoom);
-        return NULL;
+    if(newRoom == NULL) {
+        newRoom = alloc_chatroom();
+        if(newRoom == NULL) {
+            LOG_ERROR("Failed to allocate chatroom %s", name);
+            return NULL;
+        }
     }
-    
-    if(pthread_mutex_init(&newRoom->clientListMutex, NULL) != 0) {
-        printf("ERROR: Failed to initialize client list mutex %s\n", name);
-        free(newRoom);
-        return NULL;
+    if(newRoom->history != NULL) {
+        mem_account_charge(&newRoom->memAccount, historyLen * sizeof(msg_frame_t*));
     }
+    mem_account_charge(&newRoom->memAccount, (int64_t)newRoom->members.capacity * (sizeof(client_t*)+1));
 
-    if(sem_init(&newRoom->sendBuff.empty, SEM_PSHARE, SEND_BUFF_LEN) != 0) {
-        printf("ERROR: Failed to initialize send buff empty sem %s\n", name);
-        free(newRoom);
-        return NULL;
-    }
-    
-    if(sem_init(&newRoom->sendBuff.full, SEM_PSHARE, 0) != 0) {
-        printf("ERROR: Failed to initialize send buff empty sem %s\n", name);
-        free(newRoom);
-        return NULL;
+    // Reset the send ring, a pooled room left it drained
+    for(uint32_t i = 0; i < SEND_BUFF_LEN; i++) {
+        atomic_store_explicit(&newRoom->sendBuff.buff[i].seq, i, memory_order_relaxed);
     }
-    newRoom->sendBuff.removeIdx = 0;
-    newRoom->sendBuff.insertIdx = 0;
+    atomic_store_explicit(&newRoom->sendBuff.insertIdx, 0, memory_order_relaxed);
+    atomic_store_explicit(&newRoom->sendBuff.removeIdx, 0, memory_order_relaxed);
+    atomic_store_explicit(&newRoom->sendBuff.consumer.isQueued, 0, memory_order_relaxed);
+    // Sharded mode runs one sender per shard, so this is the shard owning the room
+    newRoom->sendBuff.consumer.senderId = hash % senders_count();
+
+    newRoom->members.count = 0;
+    newRoom->numStaged = 0;
+    atomic_store_explicit(&newRoom->msgsOut, 0, memory_order_relaxed);
+    atomic_store_explicit(&newRoom->bytesOut, 0, memory_order_relaxed);
+    newRoom->historyHead = 0;
+    newRoom->historyCount = 0;
+    newRoom->historyBytes = 0;
+    newRoom->lastSeq = 0;
+    atomic_store_explicit(&newRoom->numDetached, 0, memory_order_relaxed);
+    newRoom->hashNext = NULL;
 
     // Name
     strcpy(newRoom->name, name);
-
-    // Start the sender thread
-    if(pthread_create(&newRoom->tid, NULL, chatroom_sender, newRoom) != 0) {
-        printf("ERROR: Failed to start chatroom %s sender thread\n", name);
-        free(newRoom);
-        return NULL;
+    newRoom->hash = hash;
+    newRoom->isDormant = 1;
+    init_rate_limits(&newRoom->msgBucket, &newRoom->byteBucket, config.roomMsgRate, config.roomByteRate);
+
+    if(roomlog_enabled()) {
+        newRoom->log = roomlog_open(name);
+        if(newRoom->log == NULL) {
+            LOG_ERROR("Failed to open room log %s", name);
+            close_chatroom(newRoom);
+            return NULL;
+        }
+        if(newRoom->history != NULL) {
+            roomlog_read_tail(newRoom->log, historyLen, restore_history_msg, newRoom);
+        }
     }
 
-    // Add new room to list
-    add_chatroom(newRoom);
-
     return newRoom;
 }
 
 // Add client to chatroom
 // If name doesn't correspond, create new
-static int8_t init_client(int fd, char* roomName, char* clientName, char* buff)
+static int8_t init_client(client_t* client, char* roomName, char* clientName)
 {
     // Check name length
     if(strlen(roomName) > MAX_NAME_LEN || strlen(clientName) > MAX_NAME_LEN) {
         return -1;
     }
     
-    chatroom_t* room = find_chatroom(roomName);
+    uint32_t hash = hash_room_name(roomName);
+    pthread_mutex_t* stripe = room_stripe(hash);
+    pthread_mutex_lock(stripe);
+    chatroom_t* room = find_chatroom(roomName, hash);
     if(room != NULL) {
-        // Found active chatroom
+        // Found chatroom, active or dormant
         // Just add new client to it
-        if(add_client(fd, room, clientName, buff) != 0) {
-            printf("ERROR: Failed to add client %s to %s\n", clientName, roomName);
+        if(add_client(client, room, clientName, 0, 0) != 0) {
+            LOG_ERROR("Failed to add client %s to %s", clientName, roomName);
+            pthread_mutex_unlock(stripe);
             return -1;
         }
+        // Its sender picks it up again with the has joined msg
+        room->isDormant = 0;
     } else {
         // Need to create new chatroom
-        room = init_chatroom(fd, roomName);
+        room = init_chatroom(roomName, hash);
         if(room == NULL) {
-            printf("ERROR: Failed to initialize chatroom %s\n", roomName);
+            LOG_ERROR("Failed to initialize chatroom %s", roomName);
+            pthread_mutex_unlock(stripe);
             return -1;
         }
 
         // Add first client
-        if(add_client(fd, room, clientName, buff) != 0) {
-            printf("ERROR: Failed to initialize first client %s to %s\n", clientName, roomName);
+        if(add_client(client, room, clientName, 0, 0) != 0) {
+            LOG_ERROR("Failed to initialize first client %s to %s", clientName, roomName);
+            pthread_mutex_unlock(stripe);
+            close_chatroom(room);
             return -1;
         }
+        room->isDormant = 0;
+        add_chatroom(room);
     }
+    pthread_mutex_unlock(stripe);
 
     return 0;
 }
 
-// Returns join message length (including null char) if success
-// Returns 0 if keep recv
-// Returns -1 if error
-static int16_t parse_join_msg(char* msg, size_t len, char** clientName, char** roomName)
-{
-    size_t joinMsgLen = 0;
-    size_t tokenLen = 0;
-    char* token = strtok(msg+joinMsgLen, " ");
-    tokenLen = strlen(token); // token will never be null on first strtok call
-    if(tokenLen == len) {
-        // No delimiter
-        if(strchr(token, '\n') == NULL) {
-            // If no \n --> fragmented, need to retry
-            return 0;
-        } else {
-            printf("ERROR: Invalid message header %s\n", token);
-            return -1;
-        }
-        
+// Hash of the room a session belongs to, for picking its shard and stripe
+// Returns -1 if there is no such session
+static int8_t find_session_room(uint64_t token, uint32_t* hash)
+{
+    pthread_mutex_lock(&sessions.mutex);
+    session_t* session = find_session(token);
+    if(session != NULL) {
+        *hash = session->room->hash;
     }
-    if(strcmp(token, "JOIN") != 0) {
-        printf("ERROR: Invalid message header %s\n", token);
+    pthread_mutex_unlock(&sessions.mutex);
+
+    return session != NULL ? 0 : -1;
+}
+
+// Take the session over from its dropped connection, or from one that hasn't noticed yet
+// The room hears nothing, the client gets the broadcasts after lastSeq that the history still holds
+static int8_t resume_client(client_t* client, uint64_t token, uint64_t lastSeq)
+{
+    uint32_t hash;
+    if(find_session_room(token, &hash) != 0) {
+        LOG_ERROR("No session %016" PRIx64 " to resume", token);
         return -1;
     }
-    joinMsgLen += strlen(token) + 1; // +1 include null char
 
-    token = strtok(msg+joinMsgLen, " ");
-    if(strlen(token) == (len-joinMsgLen)) {
-        // No room name
-        if(strchr(token, '\n') == NULL) {
-            // If no \n --> fragmented, need to retry
-            return 0;
-        } else {
-            printf("ERROR: Invalid JOIN msg\n");
-            return -1;
-        }
+    // Stripe first, like a join, then look again in case it expired meanwhile
+    pthread_mutex_t* stripe = room_stripe(hash);
+    pthread_mutex_lock(stripe);
+    pthread_mutex_lock(&sessions.mutex);
+    session_t* session = find_session(token);
+    if(session == NULL) {
+        pthread_mutex_unlock(&sessions.mutex);
+        pthread_mutex_unlock(stripe);
+        LOG_ERROR("Session %016" PRIx64 " expired before it was resumed", token);
+        return -1;
+    }
+    chatroom_t* room = session->room;
+    if(session->client == NULL) {
+        sessions.numDetached--;
+        atomic_fetch_sub_explicit(&room->numDetached, 1, memory_order_relaxed);
+    } else {
+        // It leaves the room without a word once its reactor sees the hangup
+        disconnect_client(session->client);
     }
-    tokenLen = strlen(token);
-    if(strlen(token) > MAX_NAME_LEN ) {
-        // Due to carriage return, the effective max length is 19 chars
-        *roomName = NULL;
-        *clientName = NULL;
-        printf("ERROR: Room name too long %s\n", *roomName);
+    session->client = client;
+    client->sessionToken = token;
+    char name[MAX_NAME_LEN+1];
+    strcpy(name, session->name);
+    pthread_mutex_unlock(&sessions.mutex);
+
+    // Only its holder frees the session, and that is this client now
+    if(add_client(client, room, name, 1, lastSeq) != 0) {
+        LOG_ERROR("Failed to resume client %s in %s", name, room->name);
+        pthread_mutex_lock(&sessions.mutex);
+        session->client = NULL;
+        session->expiresMs = reactor_now_ms() + config.resumeGraceSecs*1000ull;
+        sessions.numDetached++;
+        atomic_fetch_add_explicit(&room->numDetached, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&sessions.mutex);
+        client->sessionToken = 0;
+        pthread_mutex_unlock(stripe);
         return -1;
     }
-    joinMsgLen += tokenLen + 1; // +1 include null char
-    *roomName = token;
-    printf("INFO: Got room name %s\n", *roomName);
+    // Every member may have been detached
+    room->isDormant = 0;
+    pthread_mutex_unlock(stripe);
+    metrics_add(METRIC_SESSIONS_RESUMED, 1);
 
-    token = strtok(msg+joinMsgLen, "\n");
-    if(strlen(token) == (len-joinMsgLen)) {
-        // No client name, keep recv
-        *clientName = NULL;
-        *roomName = NULL;
-        return 0;
+    return 0;
+}
+
+// RESUME carries a hex token and a decimal seq where JOIN has the room and client names
+static int8_t parse_resume_fields(join_parser_t* parser)
+{
+    char* end;
+    parser->resumeToken = strtoull(parser->roomName, &end, 16);
+    if(*end != '\0' || parser->resumeToken == 0) {
+        return -1;
     }
-    tokenLen = strlen(token);
-    if(tokenLen > MAX_NAME_LEN) {
-        // Due to carriage return, the effective max length is 19 chars
-        *clientName = NULL;
-        *roomName = NULL;
-        printf("ERROR: Client name too long\n");
+    errno = 0;
+    parser->resumeSeq = strtoull(parser->clientName, &end, 10);
+    if(*end != '\0' || errno != 0) {
         return -1;
     }
-    joinMsgLen += tokenLen + 1;
-    // Remove carriage return if present
-    if(token[tokenLen-1] == '\r') {
-        token[tokenLen-1] = '\0';
+
+    return 0;
+}
+
+// Resumes where the previous call stopped, so each byte is only parsed once
+// Fields are null terminated in place
+// Returns join message length if success
+// Returns 0 if keep recv
+// Returns -1 if error
+static int16_t parse_join_msg(join_parser_t* parser)
+{
+    while(parser->scanIdx < parser->len) {
+        uint16_t idx = parser->scanIdx++;
+        char c = parser->buff[idx];
+        char* field = parser->buff + parser->fieldIdx;
+        uint16_t fieldLen = idx - parser->fieldIdx;
+
+        switch(parser->state) {
+        case JOIN_PARSE_CMD:
+            if(c != ' ') {
+                if(c == '\n' || fieldLen >= strlen(RESUME_CMD)) {
+                    LOG_ERROR("Invalid message header");
+                    return -1;
+                }
+                break;
+            }
+            parser->buff[idx] = '\0';
+            if(config.resumeGraceSecs > 0 && strcmp(field, RESUME_CMD) == 0) {
+                parser->isResume = 1;
+            } else if(strcmp(field, JOIN_CMD) != 0) {
+                LOG_ERROR("Invalid message header %s", field);
+                return -1;
+            }
+            parser->state = JOIN_PARSE_ROOM;
+            parser->fieldIdx = idx+1;
+            break;
+
+        case JOIN_PARSE_ROOM:
+            if(c == '\n') {
+                LOG_ERROR("Invalid JOIN msg");
+                return -1;
+            }
+            if(c != ' ') {
+                if(fieldLen >= MAX_NAME_LEN) {
+                    LOG_ERROR("Room name too long");
+                    return -1;
+                }
+                break;
+            }
+            if(fieldLen == 0) {
+                LOG_ERROR("Invalid JOIN msg");
+                return -1;
+            }
+            parser->buff[idx] = '\0';
+            parser->roomName = field;
+            parser->state = JOIN_PARSE_NAME;
+            parser->fieldIdx = idx+1;
+            LOG_DEBUG("Got room name %s", parser->roomName);
+            break;
+
+        case JOIN_PARSE_NAME:
+            if(c == ' ') {
+                LOG_ERROR("Invalid client name");
+                return -1;
+            }
+            if(c != '\n') {
+                // +1 leaves room for a trailing carriage return
+                if(fieldLen >= MAX_NAME_LEN+1) {
+                    LOG_ERROR("Client name too long");
+                    return -1;
+                }
+                break;
+            }
+            // Remove carriage return if present
+            if(fieldLen > 0 && field[fieldLen-1] == '\r') {
+                fieldLen--;
+            }
+            if(fieldLen == 0 || fieldLen > MAX_NAME_LEN) {
+                LOG_ERROR("Invalid client name");
+                return -1;
+            }
+            field[fieldLen] = '\0';
+            parser->clientName = field;
+            LOG_DEBUG("Got client name %s", parser->clientName);
+            if(parser->isResume && parse_resume_fields(parser) != 0) {
+                LOG_ERROR("Invalid RESUME msg");
+                return -1;
+            }
+            return idx+1;
+        }
     }
-    *clientName = token;
 
-    // Check if extra spaces in user name
-    if(strchr(*clientName, ' ') != NULL) {
-        *clientName = NULL;
-        *roomName = NULL;
-        printf("ERROR: Invalid client name\n");
+    // Sanity check
+    if(parser->len >= MAX_JOIN_MSG_LEN) {
+        LOG_ERROR("JOIN msg exceeds max length");
         return -1;
     }
-    printf("INFO: Got client name %s\n", *clientName);
 
-    return joinMsgLen;
+    return 0;
 }
 
 static int8_t send_join_error_msg(int fd)
 {
     char msg[] = "ERROR\n";
 
-    if(send(fd, msg, strlen(msg), MSG_NOSIGNAL) != 0) {
+    if(send(fd, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
         int err = errno;
-        printf("ERROR: Failed to send error msg in response to invalid join with err=%d\n", err);
+        LOG_ERROR("Failed to send error msg in response to invalid join with err=%d", err);
         return -1;
     }
 
     return 0;
 }
 
-// New connection
-int8_t new_connection(int fd)
+static void abort_handshake(reactor_t* reactor, client_t* client, uint8_t sendError)
 {
-    // Set a timeout for the first connection message
-    struct timeval tv;
-    tv.tv_sec = CONN_TIMEOUT_SECS;
-    tv.tv_usec = 0;
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) != 0) {
-        int err = errno;
-        printf("ERROR: Failed to set timeout on fd %d with err=%d\n", fd, err);
-        return -1;
+    metrics_add(METRIC_HANDSHAKE_FAILED, 1);
+    reactor_deadline_cancel(reactor, &client->joinDeadline);
+    stop_watching(client);
+    if(sendError) {
+        send_join_error_msg(client->fd);
+    }
+    delete_client(client);
+}
+
+// Handshake is done, add the client to its room and switch to chat msgs
+static void join_client(reactor_t* reactor, client_t* client)
+{
+    join_parser_t* parser = &client->joinParser;
+
+    // Initialize the client connection
+    int8_t ret = parser->isResume ? resume_client(client, parser->resumeToken, parser->resumeSeq) :
+                                    init_client(client, parser->roomName, parser->clientName);
+    if(ret != 0) {
+        LOG_ERROR("Failed to init client. Discarding connection");
+        abort_handshake(reactor, client, 1);
+        return;
     }
 
-    // Attempt to receive proper JOIN message
-    ssize_t numBytes = 0;
-    int16_t joinMsgSize = 0;
-    char buff[JOIN_BUFF_SIZE+1]; // +1 so we can add null char
-    char* clientName = NULL;
-    char* roomName = NULL;
+    start_client(client, parser->isResume, parser->buff+parser->msgLen, parser->len-parser->msgLen);
+    metrics_add(METRIC_HANDSHAKE_OK, 1);
+}
 
-    while(1) {
-        numBytes += recv(fd, buff+numBytes, sizeof(buff)-numBytes, 0); // -1 so we can add null char
-        if(numBytes <= 0) {
-            int err = errno;
-            printf("ERROR: Failed to receive join msg on fd %d with err=%d\n", fd, err);
-            return -1;
-        }
+// Runs on the shard owning the client's room
+static void finish_handover(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
 
-        // Append null char
-        buff[numBytes] = '\0';
+    if(reactor_add(reactor, &client->handle) != 0) {
+        metrics_add(METRIC_HANDSHAKE_FAILED, 1);
+        send_join_error_msg(client->fd);
+        delete_client(client);
+        return;
+    }
+    client->isWatched = 1;
 
-        // Extract room name and client name from message
-        // ret == 1 --> fragmented packet, keep recv
-        joinMsgSize = parse_join_msg(buff, numBytes, &clientName, &roomName);
-        if(joinMsgSize < 0) {
-            // Invalid
-            printf("ERROR: Invalid JOIN msg. Sending error and closing\n");
-            send_join_error_msg(fd);
-            return -1;
-        } else if(joinMsgSize > 0) {
-            // Succesfully found JOIN 
-            break;
-        }
+    join_client(reactor, client);
+}
 
-        // Sanity check
-        if(numBytes >= MAX_JOIN_MSG_LEN) {
-            printf("ERROR: JOIN msg exceeds max length\n");
-            send_join_error_msg(fd);
-            return -1;
+// Central deadline for the first message, fires on the reactor thread
+static void handshake_timeout(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
+    LOG_ERROR("Timed out waiting for join msg on fd %d", client->fd);
+    metrics_add(METRIC_HANDSHAKE_TIMEOUT, 1);
+    // Deadline already fired, nothing left to cancel
+    stop_watching(client);
+    delete_client(client);
+}
+
+static void chatroom_handshake(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
+    join_parser_t* parser = &client->joinParser;
+
+    ssize_t numBytes = recv(client->fd, parser->buff+parser->len, JOIN_BUFF_SIZE-parser->len, MSG_DONTWAIT);
+    if(numBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if(numBytes <= 0) {
+        int err = errno;
+        LOG_ERROR("Failed to receive join msg on fd %d with err=%d", client->fd, err);
+        abort_handshake(reactor, client, 0);
+        return;
+    }
+    parser->len += numBytes;
+    parser->buff[parser->len] = '\0';
+
+    // Extract room name and client name from message
+    int16_t joinMsgSize = parse_join_msg(parser);
+    if(joinMsgSize < 0) {
+        // Invalid
+        LOG_ERROR("Invalid JOIN msg. Sending error and closing");
+        abort_handshake(reactor, client, 1);
+        return;
+    } else if(joinMsgSize == 0) {
+        // Fragmented, keep recv
+        return;
+    }
+    reactor_deadline_cancel(reactor, &client->joinDeadline);
+    parser->msgLen = joinMsgSize;
+
+    if(config.isSharded) {
+        uint32_t hash = hash_room_name(parser->roomName);
+        if(parser->isResume && find_session_room(parser->resumeToken, &hash) != 0) {
+            LOG_ERROR("No session %016" PRIx64 " to resume", parser->resumeToken);
+            abort_handshake(reactor, client, 1);
+            return;
+        }
+        reactor_t* owner = room_shard(hash);
+        if(owner != reactor) {
+            // Wrong shard, the owner picks the socket up and finishes the join
+            stop_watching(client);
+            client->reactor = owner;
+            client->startTask.cb = finish_handover;
+            if(reactor_post(owner, &client->startTask) != 0) {
+                metrics_add(METRIC_HANDSHAKE_FAILED, 1);
+                send_join_error_msg(client->fd);
+                delete_client(client);
+            }
+            return;
         }
     }
-    
-    // Initialize the client connection
-    if(init_client(fd, roomName, clientName, buff+joinMsgSize) != 0) {
-        printf("ERROR: Failed to init client. Discarding connection\n");
-        send_join_error_msg(fd);
+
+    join_client(reactor, client);
+}
+
+// Runs on the reactor thread the connection was handed to
+static void start_handshake(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    client_t* client = (client_t*)ctx;
+
+    if(reactor_add(reactor, &client->handle) != 0) {
+        metrics_add(METRIC_HANDSHAKE_FAILED, 1);
+        delete_client(client);
+        return;
+    }
+    client->isWatched = 1;
+
+    // Set a timeout for the first connection message
+    reactor_deadline_arm(reactor, &client->joinDeadline, CONN_TIMEOUT_SECS*1000);
+}
+
+// New connection
+// Never blocks, the JOIN handshake is driven by the given reactor
+int8_t new_connection(reactor_t* reactor, int fd)
+{
+    if(fd < 0) {
+        return -1;
+    }
+
+    client_t* client = acquire_client();
+    if(client == NULL) {
+        LOG_ERROR("Failed to allocate client for fd %d", fd);
         return -1;
     }
+    client->joinParser.state = JOIN_PARSE_CMD;
 
-    // Set no timeout for the subsequent messages
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) != 0) {
+    // Reads and writes are all driven by the reactor
+    // io_uring parks blocked requests itself and only wants blocking sockets
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags >= 0) {
+        flags = reactor_backend() == REACTOR_BACKEND_URING ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    }
+    if(flags < 0 || fcntl(fd, F_SETFL, flags) != 0) {
         int err = errno;
-        printf("ERROR: Failed to remove timeout on fd %d with err=%d\n", fd, err);
+        LOG_ERROR("Failed to set the blocking mode of fd %d with err=%d", fd, err);
+        release_client(client);
+        return -1;
+    }
+
+    client->fd = fd;
+    client->reactor = reactor;
+    client->handle.fd = fd;
+    client->handle.events = CLIENT_EVENTS;
+    client->handle.cb = chatroom_handshake;
+    client->handle.ctx = client;
+    client->joinDeadline.cb = handshake_timeout;
+    client->joinDeadline.ctx = client;
+    client->resumeDeadline.cb = resume_reads;
+    client->resumeDeadline.ctx = client;
+    client->errorDeadline.cb = retry_error_msg;
+    client->errorDeadline.ctx = client;
+    client->livenessDeadline.cb = check_liveness;
+    client->livenessDeadline.ctx = client;
+    client->startTask.cb = start_handshake;
+    client->startTask.ctx = client;
+    client->flushTask.cb = flush_client;
+    client->flushTask.ctx = client;
+    client->sendReq.fd = fd;
+    client->sendReq.cb = client_sent;
+    client->sendReq.ctx = client;
+    // Older kernels can't, the client just sends copied
+    if(config.zerocopyThreshold > 0 && zerocopy_enable(fd) != 0) {
+        client->outQueue.isZerocopyOff = 1;
+    }
+
+    if(reactor_post(client->reactor, &client->startTask) != 0) {
+        release_client(client);
         return -1;
     }
+    metrics_add(METRIC_CONNECTIONS, 1);
 
     return 0;
-}
\ No newline at end of file
+}
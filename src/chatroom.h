@@ -3,8 +3,74 @@
 
 #include <stdint.h>
 #include <pthread.h>
-#include <semaphore.h>
 
-int8_t new_connection(int fd);
+#include "reactor.h"
+
+typedef enum {
+    SLOW_CONSUMER_DROP_OLDEST,
+    SLOW_CONSUMER_DROP_NEWEST,
+    SLOW_CONSUMER_DISCONNECT,
+    NUM_SLOW_CONSUMER_POLICY,
+} slow_consumer_policy_t;
+
+typedef struct chatroom_config_s {
+    slow_consumer_policy_t slowConsumerPolicy;
+    uint32_t outQueueHighWatermark; // queued msgs per client before the policy applies
+    uint8_t isSharded;              // each room is owned by one reactor, joiners are handed over to it
+    uint32_t largeRoomThreshold;    // members above which broadcasts are split across the fan-out workers
+    uint32_t fanoutWorkers;
+    uint32_t scrollbackMsgs;        // newest broadcasts each room replays to joiners, 0 disables
+    uint32_t scrollbackBytes;       // cap on the bytes those msgs hold
+    uint32_t clientMsgRate;         // msgs/s each member may send, 0 is unlimited
+    uint32_t clientByteRate;        // chat bytes/s each member may send
+    uint32_t roomMsgRate;           // msgs/s all members of a room may send together
+    uint32_t roomByteRate;
+    uint32_t roomSenders;           // threads shared by every room's sender, one per reactor when sharded
+    uint32_t zerocopyThreshold;     // msgs at least this big are sent with MSG_ZEROCOPY, 0 disables, epoll only
+    uint32_t idleSecs;              // joined clients silent this long are dropped, 0 disables
+    uint32_t keepaliveSecs;         // silent clients are sent PING this often and may answer PONG, 0 disables
+    uint32_t sendStallSecs;         // clients whose queued msgs don't move this long are dropped, 0 disables
+    uint32_t resumeGraceSecs;       // dropped clients may resume their session this long, broadcasts carry a seq, 0 disables
+} chatroom_config_t;
+
+// Number of times each slow consumer policy action was taken
+typedef struct slow_consumer_stats_s {
+    uint64_t droppedOldest;
+    uint64_t droppedNewest;
+    uint64_t disconnected;
+} slow_consumer_stats_t;
+
+// What a room costs right now
+typedef struct room_stats_s {
+    const char* name;   // only valid inside the callback
+    uint32_t numClients;
+    uint64_t memBytes;  // room itself, frames it holds and its members' queue slots
+    uint64_t numFrames;
+    uint64_t msgsOut;   // broadcasts fanned out since the room was created
+    uint64_t bytesOut;
+    uint32_t sendBuffUsed;
+    uint32_t sendBuffLen;
+} room_stats_t;
+
+typedef void (*room_stats_cb_t)(const room_stats_t* stats, void* ctx);
+
+// Per member, names are only valid inside the callback
+typedef struct client_stats_s {
+    const char* room;
+    const char* name;
+    uint32_t queuedMsgs;    // send backlog waiting on the socket
+} client_stats_t;
+
+typedef void (*client_stats_cb_t)(const client_stats_t* stats, void* ctx);
+
+void chatroom_default_config(chatroom_config_t* config);
+void chatroom_configure(const chatroom_config_t* config);
+void chatroom_get_slow_consumer_stats(slow_consumer_stats_t* stats);
+void chatroom_foreach_room_stats(room_stats_cb_t cb, void* ctx);
+void chatroom_foreach_client_stats(client_stats_cb_t cb, void* ctx);
+
+// Call once after the reactors are started
+int8_t chatroom_start(void);
+int8_t new_connection(reactor_t* reactor, int fd);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "fanout.h"
+#include "logger.h"
+
+// Shared by every room, jobs are taken in submission order
+static pthread_mutex_t jobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+static fanout_job_t* jobHead = NULL;
+static fanout_job_t* jobTail = NULL;
+static uint32_t numWorkers = 0;
+
+static void* fanout_worker(void* input)
+{
+    while(1) {
+        pthread_mutex_lock(&jobMutex);
+        while(jobHead == NULL) {
+            pthread_cond_wait(&jobReady, &jobMutex);
+        }
+        fanout_job_t* job = jobHead;
+        jobHead = job->next;
+        if(jobHead == NULL) {
+            jobTail = NULL;
+        }
+        pthread_mutex_unlock(&jobMutex);
+
+        // Group lives on the submitter's stack, don't touch the job after signalling
+        fanout_group_t* group = job->group;
+        job->fn(job->ctx);
+
+        pthread_mutex_lock(&group->mutex);
+        if(--group->pending == 0) {
+            pthread_cond_signal(&group->done);
+        }
+        pthread_mutex_unlock(&group->mutex);
+    }
+
+    return NULL;
+}
+
+int8_t fanout_start(uint32_t count)
+{
+    if(count > MAX_FANOUT_WORKERS) {
+        LOG_ERROR("Invalid number of fan-out workers %u", count);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < count; i++) {
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, fanout_worker, NULL) != 0) {
+            LOG_ERROR("Failed to start fan-out worker %u", i);
+            return -1;
+        }
+        pthread_detach(tid);
+        numWorkers++;
+    }
+
+    LOG_INFO("Started %u fan-out worker(s)", numWorkers);
+    return 0;
+}
+
+uint32_t fanout_num_workers(void)
+{
+    return numWorkers;
+}
+
+int8_t fanout_group_init(fanout_group_t* group)
+{
+    group->pending = 0;
+    if(pthread_mutex_init(&group->mutex, NULL) != 0) {
+        return -1;
+    }
+    if(pthread_cond_init(&group->done, NULL) != 0) {
+        pthread_mutex_destroy(&group->mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+void fanout_group_destroy(fanout_group_t* group)
+{
+    pthread_cond_destroy(&group->done);
+    pthread_mutex_destroy(&group->mutex);
+}
+
+void fanout_submit(fanout_group_t* group, fanout_job_t* job)
+{
+    job->group = group;
+    job->next = NULL;
+
+    pthread_mutex_lock(&group->mutex);
+    group->pending++;
+    pthread_mutex_unlock(&group->mutex);
+
+    pthread_mutex_lock(&jobMutex);
+    if(jobTail == NULL) {
+        jobHead = job;
+    } else {
+        jobTail->next = job;
+    }
+    jobTail = job;
+    pthread_cond_signal(&jobReady);
+    pthread_mutex_unlock(&jobMutex);
+}
+
+void fanout_wait(fanout_group_t* group)
+{
+    pthread_mutex_lock(&group->mutex);
+    while(group->pending > 0) {
+        pthread_cond_wait(&group->done, &group->mutex);
+    }
+    pthread_mutex_unlock(&group->mutex);
+}
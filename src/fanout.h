@@ -0,0 +1,34 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_FANOUT_WORKERS  (32)
+
+typedef void (*fanout_fn_t)(void* ctx);
+
+// Jobs submitted together, the submitter waits for all of them
+typedef struct fanout_group_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    uint32_t pending;
+} fanout_group_t;
+
+// Embedded in whatever the job works on, must outlive fanout_wait
+typedef struct fanout_job_s {
+    fanout_fn_t fn;
+    void* ctx;
+    fanout_group_t* group;
+    struct fanout_job_s* next;
+} fanout_job_t;
+
+int8_t fanout_start(uint32_t numWorkers);
+uint32_t fanout_num_workers(void);
+
+int8_t fanout_group_init(fanout_group_t* group);
+void fanout_group_destroy(fanout_group_t* group);
+void fanout_submit(fanout_group_t* group, fanout_job_t* job);
+void fanout_wait(fanout_group_t* group);
+
+#endif
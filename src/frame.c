@@ -0,0 +1,54 @@
+#include <stdlib.h>
+
+#include "frame.h"
+#include "slab.h"
+
+void mem_account_charge(mem_account_t* account, int64_t bytes)
+{
+    if(account != NULL) {
+        atomic_fetch_add_explicit(&account->bytes, bytes, memory_order_relaxed);
+    }
+}
+
+// Returned with a single reference held by the caller
+// Storage comes from the slab class that fits, so a short line costs 64 bytes not MAX_MSG_SIZE
+msg_frame_t* frame_alloc(uint32_t size, mem_account_t* account)
+{
+    uint8_t sizeClass;
+    msg_frame_t* frame = (msg_frame_t*)slab_alloc(sizeof(msg_frame_t) + size, &sizeClass);
+    if(frame == NULL) {
+        return NULL;
+    }
+    atomic_init(&frame->refCount, 1);
+    frame->size = size;
+    frame->sizeClass = sizeClass;
+    frame->account = account;
+    frame->cost = sizeClass == SLAB_LARGE_CLASS ? sizeof(msg_frame_t) + size : slab_class_size(sizeClass);
+
+    if(account != NULL) {
+        mem_account_charge(account, frame->cost);
+        atomic_fetch_add_explicit(&account->frames, 1, memory_order_relaxed);
+    }
+
+    return frame;
+}
+
+void frame_ref(msg_frame_t* frame)
+{
+    atomic_fetch_add_explicit(&frame->refCount, 1, memory_order_relaxed);
+}
+
+void frame_unref(msg_frame_t* frame)
+{
+    // Release so writes to the frame happen before whoever frees it
+    if(atomic_fetch_sub_explicit(&frame->refCount, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    mem_account_t* account = frame->account;
+    if(account != NULL) {
+        mem_account_charge(account, -(int64_t)frame->cost);
+        atomic_fetch_sub_explicit(&account->frames, 1, memory_order_relaxed);
+    }
+    slab_free(frame, frame->sizeClass);
+}
@@ -0,0 +1,30 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Bytes held on behalf of one room, charged at slab class size
+typedef struct mem_account_s {
+    atomic_int_fast64_t bytes;
+    atomic_int_fast64_t frames;
+} mem_account_t;
+
+// Formatted msg shared by every recipient, immutable once published
+// Freed when the last queue holding it lets go
+typedef struct msg_frame_s {
+    atomic_uint refCount;
+    uint32_t size;
+    mem_account_t* account;
+    uint32_t cost;      // bytes charged to the account
+    uint8_t sizeClass;
+    char data[];
+} msg_frame_t;
+
+msg_frame_t* frame_alloc(uint32_t size, mem_account_t* account);
+void frame_ref(msg_frame_t* frame);
+void frame_unref(msg_frame_t* frame);
+
+void mem_account_charge(mem_account_t* account, int64_t bytes);
+
+#endif
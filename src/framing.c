@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "framing.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// SSE2 is always there on x86-64
+static const char* find_newline_sse2(const char* start, const char* end)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    while(end - start >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)start);
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        if(mask != 0) {
+            return start + __builtin_ctz(mask);
+        }
+        start += 16;
+    }
+
+    while(start < end && *start != '\n') {
+        start++;
+    }
+    return start;
+}
+
+__attribute__((target("avx2")))
+static const char* find_newline_avx2(const char* start, const char* end)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while(end - start >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)start);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        if(mask != 0) {
+            return start + __builtin_ctz(mask);
+        }
+        start += 32;
+    }
+
+    return find_newline_sse2(start, end);
+}
+
+static const char* (*find_newline_impl)(const char*, const char*) = find_newline_sse2;
+
+// Picked once at load, before any reactor runs
+__attribute__((constructor))
+static void pick_find_newline(void)
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        find_newline_impl = find_newline_avx2;
+    }
+}
+
+// Returns end if there is no \n in [start, end)
+const char* find_newline(const char* start, const char* end)
+{
+    return find_newline_impl(start, end);
+}
+
+#else
+
+const char* find_newline(const char* start, const char* end)
+{
+    const char* found = (const char*)memchr(start, '\n', end - start);
+    return found == NULL ? end : found;
+}
+
+#endif
+
+int8_t recv_ring_init(recv_ring_t* ring, uint32_t capacity)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->buff = (char*)malloc(capacity);
+    if(ring->buff == NULL) {
+        return -1;
+    }
+    ring->capacity = capacity;
+
+    return 0;
+}
+
+void recv_ring_free(recv_ring_t* ring)
+{
+    free(ring->buff);
+    ring->buff = NULL;
+}
+
+// Forget everything received, the buffer is kept
+void recv_ring_reset(recv_ring_t* ring)
+{
+    ring->head = 0;
+    ring->scanned = 0;
+    ring->tail = 0;
+}
+
+// Bytes received but not yet returned as a line
+uint32_t recv_ring_pending(const recv_ring_t* ring)
+{
+    return ring->tail - ring->head;
+}
+
+// Free space as at most two segments, so a single readv fills the ring without moving anything
+// Returns the number of segments, 0 if the ring is full
+uint8_t recv_ring_write_iov(recv_ring_t* ring, struct iovec iov[2])
+{
+    uint32_t space = ring->capacity - recv_ring_pending(ring);
+    if(space == 0) {
+        return 0;
+    }
+
+    uint32_t offset = ring->tail & (ring->capacity-1);
+    uint32_t first = ring->capacity - offset;
+    if(first > space) {
+        first = space;
+    }
+    iov[0].iov_base = ring->buff + offset;
+    iov[0].iov_len = first;
+    if(first == space) {
+        return 1;
+    }
+    iov[1].iov_base = ring->buff;
+    iov[1].iov_len = space - first;
+
+    return 2;
+}
+
+void recv_ring_commit(recv_ring_t* ring, uint32_t len)
+{
+    ring->tail += len;
+}
+
+// Copy bytes in, returns how many fit
+uint32_t recv_ring_append(recv_ring_t* ring, const char* data, uint32_t len)
+{
+    struct iovec iov[2];
+    uint8_t numIov = recv_ring_write_iov(ring, iov);
+    uint32_t copied = 0;
+    for(uint8_t i = 0; i < numIov && copied < len; i++) {
+        uint32_t chunk = len - copied < iov[i].iov_len ? len - copied : iov[i].iov_len;
+        memcpy(iov[i].iov_base, data + copied, chunk);
+        copied += chunk;
+    }
+    recv_ring_commit(ring, copied);
+
+    return copied;
+}
+
+// Find the next complete line without popping it, resuming the scan where the last call gave up
+// Peeking again returns the same line until it is consumed
+// Returns 0 if only a partial line is left
+uint8_t recv_ring_peek_line(recv_ring_t* ring, recv_line_t* line)
+{
+    uint32_t mask = ring->capacity-1;
+    while(ring->scanned != ring->tail) {
+        // Scan up to the tail or the end of the buffer, whichever is first
+        uint32_t offset = ring->scanned & mask;
+        uint32_t avail = ring->tail - ring->scanned;
+        if(avail > ring->capacity - offset) {
+            avail = ring->capacity - offset;
+        }
+        const char* start = ring->buff + offset;
+        const char* newline = find_newline(start, start + avail);
+        ring->scanned += newline - start;
+        if(newline == start + avail) {
+            continue;
+        }
+
+        // Slice [head, scanned) without the \n
+        uint32_t lineLen = ring->scanned - ring->head;
+        uint32_t headOffset = ring->head & mask;
+        uint32_t first = ring->capacity - headOffset;
+        if(first > lineLen) {
+            first = lineLen;
+        }
+        line->part[0] = ring->buff + headOffset;
+        line->len[0] = first;
+        line->part[1] = ring->buff;
+        line->len[1] = lineLen - first;
+
+        // Drop the \r of a \r\n
+        if(line->len[1] > 0 && line->part[1][line->len[1]-1] == '\r') {
+            line->len[1]--;
+        } else if(line->len[1] == 0 && first > 0 && line->part[0][first-1] == '\r') {
+            line->len[0]--;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Drop the line the last peek returned, scanned sits on its \n
+void recv_ring_consume_line(recv_ring_t* ring)
+{
+    ring->scanned++;
+    ring->head = ring->scanned;
+}
+
+// Pop the next complete line
+// Returns 0 if only a partial line is left
+uint8_t recv_ring_next_line(recv_ring_t* ring, recv_line_t* line)
+{
+    if(!recv_ring_peek_line(ring, line)) {
+        return 0;
+    }
+
+    recv_ring_consume_line(ring);
+    return 1;
+}
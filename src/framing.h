@@ -0,0 +1,37 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Receive buffer indexed by free running counters, bytes are never moved once received
+// Capacity must be a power of 2
+typedef struct recv_ring_s {
+    char* buff;
+    uint32_t capacity;
+    uint32_t head;      // first byte of the current line
+    uint32_t scanned;   // bytes up to here are known not to hold a \n
+    uint32_t tail;      // end of received bytes
+} recv_ring_t;
+
+// One line without its \n or \r\n, split in two when it wraps around the ring
+// Only valid until the ring is written to again
+typedef struct recv_line_s {
+    const char* part[2];
+    uint32_t len[2];
+} recv_line_t;
+
+const char* find_newline(const char* start, const char* end);
+
+int8_t recv_ring_init(recv_ring_t* ring, uint32_t capacity);
+void recv_ring_free(recv_ring_t* ring);
+void recv_ring_reset(recv_ring_t* ring);
+uint32_t recv_ring_pending(const recv_ring_t* ring);
+uint8_t recv_ring_write_iov(recv_ring_t* ring, struct iovec iov[2]);
+void recv_ring_commit(recv_ring_t* ring, uint32_t len);
+uint32_t recv_ring_append(recv_ring_t* ring, const char* data, uint32_t len);
+uint8_t recv_ring_peek_line(recv_ring_t* ring, recv_line_t* line);
+void recv_ring_consume_line(recv_ring_t* ring);
+uint8_t recv_ring_next_line(recv_ring_t* ring, recv_line_t* line);
+
+#endif
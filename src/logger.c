@@ -0,0 +1,311 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define LOG_RING_LEN        (128)   // records per thread, power of 2
+#define LOG_TEXT_LEN        (224)
+#define LOG_SITE_BURST      (20)    // lines per call site per second before suppressing
+#define LOG_IDLE_SLEEP_US   (5000)
+#define LOG_OUT_BUFF_SIZE   (64*1024)
+
+typedef struct log_record_s {
+    uint64_t timeNs;        // CLOCK_REALTIME
+    uint32_t suppressed;    // similar lines dropped by the rate limit before this one
+    uint16_t len;
+    uint8_t level;
+    char text[LOG_TEXT_LEN];
+} log_record_t;
+
+// Single producer, the owning thread, and single consumer, the logger thread
+typedef struct log_ring_s {
+    log_record_t records[LOG_RING_LEN];
+    atomic_uint head;       // consumer position
+    atomic_uint tail;       // producer position
+    atomic_uint dropped;    // ring was full
+    atomic_int isRetired;   // owner exited, freed once drained
+    uint32_t threadId;
+    struct log_ring_s* next;
+} log_ring_t;
+
+log_level_t logLevel = LOG_LEVEL_INFO;
+
+static const char* levelNames[NUM_LOG_LEVELS] = {
+    [LOG_LEVEL_DEBUG] = "DEBUG",
+    [LOG_LEVEL_INFO] = "INFO",
+    [LOG_LEVEL_WARN] = "WARN",
+    [LOG_LEVEL_ERROR] = "ERROR",
+};
+
+static pthread_mutex_t ringListMutex = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t* ringList = NULL;
+static atomic_uint nextThreadId;
+
+static __thread log_ring_t* threadRing = NULL;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static void retire_thread_ring(void* input)
+{
+    log_ring_t* ring = (log_ring_t*)input;
+    atomic_store_explicit(&ring->isRetired, 1, memory_order_release);
+}
+
+static void create_ring_key(void)
+{
+    pthread_key_create(&ringKey, retire_thread_ring);
+}
+
+static log_ring_t* register_thread_ring(void)
+{
+    log_ring_t* ring = (log_ring_t*)calloc(1, sizeof(log_ring_t));
+    if(ring == NULL) {
+        return NULL;
+    }
+    ring->threadId = atomic_fetch_add_explicit(&nextThreadId, 1, memory_order_relaxed);
+
+    pthread_once(&ringKeyOnce, create_ring_key);
+    pthread_setspecific(ringKey, ring);
+
+    pthread_mutex_lock(&ringListMutex);
+    ring->next = ringList;
+    ringList = ring;
+    pthread_mutex_unlock(&ringListMutex);
+
+    threadRing = ring;
+    return ring;
+}
+
+// Returns the number of lines suppressed since the last one let through, or -1 to suppress this one
+static int64_t check_rate_limit(log_site_t* site)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint32_t now = (uint32_t)ts.tv_sec;
+
+    uint32_t window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if(window != now && atomic_compare_exchange_strong_explicit(&site->window, &window, now,
+                                                                memory_order_relaxed, memory_order_relaxed)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    }
+
+    if(atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= LOG_SITE_BURST) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    return atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+}
+
+static void write_all(const char* data, size_t len)
+{
+    while(len > 0) {
+        ssize_t ret = write(STDOUT_FILENO, data, len);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += ret;
+        len -= ret;
+    }
+}
+
+// Room for LOG_TEXT_LEN + 128 bytes
+static size_t format_record(const log_record_t* record, uint32_t threadId, char* out)
+{
+    time_t secs = record->timeNs / 1000000000ull;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    size_t len = strftime(out, 32, "%H:%M:%S", &tm);
+    len += sprintf(out + len, ".%06lu [t%u] %s: %.*s", (unsigned long)(record->timeNs % 1000000000ull) / 1000,
+                   threadId, levelNames[record->level], record->len, record->text);
+    if(record->suppressed > 0) {
+        len += sprintf(out + len, " (%u similar suppressed)", record->suppressed);
+    }
+    out[len++] = '\n';
+
+    return len;
+}
+
+static void render_record(log_record_t* record, log_level_t level, uint32_t suppressed, const char* fmt, va_list args)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->timeNs = (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+    record->level = level;
+    record->suppressed = suppressed;
+
+    int len = vsnprintf(record->text, LOG_TEXT_LEN, fmt, args);
+    if(len < 0) {
+        len = 0;
+    } else if(len >= LOG_TEXT_LEN) {
+        len = LOG_TEXT_LEN-1;
+    }
+    record->len = len;
+}
+
+void log_write(log_site_t* site, log_level_t level, const char* fmt, ...)
+{
+    int64_t suppressed = check_rate_limit(site);
+    if(suppressed < 0) {
+        return;
+    }
+
+    log_ring_t* ring = threadRing;
+    if(ring == NULL && (ring = register_thread_ring()) == NULL) {
+        return;
+    }
+
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_LEN) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    // Args may point at buffers that are gone by the time the logger runs, so render the text now
+    log_record_t* record = &ring->records[tail & (LOG_RING_LEN-1)];
+    va_list args;
+    va_start(args, fmt);
+    render_record(record, level, (uint32_t)suppressed, fmt, args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->tail, tail+1, memory_order_release);
+}
+
+// Format whatever the ring holds, returns the number of records taken
+static uint32_t drain_ring(log_ring_t* ring, char* out, size_t* outLen)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t taken = 0;
+
+    uint32_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if(dropped > 0) {
+        *outLen += sprintf(out + *outLen, "WARN: [t%u] Log ring full, dropped %u record(s)\n", ring->threadId, dropped);
+    }
+
+    while(head != tail) {
+        // Worst case record plus prefix and suppression note
+        if(*outLen + LOG_TEXT_LEN + 128 > LOG_OUT_BUFF_SIZE) {
+            write_all(out, *outLen);
+            *outLen = 0;
+        }
+
+        *outLen += format_record(&ring->records[head & (LOG_RING_LEN-1)], ring->threadId, out + *outLen);
+
+        head++;
+        taken++;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+
+    return taken;
+}
+
+// Takes the ring list mutex, so the logger thread and log_flush never drain at the same time
+static uint32_t drain_all_rings(void)
+{
+    static char out[LOG_OUT_BUFF_SIZE];
+    size_t outLen = 0;
+    uint32_t taken = 0;
+
+    pthread_mutex_lock(&ringListMutex);
+    log_ring_t** link = &ringList;
+    while(*link != NULL) {
+        log_ring_t* ring = *link;
+        // Check before draining so nothing published before the owner exited is missed
+        int isRetired = atomic_load_explicit(&ring->isRetired, memory_order_acquire);
+        taken += drain_ring(ring, out, &outLen);
+        if(isRetired) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    if(outLen > 0) {
+        write_all(out, outLen);
+    }
+    pthread_mutex_unlock(&ringListMutex);
+
+    return taken;
+}
+
+void log_write_direct(log_level_t level, const char* fmt, ...)
+{
+    if(level < logLevel) {
+        return;
+    }
+
+    log_ring_t* ring = threadRing;
+    if(ring == NULL && (ring = register_thread_ring()) == NULL) {
+        return;
+    }
+
+    log_record_t record;
+    va_list args;
+    va_start(args, fmt);
+    render_record(&record, level, 0, fmt, args);
+    va_end(args);
+
+    char out[LOG_TEXT_LEN + 128];
+    size_t len = format_record(&record, ring->threadId, out);
+    // Lines the thread logged before still come out first
+    drain_all_rings();
+    // Held like a drain so the line never lands in the middle of the logger's output
+    pthread_mutex_lock(&ringListMutex);
+    write_all(out, len);
+    pthread_mutex_unlock(&ringListMutex);
+}
+
+static void* logger_loop(void* input)
+{
+    while(1) {
+        if(drain_all_rings() == 0) {
+            usleep(LOG_IDLE_SLEEP_US);
+        }
+    }
+
+    return NULL;
+}
+
+// For exit paths, writes out everything logged so far on the calling thread
+void log_flush(void)
+{
+    drain_all_rings();
+}
+
+int8_t log_parse_level(const char* name, log_level_t* level)
+{
+    for(uint32_t i = 0; i < NUM_LOG_LEVELS; i++) {
+        if(strcasecmp(name, levelNames[i]) == 0) {
+            *level = (log_level_t)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Records logged before this are kept and written once the thread is up
+int8_t log_start(log_level_t level)
+{
+    logLevel = level;
+
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, logger_loop, NULL) != 0) {
+        printf("ERROR: Failed to start logger thread\n");
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
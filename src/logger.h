@@ -0,0 +1,46 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    NUM_LOG_LEVELS,
+} log_level_t;
+
+// One per call site, caps how often that line can be logged
+typedef struct log_site_s {
+    atomic_uint window;     // second the count belongs to
+    atomic_uint count;
+    atomic_uint suppressed;
+} log_site_t;
+
+extern log_level_t logLevel;
+
+// Never blocks, the text is captured into the calling thread's ring and written out by the logger thread
+void log_write(log_site_t* site, log_level_t level, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+// Skips the rate limit and the ring and writes the line out before returning
+// For bulk output off the hot paths, such as the stats dump, that the ring would drop
+void log_write_direct(log_level_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+int8_t log_start(log_level_t level);
+void log_flush(void);
+int8_t log_parse_level(const char* name, log_level_t* level);
+
+#define LOG_AT(level, ...) do { \
+        static log_site_t logSite; \
+        if((level) >= logLevel) { \
+            log_write(&logSite, (level), __VA_ARGS__); \
+        } \
+    } while(0)
+
+#define LOG_DEBUG(...)  LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)   LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)   LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...)  LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -1,79 +1,528 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <netinet/in.h> 
+#include <netinet/tcp.h>
 #include <sys/socket.h> 
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
 
+#include "admin.h"
 #include "chatroom.h"
+#include "fanout.h"
+#include "logger.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "roomlog.h"
+#include "senders.h"
+#include "slab.h"
 
 #define TCP_PORT_MIN        (49512)
 #define TCP_PORT_MAX        (65535)
 #define DEFAULT_TCP_PORT
+#define DEFAULT_REACTORS    (1)
+#define DEFAULT_LISTEN_BACKLOG  (1024)  // the kernel caps it at net.core.somaxconn
+#define ACCEPT_RETRY_MS     (100)   // io_uring backend, before a failed multishot accept is started again
+#define USAGE               "Usage: chat_server [-r reactors] [-s] [-k backlog] [-D defer_secs] [-q queue_len] [-p oldest|newest|disconnect] [-l large_room] [-w workers] [-W room_senders] [-z zerocopy_bytes] [-I idle_secs] [-K ping_secs] [-S stall_secs] [-R resume_secs, prefixes broadcasts with \"seq \"] [-a admin_port] [-u admin_socket] [-b scrollback_msgs] [-B scrollback_bytes] [-m client_msgs/s] [-M client_bytes/s] [-g room_msgs/s] [-G room_bytes/s] [-d log_dir] [-i epoll|uring] [-v debug|info|warn|error] [opt: port]\n"
 
+static const char* slowConsumerPolicyNames[NUM_SLOW_CONSUMER_POLICY] = {
+    [SLOW_CONSUMER_DROP_OLDEST] = "oldest",
+    [SLOW_CONSUMER_DROP_NEWEST] = "newest",
+    [SLOW_CONSUMER_DISCONNECT] = "disconnect",
+};
 
-int main(int argc, char* argv[])
+static const char* backendNames[NUM_REACTOR_BACKEND] = {
+    [REACTOR_BACKEND_EPOLL] = "epoll",
+    [REACTOR_BACKEND_URING] = "uring",
+};
+
+static volatile sig_atomic_t dumpStatsRequested = 0;
+
+// Kept open so a listener out of fds can still accept and close what is waiting
+// Otherwise the level triggered listener would spin on EMFILE
+static int spareFd = -1;
+
+typedef struct listen_config_s {
+    uint32_t backlog;
+    uint32_t deferSecs;     // TCP_DEFER_ACCEPT, 0 hands connections over as soon as they are established
+} listen_config_t;
+
+// One SO_REUSEPORT listener per shard, the kernel spreads connections across them
+// Unsharded there is a single one on the first reactor, which spreads its connections over all of them
+typedef struct listener_s {
+    reactor_handle_t handle;
+    reactor_task_t startTask;
+    reactor_deadline_t retryDeadline;
+    uint8_t isSharded;
+} listener_t;
+
+static listener_t listeners[MAX_REACTORS];
+
+static void request_stats_dump(int sig)
 {
-    if(argc > 2) {
-        printf("Usage: chat_server [opt: port]\n");
+    dumpStatsRequested = 1;
+}
+
+static void print_room_stats(const room_stats_t* stats, void* ctx)
+{
+    log_write_direct(LOG_LEVEL_INFO, "Room %s clients=%u bytes=%" PRIu64 " frames=%" PRIu64,
+                     stats->name, stats->numClients, stats->memBytes, stats->numFrames);
+}
+
+// kill -USR1 prints what every room costs, written out directly so the rate limit drops no room
+static void dump_stats(void)
+{
+    log_write_direct(LOG_LEVEL_INFO, "Slab reserved bytes=%" PRIu64, slab_reserved_bytes());
+    chatroom_foreach_room_stats(print_room_stats, NULL);
+}
+
+// Returns the listening fd or -1
+static int open_listener(uint32_t port, uint8_t reusePort, const listen_config_t* listenConfig)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0) {
+        int err = errno;
+        LOG_ERROR("Failed to create listening socket with err=%d", err);
         return -1;
     }
-    
-    uint32_t port = 0;
-    if(argc == 2) {
-        port = strtoul(argv[1], NULL, 10);
-        if(port > TCP_PORT_MAX || port < TCP_PORT_MIN) {
-            printf("ERROR: Invalid port. Please pick port between %u and %u\n", TCP_PORT_MIN, TCP_PORT_MAX);
-            return -1;
-        }
-        printf("INFO: Using desired port %u\n", port);
-    } else {
-        port = 1234;
-        printf("INFO: Using default port %u\n", port);
-    }
 
-    int listen_fd = -1;
-    int connect_fd = -1;
-    struct sockaddr_in serverAddr, clientAddr;
+    int one = 1;
+    if(reusePort && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to set SO_REUSEPORT with err=%d", err);
+        close(listen_fd);
+        return -1;
+    }
 
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(listen_fd < 0) {
+    // Connections only show up once the client sent something, normally the JOIN
+    int deferSecs = (int)listenConfig->deferSecs;
+    if(deferSecs > 0 && setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSecs, sizeof(deferSecs)) != 0) {
         int err = errno;
-        printf("ERROR: Failed to create listening socket with err=%d\n", err);
+        LOG_ERROR("Failed to set TCP_DEFER_ACCEPT with err=%d", err);
+        close(listen_fd);
         return -1;
     }
 
     // Bind
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     serverAddr.sin_port = htons(port);
     if(bind(listen_fd, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) != 0) {
         int err = errno;
-        printf("ERROR: Failed to bind listening socket on port %u with err=%d\n", port, err);
+        LOG_ERROR("Failed to bind listening socket on port %u with err=%d", port, err);
         close(listen_fd);
         return -1;
     }
 
     // Listening
-    if(listen(listen_fd, 20) != 0) {
+    if(listen(listen_fd, (int)listenConfig->backlog) != 0) {
         int err = errno;
-        printf("ERROR: Failed to listen on port %u with err=%d\n", port, err);
+        LOG_ERROR("Failed to listen on port %u with err=%d", port, err);
         close(listen_fd);
         return -1;
     }
 
+    return listen_fd;
+}
+
+// Accept failed for lack of fds, take the oldest waiting connection off the queue and drop it
+// accept4 fails with EMFILE before it looks at the queue, so check it is not empty first
+// Returns 1 if a connection was dropped
+static int8_t shed_connection(int listen_fd)
+{
+    struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+    if(spareFd < 0 || poll(&pfd, 1, 0) != 1) {
+        return 0;
+    }
+
+    close(spareFd);
+    int connect_fd = accept(listen_fd, NULL, NULL);
+    if(connect_fd >= 0) {
+        close(connect_fd);
+        metrics_add(METRIC_ACCEPT_DROPPED, 1);
+    }
+    spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return connect_fd >= 0;
+}
+
+// Hand the new socket to a reactor for its handshake
+// Sharded listeners keep it on the accepting shard
+static void hand_over_connection(reactor_t* reactor, listener_t* listener, int connect_fd)
+{
+    metrics_add(METRIC_ACCEPTED, 1);
+    reactor_t* target = listener->isSharded ? reactor : reactor_pick();
+    if(new_connection(target, connect_fd) < 0) {
+        LOG_ERROR("Failed to add fd %d to chatroom", connect_fd);
+        metrics_add(METRIC_ACCEPT_DROPPED, 1);
+        close(connect_fd);
+    }
+}
+
+// Runs on the listener's reactor, drains everything queued since the last wakeup
+static void accept_connections(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    listener_t* listener = (listener_t*)ctx;
+
     while(1) {
-        size_t addrLen = sizeof(clientAddr);
-        connect_fd = accept(listen_fd, (struct sockaddr *)&clientAddr, (socklen_t*)&addrLen);
+        int connect_fd = accept4(listener->handle.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if(connect_fd < 0) {
-            printf("ERROR: Failed to accept connection. Retrying.\n");
+            int err = errno;
+            if(err == EINTR || err == ECONNABORTED) {
+                continue;
+            }
+            if(err == EMFILE || err == ENFILE) {
+                LOG_ERROR("Reactor %u ran out of fds accepting connections", reactor->id);
+                if(shed_connection(listener->handle.fd)) {
+                    continue;
+                }
+                return;
+            }
+            if(err != EAGAIN && err != EWOULDBLOCK) {
+                LOG_ERROR("Reactor %u failed to accept connection with err=%d", reactor->id, err);
+            }
+            return;
         }
 
-        if(new_connection(connect_fd) < 0) {
-            printf("ERROR: Failed to add fd %d to chatroom\n", connect_fd);
-            close(connect_fd);
+        hand_over_connection(reactor, listener, connect_fd);
+    }
+}
+
+// io_uring requests have to be issued from the reactor thread
+static void start_uring_listener(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    listener_t* listener = (listener_t*)ctx;
+    if(listener->handle.op == NULL && reactor_accept_start(reactor, &listener->handle) != 0) {
+        LOG_ERROR("Reactor %u failed to start accepting on fd %d", reactor->id, listener->handle.fd);
+        reactor_deadline_arm(reactor, &listener->retryDeadline, ACCEPT_RETRY_MS);
+    }
+}
+
+// io_uring backend, one completion per connection off the multishot accept
+static void accept_uring_connection(reactor_t* reactor, void* ctx, int connect_fd)
+{
+    listener_t* listener = (listener_t*)ctx;
+    if(connect_fd >= 0) {
+        hand_over_connection(reactor, listener, connect_fd);
+        return;
+    }
+
+    // A failure ends the multishot accept, start it again once fds may have been freed
+    if(connect_fd == -EMFILE || connect_fd == -ENFILE) {
+        LOG_ERROR("Reactor %u ran out of fds accepting connections", reactor->id);
+        while(shed_connection(listener->handle.fd)) {
+        }
+    } else {
+        LOG_ERROR("Reactor %u failed to accept connection with err=%d", reactor->id, -connect_fd);
+    }
+    reactor_deadline_arm(reactor, &listener->retryDeadline, ACCEPT_RETRY_MS);
+}
+
+static int8_t start_listener(listener_t* listener, reactor_t* reactor, int listen_fd)
+{
+    listener->handle.fd = listen_fd;
+    listener->handle.ctx = listener;
+    if(reactor_backend() == REACTOR_BACKEND_URING) {
+        listener->handle.acceptCb = accept_uring_connection;
+        listener->startTask.cb = start_uring_listener;
+        listener->startTask.ctx = listener;
+        listener->retryDeadline.cb = start_uring_listener;
+        listener->retryDeadline.ctx = listener;
+        return reactor_post(reactor, &listener->startTask);
+    }
+
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    if(flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to make listener on reactor %u non-blocking with err=%d", reactor->id, err);
+        return -1;
+    }
+    listener->handle.events = EPOLLIN;
+    listener->handle.cb = accept_connections;
+    return reactor_add(reactor, &listener->handle);
+}
+
+static int8_t start_shard_listeners(uint32_t port, uint8_t numShards, const listen_config_t* listenConfig)
+{
+    for(uint8_t i = 0; i < numShards; i++) {
+        int listen_fd = open_listener(port, 1, listenConfig);
+        if(listen_fd < 0) {
+            return -1;
+        }
+
+        listeners[i].isSharded = 1;
+        if(start_listener(&listeners[i], reactor_get(i), listen_fd) != 0) {
+            close(listen_fd);
+            return -1;
+        }
+    }
+
+    LOG_INFO("Started %u sharded listener(s)", numShards);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t numReactors = DEFAULT_REACTORS;
+    uint32_t adminPort = 0;
+    const char* adminSocket = NULL;
+    log_level_t level = LOG_LEVEL_INFO;
+    const char* logDir = NULL;
+    reactor_backend_t backend = REACTOR_BACKEND_EPOLL;
+    listen_config_t listenConfig = {
+        .backlog = DEFAULT_LISTEN_BACKLOG,
+        .deferSecs = 0,
+    };
+    chatroom_config_t config;
+    chatroom_default_config(&config);
+
+    int opt;
+    while((opt = getopt(argc, argv, "r:sk:D:q:p:l:w:W:z:I:K:S:R:a:u:v:b:B:m:M:g:G:d:i:")) != -1) {
+        switch(opt) {
+        case 'r':
+            numReactors = strtoul(optarg, NULL, 10);
+            if(numReactors == 0 || numReactors > MAX_REACTORS) {
+                printf("ERROR: Invalid reactor count. Please pick between 1 and %u\n", MAX_REACTORS);
+                return -1;
+            }
+            break;
+        case 's':
+            config.isSharded = 1;
+            break;
+        case 'k':
+            listenConfig.backlog = strtoul(optarg, NULL, 10);
+            if(listenConfig.backlog == 0 || listenConfig.backlog > INT32_MAX) {
+                printf("ERROR: Invalid listen backlog %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'D':
+            listenConfig.deferSecs = strtoul(optarg, NULL, 10);
+            if(listenConfig.deferSecs > INT32_MAX) {
+                printf("ERROR: Invalid accept defer time %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'q':
+            config.outQueueHighWatermark = strtoul(optarg, NULL, 10);
+            if(config.outQueueHighWatermark == 0) {
+                printf("ERROR: Invalid out queue length %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'p': {
+            int policy = 0;
+            while(policy < NUM_SLOW_CONSUMER_POLICY && strcmp(optarg, slowConsumerPolicyNames[policy]) != 0) {
+                policy++;
+            }
+            if(policy == NUM_SLOW_CONSUMER_POLICY) {
+                printf("ERROR: Invalid slow consumer policy %s\n", optarg);
+                return -1;
+            }
+            config.slowConsumerPolicy = (slow_consumer_policy_t)policy;
+            break;
+        }
+        case 'l':
+            config.largeRoomThreshold = strtoul(optarg, NULL, 10);
+            if(config.largeRoomThreshold == 0) {
+                printf("ERROR: Invalid large room threshold %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'w':
+            config.fanoutWorkers = strtoul(optarg, NULL, 10);
+            if(config.fanoutWorkers > MAX_FANOUT_WORKERS) {
+                printf("ERROR: Invalid fan-out worker count. Please pick between 0 and %u\n", MAX_FANOUT_WORKERS);
+                return -1;
+            }
+            break;
+        case 'W':
+            config.roomSenders = strtoul(optarg, NULL, 10);
+            if(config.roomSenders == 0 || config.roomSenders > MAX_SENDERS) {
+                printf("ERROR: Invalid room sender count. Please pick between 1 and %u\n", MAX_SENDERS);
+                return -1;
+            }
+            break;
+        case 'z':
+            config.zerocopyThreshold = strtoul(optarg, NULL, 10);
+            break;
+        case 'I':
+            config.idleSecs = strtoul(optarg, NULL, 10);
+            break;
+        case 'K':
+            config.keepaliveSecs = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            config.sendStallSecs = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            config.resumeGraceSecs = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            adminPort = strtoul(optarg, NULL, 10);
+            if(adminPort == 0 || adminPort > TCP_PORT_MAX) {
+                printf("ERROR: Invalid admin port %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'u':
+            adminSocket = optarg;
+            break;
+        case 'b':
+            config.scrollbackMsgs = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            config.scrollbackBytes = strtoul(optarg, NULL, 10);
+            if(config.scrollbackBytes == 0) {
+                printf("ERROR: Invalid scrollback bytes %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm':
+            config.clientMsgRate = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            config.clientByteRate = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            config.roomMsgRate = strtoul(optarg, NULL, 10);
+            break;
+        case 'G':
+            config.roomByteRate = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            logDir = optarg;
+            break;
+        case 'i': {
+            int choice = 0;
+            while(choice < NUM_REACTOR_BACKEND && strcmp(optarg, backendNames[choice]) != 0) {
+                choice++;
+            }
+            if(choice == NUM_REACTOR_BACKEND) {
+                printf("ERROR: Invalid io backend %s\n", optarg);
+                return -1;
+            }
+            backend = (reactor_backend_t)choice;
+            break;
+        }
+        case 'v':
+            if(log_parse_level(optarg, &level) != 0) {
+                printf("ERROR: Invalid log level %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            printf(USAGE);
+            return -1;
+        }
+    }
+
+    if(argc - optind > 1) {
+        printf(USAGE);
+        return -1;
+    }
+    if(log_start(level) != 0) {
+        return -1;
+    }
+    chatroom_configure(&config);
+    LOG_INFO("Slow consumers %s at %u queued msgs", 
+            slowConsumerPolicyNames[config.slowConsumerPolicy], config.outQueueHighWatermark);
+    if(config.scrollbackMsgs > 0) {
+        LOG_INFO("Replaying up to %u msgs or %u bytes of scrollback to joiners", config.scrollbackMsgs, config.scrollbackBytes);
+    }
+    if(config.clientMsgRate > 0 || config.clientByteRate > 0) {
+        LOG_INFO("Pausing reads of clients over %u msgs/s or %u bytes/s (0 is unlimited)", config.clientMsgRate, config.clientByteRate);
+    }
+    if(config.roomMsgRate > 0 || config.roomByteRate > 0) {
+        LOG_INFO("Pausing reads of rooms over %u msgs/s or %u bytes/s (0 is unlimited)", config.roomMsgRate, config.roomByteRate);
+    }
+    if(config.idleSecs > 0 || config.keepaliveSecs > 0) {
+        LOG_INFO("Dropping clients silent for %u s, pinging them every %u s of silence (0 is off)", config.idleSecs, config.keepaliveSecs);
+    }
+    if(config.sendStallSecs > 0) {
+        LOG_INFO("Dropping clients whose queued msgs haven't moved for %u s", config.sendStallSecs);
+    }
+    if(config.resumeGraceSecs > 0) {
+        LOG_INFO("Keeping sessions of dropped clients for %u s to be resumed", config.resumeGraceSecs);
+    }
+    if(config.zerocopyThreshold > 0) {
+        LOG_INFO("Sending msgs of %u bytes or more with MSG_ZEROCOPY", config.zerocopyThreshold);
+    }
+    
+    uint32_t port = 0;
+    if(argc - optind == 1) {
+        port = strtoul(argv[optind], NULL, 10);
+        if(port > TCP_PORT_MAX || port < TCP_PORT_MIN) {
+            LOG_ERROR("Invalid port. Please pick port between %u and %u", TCP_PORT_MIN, TCP_PORT_MAX);
+            log_flush();
+            return -1;
+        }
+        LOG_INFO("Using desired port %u", port);
+    } else {
+        port = 1234;
+        LOG_INFO("Using default port %u", port);
+    }
+
+    // Room logs are indexed before the first room can be created
+    if(logDir != NULL && roomlog_start(logDir) != 0) {
+        log_flush();
+        return -1;
+    }
+
+    // Sharded mode opens one listener per reactor instead
+    int listen_fd = -1;
+    if(!config.isSharded) {
+        listen_fd = open_listener(port, 0, &listenConfig);
+        if(listen_fd < 0) {
+            log_flush();
+            return -1;
+        }
+    }
+    spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    LOG_INFO("Listening with a backlog of %u", listenConfig.backlog);
+    if(listenConfig.deferSecs > 0) {
+        LOG_INFO("Deferring accepts up to %u s until the JOIN arrives", listenConfig.deferSecs);
+    }
+
+    // SIGUSR1 is only taken by this thread
+    sigset_t statsSignal;
+    sigemptyset(&statsSignal);
+    sigaddset(&statsSignal, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &statsSignal, NULL);
+
+    // Event loops that service the listeners and all joined client sockets
+    if(reactor_start_all(numReactors, config.isSharded, backend) != 0 || chatroom_start() != 0 ||
+       (config.isSharded && start_shard_listeners(port, numReactors, &listenConfig) != 0) ||
+       (!config.isSharded && start_listener(&listeners[0], reactor_get(0), listen_fd) != 0) ||
+       admin_start(adminPort, adminSocket) != 0) {
+        close(listen_fd);
+        log_flush();
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stats_dump;
+    sigaction(SIGUSR1, &sa, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &statsSignal, NULL);
+
+    while(1) {
+        // Nothing left to do here but wait for stats requests
+        pause();
+        if(dumpStatsRequested) {
+            dumpStatsRequested = 0;
+            dump_stats();
         }
     }
-}
\ No newline at end of file
+}
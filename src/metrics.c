@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// Only its own thread writes a block, atomics just keep scrapes from tearing
+typedef struct metrics_block_s {
+    atomic_uint_fast64_t values[NUM_METRICS];
+    struct metrics_block_s* next;
+    struct metrics_block_s* prev;
+} metrics_block_t;
+
+static const metric_info_t metricInfo[NUM_METRICS] = {
+    [METRIC_ACCEPTED] = {"yak_accepted_total", "Connections taken off the listen queue"},
+    [METRIC_ACCEPT_DROPPED] = {"yak_accept_dropped_total", "Connections closed on accept for lack of fds or memory"},
+    [METRIC_CONNECTIONS] = {"yak_connections_total", "Connections handed to the reactors"},
+    [METRIC_HANDSHAKE_OK] = {"yak_handshakes_ok_total", "JOIN handshakes that joined a room"},
+    [METRIC_HANDSHAKE_FAILED] = {"yak_handshakes_failed_total", "JOIN handshakes rejected or dropped"},
+    [METRIC_HANDSHAKE_TIMEOUT] = {"yak_handshakes_timeout_total", "JOIN handshakes that ran out of time"},
+    [METRIC_CLIENTS_TIMED_OUT] = {"yak_clients_timed_out_total", "Joined clients dropped for being idle or not draining their sends"},
+    [METRIC_SESSIONS_RESUMED] = {"yak_sessions_resumed_total", "Dropped clients that resumed their session"},
+    [METRIC_SESSIONS_EXPIRED] = {"yak_sessions_expired_total", "Sessions not resumed within the grace period"},
+    [METRIC_SESSIONS_GAPPED] = {"yak_sessions_gapped_total", "Resumed sessions that missed msgs the room no longer held"},
+    [METRIC_MSGS_IN] = {"yak_msgs_received_total", "Chat msgs received from clients"},
+    [METRIC_BYTES_IN] = {"yak_msg_bytes_received_total", "Chat msg bytes received from clients"},
+    [METRIC_READS_PAUSED] = {"yak_reads_paused_total", "Times a client's reads were paused by a rate limit"},
+    [METRIC_FRAMES_QUEUED] = {"yak_deliveries_total", "Msgs queued on a member's out queue"},
+    [METRIC_BYTES_SENT] = {"yak_bytes_sent_total", "Bytes written to client sockets"},
+    [METRIC_ZEROCOPY_BYTES] = {"yak_zerocopy_bytes_sent_total", "Bytes written to client sockets with MSG_ZEROCOPY"},
+    [METRIC_ZEROCOPY_COPIED] = {"yak_zerocopy_copied_total", "Zerocopy sends the kernel copied anyway"},
+    [METRIC_SEND_BUFF_FULL] = {"yak_send_buff_full_total", "Times a producer found a room's send ring full and backed off"},
+    [METRIC_LOG_BYTES] = {"yak_log_bytes_written_total", "Bytes appended to durable room logs"},
+    [METRIC_LOG_SYNCS] = {"yak_log_syncs_total", "Group commits synced to disk by the room log writer"},
+};
+
+static pthread_mutex_t blockListMutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_block_t* blockList = NULL;
+static metrics_block_t retired;     // totals of threads that exited
+
+static __thread metrics_block_t* threadBlock = NULL;
+static pthread_key_t blockKey;
+static pthread_once_t blockKeyOnce = PTHREAD_ONCE_INIT;
+
+// Fold an exiting thread's counts into the retired totals
+static void retire_thread_block(void* input)
+{
+    metrics_block_t* block = (metrics_block_t*)input;
+
+    pthread_mutex_lock(&blockListMutex);
+    for(uint32_t i = 0; i < NUM_METRICS; i++) {
+        uint64_t value = atomic_load_explicit(&block->values[i], memory_order_relaxed);
+        atomic_fetch_add_explicit(&retired.values[i], value, memory_order_relaxed);
+    }
+    if(block->prev == NULL) {
+        blockList = block->next;
+    } else {
+        block->prev->next = block->next;
+    }
+    if(block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    pthread_mutex_unlock(&blockListMutex);
+
+    free(block);
+}
+
+static void create_block_key(void)
+{
+    pthread_key_create(&blockKey, retire_thread_block);
+}
+
+static metrics_block_t* register_thread_block(void)
+{
+    metrics_block_t* block = (metrics_block_t*)calloc(1, sizeof(metrics_block_t));
+    if(block == NULL) {
+        return NULL;
+    }
+
+    pthread_once(&blockKeyOnce, create_block_key);
+    pthread_setspecific(blockKey, block);
+
+    pthread_mutex_lock(&blockListMutex);
+    block->next = blockList;
+    if(blockList != NULL) {
+        blockList->prev = block;
+    }
+    blockList = block;
+    pthread_mutex_unlock(&blockListMutex);
+
+    threadBlock = block;
+    return block;
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+void metrics_add(metric_t metric, uint64_t value)
+{
+    metrics_block_t* block = threadBlock;
+    if(block == NULL && (block = register_thread_block()) == NULL) {
+        return;
+    }
+
+    // Single writer, a plain load and store is enough
+    uint64_t current = atomic_load_explicit(&block->values[metric], memory_order_relaxed);
+    atomic_store_explicit(&block->values[metric], current + value, memory_order_relaxed);
+}
+
+void metrics_snapshot(uint64_t values[NUM_METRICS])
+{
+    pthread_mutex_lock(&blockListMutex);
+    for(uint32_t i = 0; i < NUM_METRICS; i++) {
+        values[i] = atomic_load_explicit(&retired.values[i], memory_order_relaxed);
+    }
+    for(metrics_block_t* block = blockList; block != NULL; block = block->next) {
+        for(uint32_t i = 0; i < NUM_METRICS; i++) {
+            values[i] += atomic_load_explicit(&block->values[i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&blockListMutex);
+}
+
+const metric_info_t* metrics_info(metric_t metric)
+{
+    return &metricInfo[metric];
+}
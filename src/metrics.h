@@ -0,0 +1,41 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// Process wide counters, each thread bumps its own copy and a scrape sums them
+typedef enum {
+    METRIC_ACCEPTED,            // sockets taken off the listen queue
+    METRIC_ACCEPT_DROPPED,      // closed right away, out of fds or no room for the client
+    METRIC_CONNECTIONS,
+    METRIC_HANDSHAKE_OK,
+    METRIC_HANDSHAKE_FAILED,
+    METRIC_HANDSHAKE_TIMEOUT,
+    METRIC_CLIENTS_TIMED_OUT,   // joined clients dropped as idle or stalled
+    METRIC_SESSIONS_RESUMED,    // reconnects that picked up where they left off
+    METRIC_SESSIONS_EXPIRED,    // detached sessions nobody resumed in time
+    METRIC_SESSIONS_GAPPED,     // resumes that had to skip msgs the history no longer held
+    METRIC_MSGS_IN,             // chat lines accepted from clients
+    METRIC_BYTES_IN,
+    METRIC_READS_PAUSED,        // client went over a rate limit and stopped being read
+    METRIC_FRAMES_QUEUED,       // frame handed to one member's out queue
+    METRIC_BYTES_SENT,          // written to client sockets
+    METRIC_ZEROCOPY_BYTES,      // of those, sent with MSG_ZEROCOPY
+    METRIC_ZEROCOPY_COPIED,     // zerocopy sends the kernel ended up copying
+    METRIC_SEND_BUFF_FULL,      // producer found the room ring full
+    METRIC_LOG_BYTES,           // appended to durable room logs
+    METRIC_LOG_SYNCS,           // group commits flushed to disk
+    NUM_METRICS,
+} metric_t;
+
+typedef struct metric_info_s {
+    const char* name;
+    const char* help;
+} metric_info_t;
+
+uint64_t metrics_now_ns(void);
+void metrics_add(metric_t metric, uint64_t value);
+void metrics_snapshot(uint64_t values[NUM_METRICS]);
+const metric_info_t* metrics_info(metric_t metric);
+
+#endif
@@ -0,0 +1,344 @@
+// Microbenchmarks for the per-byte hot paths
+// Pulls in chatroom.c so the static functions can be driven directly
+#include "chatroom.c"
+
+#define BENCH_MIN_NS        (300000000ull)  // run each case for at least this long
+#define BENCH_MAX_BATCH     (1024)
+
+typedef struct bench_case_s {
+    const char* name;
+    void (*run)(void* ctx);
+    void* ctx;
+    uint64_t bytesPerOp;
+} bench_case_t;
+
+static FILE* report;
+static chatroom_t* benchRoom;
+static client_t* benchClient;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// Stand-in for the room sender, keeps the ring from filling up
+static void drain_room(void)
+{
+    send_buff_item_t* item;
+    while((item = peek_send_buff(&benchRoom->sendBuff)) != NULL) {
+        if(item->frame != NULL) {
+            frame_unref(item->frame);
+            item->frame = NULL;
+        }
+        release_send_buff(&benchRoom->sendBuff, item);
+    }
+}
+
+static void run_case(const bench_case_t* bench)
+{
+    // Warm up caches and the slab
+    bench->run(bench->ctx);
+
+    uint64_t ops = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed = 0;
+    uint64_t batch = 1;
+    while(elapsed < BENCH_MIN_NS) {
+        for(uint64_t i = 0; i < batch; i++) {
+            bench->run(bench->ctx);
+        }
+        ops += batch;
+        elapsed = bench_now_ns() - start;
+        if(batch < BENCH_MAX_BATCH) {
+            batch *= 2;
+        }
+    }
+
+    double nsPerOp = (double)elapsed / ops;
+    fprintf(report, "%-34s %10.1f ns/op", bench->name, nsPerOp);
+    if(bench->bytesPerOp > 0) {
+        fprintf(report, "  %9.1f MB/s", bench->bytesPerOp * 1e3 / nsPerOp);
+    }
+    fprintf(report, "\n");
+}
+
+// tokenize_msg, one recv worth of input per op
+typedef struct tokenize_input_s {
+    char* data;
+    uint32_t len;
+} tokenize_input_t;
+
+static void run_tokenize(void* ctx)
+{
+    tokenize_input_t* input = (tokenize_input_t*)ctx;
+    recv_ring_append(&benchClient->recvRing, input->data, input->len);
+    if(tokenize_msg(benchClient) != 0) {
+        fprintf(report, "ERROR: tokenize_msg failed\n");
+        exit(-1);
+    }
+    drain_room();
+}
+
+static void build_lines(tokenize_input_t* input, uint32_t numLines, uint32_t lineLen, const char* eol)
+{
+    uint32_t eolLen = strlen(eol);
+    input->len = numLines * (lineLen + eolLen);
+    input->data = (char*)malloc(input->len);
+    char* it = input->data;
+    for(uint32_t i = 0; i < numLines; i++) {
+        for(uint32_t j = 0; j < lineLen; j++) {
+            *it++ = 'a' + (i+j) % 26;
+        }
+        memcpy(it, eol, eolLen);
+        it += eolLen;
+    }
+}
+
+// parse_join_msg, one whole handshake fed in fragments per op
+typedef struct join_input_s {
+    const char* msg;
+    uint32_t fragLen;
+} join_input_t;
+
+static void run_parse_join(void* ctx)
+{
+    join_input_t* input = (join_input_t*)ctx;
+    join_parser_t parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.state = JOIN_PARSE_CMD;
+
+    uint32_t total = strlen(input->msg);
+    int16_t ret = 0;
+    while(parser.len < total && ret == 0) {
+        uint32_t frag = total - parser.len < input->fragLen ? total - parser.len : input->fragLen;
+        memcpy(parser.buff + parser.len, input->msg + parser.len, frag);
+        parser.len += frag;
+        parser.buff[parser.len] = '\0';
+        ret = parse_join_msg(&parser);
+    }
+    if(ret <= 0) {
+        fprintf(report, "ERROR: parse_join_msg failed on %s\n", input->msg);
+        exit(-1);
+    }
+}
+
+// insert_broadcast_msg, one preframed line per op
+static void run_insert_broadcast(void* ctx)
+{
+    recv_line_t* line = (recv_line_t*)ctx;
+    insert_broadcast_msg(benchClient, line, 1);
+    drain_room();
+}
+
+// send_buff_t, single threaded push then pop
+static void run_ring(void* ctx)
+{
+    send_buff_t* sendBuff = &benchRoom->sendBuff;
+    push_send_buff(sendBuff, NULL, BROADCAST_MSG, NULL);
+    release_send_buff(sendBuff, peek_send_buff(sendBuff));
+}
+
+// Every bucket a msg goes through, with rates high enough that it is never held back
+static void run_rate_check(void* ctx)
+{
+    static uint64_t nowNs = 0;
+    nowNs += 1000;
+    if(msg_tokens_wait(benchClient, 40, nowNs) != 0) {
+        fprintf(report, "ERROR: msg_tokens_wait held back a msg\n");
+        exit(-1);
+    }
+    take_msg_tokens(benchClient, 40, nowNs);
+}
+
+// deliver_staged, one msg to every member of a large room whose sockets are all backed up
+// Members queue it and drop their oldest, nothing is written
+#define FANOUT_BENCH_MEMBERS    (10000)
+
+static chatroom_t* fanoutRoom;
+static msg_frame_t* fanoutFrame;
+
+static void run_fanout(void* ctx)
+{
+    pthread_mutex_lock(&fanoutRoom->clientListMutex);
+    broadcast_frame(fanoutRoom, fanoutFrame);
+    deliver_staged(fanoutRoom);
+    pthread_mutex_unlock(&fanoutRoom->clientListMutex);
+}
+
+static int8_t setup_fanout_room(void)
+{
+    config.slowConsumerPolicy = SLOW_CONSUMER_DROP_OLDEST;
+    config.outQueueHighWatermark = 4;
+    config.largeRoomThreshold = UINT32_MAX;
+    fanoutRoom = init_chatroom("fanout", hash_room_name("fanout"));
+    fanoutFrame = fanoutRoom == NULL ? NULL : frame_alloc(34, &fanoutRoom->memAccount);
+    int fd = open("/dev/null", O_WRONLY);
+    if(fanoutFrame == NULL || fd < 0) {
+        return -1;
+    }
+    fanoutFrame->size = sprintf(fanoutFrame->data, "benchuser: hello there everyone\n");
+
+    // Spread members over the heap the way other allocations between joins would
+    void** spacers = (void**)calloc(FANOUT_BENCH_MEMBERS, sizeof(void*));
+    if(spacers == NULL) {
+        return -1;
+    }
+    int8_t ret = 0;
+    char name[MAX_NAME_LEN+1];
+    for(uint32_t i = 0; i < FANOUT_BENCH_MEMBERS && ret == 0; i++) {
+        client_t* client = acquire_client();
+        spacers[i] = malloc(256);
+        if(client == NULL || spacers[i] == NULL) {
+            ret = -1;
+            break;
+        }
+        client->fd = fd;
+        client->handle.events = EPOLLOUT;
+        sprintf(name, "member%u", i);
+        ret = add_client(client, fanoutRoom, name, 0, 0);
+    }
+    for(uint32_t i = 0; i < FANOUT_BENCH_MEMBERS; i++) {
+        free(spacers[i]);
+    }
+    free(spacers);
+    return ret;
+}
+
+// send_buff_t, producers on other threads and a consumer scheduled on a shared sender like a room
+#define RING_PRODUCERS      (4)
+#define RING_MSGS_PER_PRODUCER  (200000)
+
+static send_buff_t contendedRing;
+static atomic_uint_fast64_t contendedDrained;
+
+// Stand-in for run_room, one batch per run
+static void drain_contended_ring(void* ctx)
+{
+    send_buff_t* sendBuff = (send_buff_t*)ctx;
+    send_buff_item_t* item;
+    uint32_t batchLen = 0;
+    while(batchLen < SEND_BUFF_LEN && (item = peek_send_buff(sendBuff)) != NULL) {
+        release_send_buff(sendBuff, item);
+        batchLen++;
+    }
+    atomic_fetch_add_explicit(&contendedDrained, batchLen, memory_order_relaxed);
+    if(peek_send_buff(sendBuff) != NULL) {
+        senders_schedule(&sendBuff->consumer);
+    }
+}
+
+static void* ring_producer(void* input)
+{
+    send_buff_t* sendBuff = (send_buff_t*)input;
+    for(uint32_t i = 0; i < RING_MSGS_PER_PRODUCER; i++) {
+        while(push_send_buff(sendBuff, NULL, BROADCAST_MSG, NULL) != 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void bench_ring_contended(void)
+{
+    send_buff_t* sendBuff = &contendedRing;
+    for(uint32_t i = 0; i < SEND_BUFF_LEN; i++) {
+        atomic_init(&sendBuff->buff[i].seq, i);
+    }
+    sendBuff->consumer.fn = drain_contended_ring;
+    sendBuff->consumer.ctx = sendBuff;
+
+    pthread_t producers[RING_PRODUCERS];
+    uint64_t start = bench_now_ns();
+    for(uint32_t i = 0; i < RING_PRODUCERS; i++) {
+        pthread_create(&producers[i], NULL, ring_producer, sendBuff);
+    }
+    for(uint32_t i = 0; i < RING_PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    while(atomic_load_explicit(&contendedDrained, memory_order_relaxed) < (uint64_t)RING_PRODUCERS*RING_MSGS_PER_PRODUCER) {
+        sched_yield();
+    }
+
+    double nsPerOp = (double)(bench_now_ns() - start) / ((uint64_t)RING_PRODUCERS*RING_MSGS_PER_PRODUCER);
+    fprintf(report, "%-34s %10.1f ns/op\n", "ring mpsc 4 producers", nsPerOp);
+}
+
+int main(void)
+{
+    // Log lines from the code under test would drown the results
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if(report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        return -1;
+    }
+    setvbuf(report, NULL, _IOLBF, 0);
+
+    // Rooms are bound to a sender when created
+    if(senders_start(1) != 0) {
+        fprintf(report, "ERROR: Failed to start the sender\n");
+        return -1;
+    }
+    benchRoom = init_chatroom("bench", hash_room_name("bench"));
+    benchClient = (client_t*)calloc(1, sizeof(client_t));
+    if(benchRoom == NULL || benchClient == NULL || recv_ring_init(&benchClient->recvRing, RECV_RING_SIZE) != 0) {
+        fprintf(report, "ERROR: Failed to set up bench room\n");
+        return -1;
+    }
+    strcpy(benchClient->name, "benchuser");
+    benchClient->sendBuff = &benchRoom->sendBuff;
+    benchClient->memAccount = &benchRoom->memAccount;
+    // The cases drain the room themselves, pretend its sender is always queued so pushes never schedule it
+    atomic_store(&benchRoom->sendBuff.consumer.isQueued, 1);
+    init_rate_limits(&benchClient->msgBucket, &benchClient->byteBucket, UINT32_MAX, UINT32_MAX);
+    init_rate_limits(&benchRoom->msgBucket, &benchRoom->byteBucket, UINT32_MAX, UINT32_MAX);
+    benchClient->roomMsgBucket = &benchRoom->msgBucket;
+    benchClient->roomByteBucket = &benchRoom->byteBucket;
+
+    if(setup_fanout_room() != 0) {
+        fprintf(report, "ERROR: Failed to set up fan-out room\n");
+        return -1;
+    }
+
+    // One ring's worth per op, tokenize_msg would pause the client's reads on a full ring
+    tokenize_input_t smallLines, telnetLines, largeLine, partialLines;
+    build_lines(&smallLines, SEND_BUFF_LEN, 40, "\n");
+    build_lines(&telnetLines, SEND_BUFF_LEN, 40, "\r\n");
+    build_lines(&largeLine, 1, 19000, "\n");
+    // Lines straddle recvs, the scan has to resume mid-line
+    build_lines(&partialLines, 64, 1000, "\n");
+    partialLines.len = 4096;
+
+    join_input_t joinWhole = {"JOIN general alice\n", 64};
+    join_input_t joinTelnet = {"JOIN general alice\r\n", 64};
+    join_input_t joinFrag3 = {"JOIN general alice\n", 3};
+    join_input_t joinFrag1 = {"JOIN abcdefghijklmnopqrst abcdefghijklmnopqrs\r\n", 1};
+
+    recv_line_t shortLine = {{"hello there, how is everyone doing", NULL}, {34, 0}};
+    recv_line_t wrappedLine = {{largeLine.data, largeLine.data + 9500}, {9500, 9500}};
+    recv_line_t fullLine = {{largeLine.data, NULL}, {19000, 0}};
+
+    bench_case_t cases[] = {
+        {"tokenize_msg 32x40B lines",       run_tokenize, &smallLines, smallLines.len},
+        {"tokenize_msg 32x40B \\r\\n lines", run_tokenize, &telnetLines, telnetLines.len},
+        {"tokenize_msg 1x19KB line",        run_tokenize, &largeLine, largeLine.len},
+        {"tokenize_msg 4KB recvs of 1KB lines", run_tokenize, &partialLines, partialLines.len},
+        {"parse_join_msg whole",            run_parse_join, &joinWhole, 19},
+        {"parse_join_msg \\r\\n",            run_parse_join, &joinTelnet, 20},
+        {"parse_join_msg 3B fragments",     run_parse_join, &joinFrag3, 19},
+        {"parse_join_msg 1B fragments max", run_parse_join, &joinFrag1, 47},
+        {"insert_broadcast_msg 34B",        run_insert_broadcast, &shortLine, 34},
+        {"insert_broadcast_msg 19KB",       run_insert_broadcast, &fullLine, 19000},
+        {"insert_broadcast_msg 19KB wrapped", run_insert_broadcast, &wrappedLine, 19000},
+        {"ring push+pop",                   run_ring, NULL, 0},
+        {"rate limit check 40B msg",        run_rate_check, NULL, 0},
+        {"fan-out 1 msg to 10k members",    run_fanout, NULL, 0},
+    };
+
+    for(uint32_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        run_case(&cases[i]);
+    }
+    bench_ring_contended();
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "ratelimit.h"
+
+#define NS_PER_SEC  (1000000000ull)
+
+void token_bucket_init(token_bucket_t* bucket, uint32_t ratePerSec, uint32_t burst)
+{
+    atomic_init(&bucket->fullAtNs, 0);
+    bucket->ratePerSec = ratePerSec;
+    bucket->tokenNs = ratePerSec == 0 ? 0 : (NS_PER_SEC << 16) / ratePerSec;
+    bucket->burstNs = ratePerSec == 0 ? 0 : (uint64_t)burst * NS_PER_SEC / ratePerSec;
+}
+
+// Fits 64 bits for any cost up to a max size msg at 1 token/s
+static uint64_t cost_ns(const token_bucket_t* bucket, uint32_t cost)
+{
+    return ((uint64_t)cost * bucket->tokenNs) >> 16;
+}
+
+uint64_t token_bucket_wait_ns(token_bucket_t* bucket, uint32_t cost, uint64_t nowNs)
+{
+    if(bucket->ratePerSec == 0) {
+        return 0;
+    }
+
+    // Taking cost tokens pushes the full time forward, more than a burst ahead means they aren't there yet
+    uint64_t fullAtNs = atomic_load_explicit(&bucket->fullAtNs, memory_order_relaxed);
+    uint64_t afterNs = (fullAtNs > nowNs ? fullAtNs : nowNs) + cost_ns(bucket, cost);
+    if(afterNs - nowNs <= bucket->burstNs) {
+        return 0;
+    }
+
+    return afterNs - nowNs - bucket->burstNs;
+}
+
+void token_bucket_take(token_bucket_t* bucket, uint32_t cost, uint64_t nowNs)
+{
+    if(bucket->ratePerSec == 0) {
+        return;
+    }
+
+    uint64_t costNs = cost_ns(bucket, cost);
+    uint64_t fullAtNs = atomic_load_explicit(&bucket->fullAtNs, memory_order_relaxed);
+    uint64_t afterNs;
+    do {
+        afterNs = (fullAtNs > nowNs ? fullAtNs : nowNs) + costNs;
+    } while(!atomic_compare_exchange_weak_explicit(&bucket->fullAtNs, &fullAtNs, afterNs,
+                                                   memory_order_relaxed, memory_order_relaxed));
+}
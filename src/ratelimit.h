@@ -0,0 +1,22 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Token bucket kept as the time it will be full again (GCRA), so one atomic holds its whole state
+// Safe to share between threads, a zero rate never limits
+typedef struct token_bucket_s {
+    atomic_uint_fast64_t fullAtNs;
+    uint32_t ratePerSec;
+    uint64_t tokenNs;   // time one token takes to refill, 16.16 fixed point so checks don't divide
+    uint64_t burstNs;   // time the burst takes to refill
+} token_bucket_t;
+
+void token_bucket_init(token_bucket_t* bucket, uint32_t ratePerSec, uint32_t burst);
+// Returns 0 if cost tokens are available now, otherwise how long until they are
+uint64_t token_bucket_wait_ns(token_bucket_t* bucket, uint32_t cost, uint64_t nowNs);
+// Unconditional, only call once every bucket the msg goes through had the tokens
+void token_bucket_take(token_bucket_t* bucket, uint32_t cost, uint64_t nowNs);
+
+#endif
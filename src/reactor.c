@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "reactor.h"
+#include "uring.h"
+
+#define REACTOR_MAX_EVENTS  (64)
+#define URING_SQ_ENTRIES    (1024)
+#define URING_CQ_ENTRIES    (8192)
+#define URING_RECV_BUFFS    (1024)  // per reactor, power of 2
+#define URING_RECV_BUFF_SIZE    (4096)
+#define URING_RECV_GROUP    (0)
+#define URING_MIN_KERNEL    (6)     // multishot recv landed in 6.0
+
+// Low bits of the io_uring user data say what completed, the rest is the pointer
+#define URING_TAG_MASK      (7ull)
+#define URING_TAG_OP        (0ull)
+#define URING_TAG_SEND      (1ull)
+#define URING_TAG_WAKE      (2ull)
+#define URING_TAG_CANCEL    (3ull)
+
+typedef enum {
+    REACTOR_OP_POLL,
+    REACTOR_OP_RECV,
+    REACTOR_OP_ACCEPT,
+} reactor_op_kind_t;
+
+// Outlives its handle, a detached op is freed once the kernel posts its last completion
+struct reactor_op_s {
+    reactor_op_kind_t kind;
+    reactor_handle_t* handle;   // NULL once reactor_del detached it
+    uint8_t isPaused;           // recv cancelled but still attached, ends instead of re-arming
+};
+
+static reactor_t reactors[MAX_REACTORS];
+static uint8_t numReactors = 0;
+static uint32_t nextReactor = 0;
+static reactor_backend_t backend = REACTOR_BACKEND_EPOLL;
+
+uint64_t reactor_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+uint64_t reactor_loop_ms(reactor_t* reactor)
+{
+    return reactor->loopMs;
+}
+
+// Run every task posted since the last wakeup
+static void reactor_take_tasks(reactor_t* reactor)
+{
+    pthread_mutex_lock(&reactor->taskMutex);
+    reactor_task_t* task = reactor->taskHead;
+    reactor->taskHead = NULL;
+    reactor->taskTail = NULL;
+    pthread_mutex_unlock(&reactor->taskMutex);
+
+    while(task != NULL) {
+        // Task may be freed by its callback
+        reactor_task_t* next = task->next;
+        task->cb(reactor, task->ctx, 0);
+        task = next;
+    }
+}
+
+// Drain the eventfd then the tasks, epoll backend
+static void reactor_run_tasks(reactor_t* reactor, void* ctx, uint32_t events)
+{
+    uint64_t count;
+    if(read(reactor->wakeHandle.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        int err = errno;
+        LOG_ERROR("Reactor %u failed to read wake fd with err=%d", reactor->id, err);
+    }
+
+    reactor_take_tasks(reactor);
+}
+
+static void reactor_expire_deadline(timer_node_t* node, void* ctx)
+{
+    reactor_deadline_t* deadline = (reactor_deadline_t*)node;
+    deadline->cb((reactor_t*)ctx, deadline->ctx, 0);
+}
+
+static void reactor_run_deadlines(reactor_t* reactor, uint64_t now)
+{
+    timer_wheel_advance(&reactor->deadlines, now, reactor_expire_deadline, reactor);
+}
+
+static int reactor_wait_timeout(reactor_t* reactor)
+{
+    int64_t ticks = timer_wheel_next(&reactor->deadlines);
+    if(ticks < 0) {
+        return -1;
+    }
+
+    uint64_t expiresMs = reactor->deadlines.nowTick + ticks;
+    uint64_t now = reactor_now_ms();
+    if(expiresMs <= now) {
+        return 0;
+    }
+    return (int)(expiresMs - now);
+}
+
+static void uring_prep(struct io_uring_sqe* sqe, uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint64_t userData)
+{
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->user_data = userData;
+}
+
+// Blocking read on the eventfd, completes when a task is posted
+static void uring_arm_wake(reactor_t* reactor)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor->ring);
+    uring_prep(sqe, IORING_OP_READ, reactor->wakeHandle.fd, (uint64_t)(uintptr_t)&reactor->wakeCount,
+               sizeof(reactor->wakeCount), URING_TAG_WAKE);
+}
+
+static void uring_arm_op(reactor_t* reactor, reactor_op_t* op)
+{
+    reactor_handle_t* handle = op->handle;
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor->ring);
+    uint64_t userData = (uint64_t)(uintptr_t)op | URING_TAG_OP;
+    switch(op->kind) {
+    case REACTOR_OP_POLL:
+        // Edge triggered, only the JOIN handshake polls and it is bounded by one read
+        uring_prep(sqe, IORING_OP_POLL_ADD, handle->fd, 0, IORING_POLL_ADD_MULTI, userData);
+        sqe->poll32_events = handle->events;
+        break;
+    case REACTOR_OP_RECV:
+        uring_prep(sqe, IORING_OP_RECV, handle->fd, 0, 0, userData);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_RECV_GROUP;
+        break;
+    case REACTOR_OP_ACCEPT:
+        uring_prep(sqe, IORING_OP_ACCEPT, handle->fd, 0, 0, userData);
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        break;
+    }
+}
+
+static int8_t uring_start_op(reactor_t* reactor, reactor_handle_t* handle, reactor_op_kind_t kind)
+{
+    reactor_op_t* op = (reactor_op_t*)malloc(sizeof(reactor_op_t));
+    if(op == NULL) {
+        LOG_ERROR("Failed to allocate io_uring op for fd %d on reactor %u", handle->fd, reactor->id);
+        return -1;
+    }
+    op->kind = kind;
+    op->handle = handle;
+    op->isPaused = 0;
+    handle->op = op;
+    uring_arm_op(reactor, op);
+
+    return 0;
+}
+
+// Returns 1 while the kernel may still post completions for the op
+static uint8_t uring_complete_op(reactor_t* reactor, reactor_op_t* op, int32_t res, uint32_t flags)
+{
+    uint8_t rearm = 0;
+    switch(op->kind) {
+    case REACTOR_OP_POLL:
+        if(op->handle != NULL && res > 0) {
+            op->handle->cb(reactor, op->handle->ctx, (uint32_t)res);
+        }
+        rearm = res > 0;
+        break;
+    case REACTOR_OP_RECV:
+        if(flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if(op->handle != NULL && res > 0) {
+                op->handle->dataCb(reactor, op->handle->ctx, uring_buf_get(reactor->recvBuffs, bid), res);
+            }
+            uring_buf_recycle(reactor->recvBuffs, bid);
+        } else if(op->handle != NULL && res != -ENOBUFS && res != -ECANCELED) {
+            op->handle->dataCb(reactor, op->handle->ctx, NULL, res);
+        }
+        // Running out of buffers ends the multishot, carry on with the ones recycled since
+        // A pause that was resumed before its cancel landed carries on too
+        rearm = (res > 0 || res == -ENOBUFS || res == -ECANCELED) && !op->isPaused;
+        break;
+    case REACTOR_OP_ACCEPT:
+        if(res >= 0 && op->handle == NULL) {
+            close(res);
+        } else if(op->handle != NULL && res != -ECANCELED) {
+            op->handle->acceptCb(reactor, op->handle->ctx, res);
+        }
+        rearm = res >= 0;
+        break;
+    }
+
+    if(flags & IORING_CQE_F_MORE) {
+        return 1;
+    }
+    // The callback may have detached the op
+    if(rearm && op->handle != NULL) {
+        uring_arm_op(reactor, op);
+        return 1;
+    }
+    return 0;
+}
+
+static void uring_complete(reactor_t* reactor, uint64_t userData, int32_t res, uint32_t flags)
+{
+    void* ptr = (void*)(uintptr_t)(userData & ~URING_TAG_MASK);
+    switch(userData & URING_TAG_MASK) {
+    case URING_TAG_WAKE:
+        uring_arm_wake(reactor);
+        reactor_take_tasks(reactor);
+        break;
+    case URING_TAG_SEND: {
+        reactor_send_t* send = (reactor_send_t*)ptr;
+        send->cb(reactor, send->ctx, res);
+        break;
+    }
+    case URING_TAG_OP: {
+        reactor_op_t* op = (reactor_op_t*)ptr;
+        if(!uring_complete_op(reactor, op, res, flags)) {
+            // Last completion, nothing in the kernel points at the op anymore
+            if(op->handle != NULL) {
+                op->handle->op = NULL;
+            }
+            free(op);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// One io_uring_enter submits everything the last round queued and waits for the next completions
+static void* reactor_uring_loop(void* input)
+{
+    reactor_t* reactor = (reactor_t*)input;
+
+    while(1) {
+        int ret = uring_submit_and_wait(reactor->ring, reactor_wait_timeout(reactor));
+        if(ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+            LOG_ERROR("Reactor %u failed to wait on io_uring with err=%d", reactor->id, -ret);
+            break;
+        }
+        reactor->loopMs = reactor_now_ms();
+
+        struct io_uring_cqe* cqe;
+        while((cqe = uring_peek_cqe(reactor->ring)) != NULL) {
+            uint64_t userData = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+            // Free the slot first, callbacks may queue more work
+            uring_cqe_seen(reactor->ring);
+            uring_complete(reactor, userData, res, flags);
+        }
+
+        reactor_run_deadlines(reactor, reactor_now_ms());
+    }
+
+    return NULL;
+}
+
+// Returns 0 if the kernel has everything the io_uring backend relies on
+static int8_t uring_probe(reactor_t* reactor)
+{
+    struct utsname name;
+    int major = 0;
+    if(uname(&name) != 0 || sscanf(name.release, "%d", &major) != 1 || major < URING_MIN_KERNEL) {
+        return -1;
+    }
+
+    const uint8_t ops[] = {
+        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_READ,
+        IORING_OP_RECV, IORING_OP_ACCEPT, IORING_OP_SENDMSG,
+    };
+    if(uring_supports_ops(reactor->ring, ops, sizeof(ops)) != 0) {
+        return -1;
+    }
+
+    return uring_buf_ring_init(reactor->ring, reactor->recvBuffs, URING_RECV_GROUP, URING_RECV_BUFFS, URING_RECV_BUFF_SIZE);
+}
+
+// Returns -1 if the kernel lacks support, the caller falls back to epoll
+static int8_t uring_init_reactor(reactor_t* reactor)
+{
+    reactor->ring = (uring_t*)calloc(1, sizeof(uring_t));
+    reactor->recvBuffs = (uring_buf_ring_t*)calloc(1, sizeof(uring_buf_ring_t));
+    if(reactor->ring != NULL && reactor->recvBuffs != NULL &&
+       uring_init(reactor->ring, URING_SQ_ENTRIES, URING_CQ_ENTRIES) == 0) {
+        if(uring_probe(reactor) == 0) {
+            return 0;
+        }
+        uring_free(reactor->ring);
+    }
+
+    // Nothing may point at them once the reactor runs epoll instead
+    free(reactor->ring);
+    free(reactor->recvBuffs);
+    reactor->ring = NULL;
+    reactor->recvBuffs = NULL;
+    return -1;
+}
+
+static void* reactor_loop(void* input)
+{
+    reactor_t* reactor = (reactor_t*)input;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while(1) {
+        int numEvents = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, reactor_wait_timeout(reactor));
+        if(numEvents < 0) {
+            int err = errno;
+            if(err == EINTR) {
+                continue;
+            }
+            LOG_ERROR("Reactor %u failed to wait with err=%d", reactor->id, err);
+            break;
+        }
+        reactor->loopMs = reactor_now_ms();
+
+        for(int i = 0; i < numEvents; i++) {
+            reactor_handle_t* handle = (reactor_handle_t*)events[i].data.ptr;
+            handle->cb(reactor, handle->ctx, events[i].events);
+        }
+
+        reactor_run_deadlines(reactor, reactor_now_ms());
+    }
+
+    return NULL;
+}
+
+// Keep a thread on the same core as the reactor, no-op if the reactor isn't pinned
+int8_t reactor_pin_thread(reactor_t* reactor, pthread_t tid)
+{
+    if(reactor->cpu < 0) {
+        return 0;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(reactor->cpu, &cpus);
+    int err = pthread_setaffinity_np(tid, sizeof(cpus), &cpus);
+    if(err != 0) {
+        LOG_ERROR("Failed to pin thread to cpu %d with err=%d", reactor->cpu, err);
+        return -1;
+    }
+
+    return 0;
+}
+
+// With pinToCores, reactor i owns core i, wrapping if there are more reactors than cores
+int8_t reactor_start_all(uint8_t count, uint8_t pinToCores, reactor_backend_t requested)
+{
+    if(count == 0 || count > MAX_REACTORS) {
+        LOG_ERROR("Invalid number of reactors %u", count);
+        return -1;
+    }
+
+    if(requested == REACTOR_BACKEND_URING) {
+        backend = REACTOR_BACKEND_URING;
+        for(uint8_t i = 0; i < count; i++) {
+            if(uring_init_reactor(&reactors[i]) != 0) {
+                LOG_WARN("io_uring is not usable on this kernel, falling back to epoll");
+                for(uint8_t j = 0; j < i; j++) {
+                    uring_free(reactors[j].ring);
+                    uring_buf_ring_free(reactors[j].recvBuffs);
+                    free(reactors[j].ring);
+                    free(reactors[j].recvBuffs);
+                    reactors[j].ring = NULL;
+                    reactors[j].recvBuffs = NULL;
+                }
+                backend = REACTOR_BACKEND_EPOLL;
+                break;
+            }
+        }
+    }
+
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(numCpus < 1) {
+        numCpus = 1;
+    }
+
+    for(uint8_t i = 0; i < count; i++) {
+        reactor_t* reactor = &reactors[i];
+        reactor->id = i;
+        reactor->cpu = pinToCores ? (int)(i % numCpus) : -1;
+        reactor->epfd = backend == REACTOR_BACKEND_EPOLL ? epoll_create1(EPOLL_CLOEXEC) : -1;
+        if(backend == REACTOR_BACKEND_EPOLL && reactor->epfd < 0) {
+            int err = errno;
+            LOG_ERROR("Failed to create epoll for reactor %u with err=%d", i, err);
+            return -1;
+        }
+
+        if(pthread_mutex_init(&reactor->taskMutex, NULL) != 0) {
+            LOG_ERROR("Failed to initialize task mutex for reactor %u", i);
+            close(reactor->epfd);
+            return -1;
+        }
+        reactor->loopMs = reactor_now_ms();
+        timer_wheel_init(&reactor->deadlines, reactor->loopMs);
+
+        reactor->wakeHandle.events = EPOLLIN;
+        reactor->wakeHandle.cb = reactor_run_tasks;
+        reactor->wakeHandle.ctx = reactor;
+        if(backend == REACTOR_BACKEND_URING) {
+            // io_uring parks the read until a task is posted, so the eventfd stays blocking
+            reactor->wakeHandle.fd = eventfd(0, EFD_CLOEXEC);
+            if(reactor->wakeHandle.fd >= 0) {
+                uring_arm_wake(reactor);
+            }
+        } else {
+            reactor->wakeHandle.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if(reactor->wakeHandle.fd >= 0 && reactor_add(reactor, &reactor->wakeHandle) != 0) {
+                close(reactor->wakeHandle.fd);
+                reactor->wakeHandle.fd = -1;
+            }
+        }
+        if(reactor->wakeHandle.fd < 0) {
+            LOG_ERROR("Failed to create wake fd for reactor %u", i);
+            close(reactor->epfd);
+            return -1;
+        }
+
+        void* (*loop)(void*) = backend == REACTOR_BACKEND_URING ? reactor_uring_loop : reactor_loop;
+        if(pthread_create(&reactor->tid, NULL, loop, reactor) != 0) {
+            LOG_ERROR("Failed to start reactor %u thread", i);
+            close(reactor->epfd);
+            return -1;
+        }
+        reactor_pin_thread(reactor, reactor->tid);
+        numReactors++;
+    }
+
+    LOG_INFO("Started %u %s reactor thread(s)", numReactors, backend == REACTOR_BACKEND_URING ? "io_uring" : "epoll");
+    return 0;
+}
+
+reactor_backend_t reactor_backend(void)
+{
+    return backend;
+}
+
+uint8_t reactor_count(void)
+{
+    return numReactors;
+}
+
+reactor_t* reactor_get(uint8_t id)
+{
+    return &reactors[id % numReactors];
+}
+
+// Round robin, only called from the accept thread
+reactor_t* reactor_pick(void)
+{
+    reactor_t* reactor = &reactors[nextReactor % numReactors];
+    nextReactor++;
+    return reactor;
+}
+
+// Safe from any thread
+// Only the first task of a round wakes the reactor, it takes the whole list at once
+int8_t reactor_post(reactor_t* reactor, reactor_task_t* task)
+{
+    task->next = NULL;
+    pthread_mutex_lock(&reactor->taskMutex);
+    uint8_t needsWake = reactor->taskTail == NULL;
+    if(reactor->taskTail == NULL) {
+        reactor->taskHead = task;
+    } else {
+        reactor->taskTail->next = task;
+    }
+    reactor->taskTail = task;
+    pthread_mutex_unlock(&reactor->taskMutex);
+
+    if(!needsWake) {
+        return 0;
+    }
+
+    uint64_t one = 1;
+    if(write(reactor->wakeHandle.fd, &one, sizeof(one)) < 0) {
+        int err = errno;
+        LOG_ERROR("Failed to wake reactor %u with err=%d", reactor->id, err);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Reactor thread only, re-arming an armed deadline moves it
+void reactor_deadline_arm(reactor_t* reactor, reactor_deadline_t* deadline, uint32_t timeoutMs)
+{
+    timer_wheel_arm(&reactor->deadlines, &deadline->node, reactor_now_ms() + timeoutMs);
+}
+
+// Reactor thread only
+void reactor_deadline_cancel(reactor_t* reactor, reactor_deadline_t* deadline)
+{
+    timer_wheel_cancel(&reactor->deadlines, &deadline->node);
+}
+
+int8_t reactor_add(reactor_t* reactor, reactor_handle_t* handle)
+{
+    if(backend == REACTOR_BACKEND_URING) {
+        return uring_start_op(reactor, handle, REACTOR_OP_POLL);
+    }
+
+    struct epoll_event ev;
+    ev.events = handle->events;
+    ev.data.ptr = handle;
+    if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, handle->fd, &ev) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to add fd %d to reactor %u with err=%d", handle->fd, reactor->id, err);
+        return -1;
+    }
+
+    return 0;
+}
+
+int8_t reactor_mod(reactor_t* reactor, reactor_handle_t* handle, uint32_t events)
+{
+    if(backend == REACTOR_BACKEND_URING) {
+        reactor_del(reactor, handle);
+        handle->events = events;
+        return reactor_add(reactor, handle);
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = handle;
+    if(epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, handle->fd, &ev) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to modify fd %d on reactor %u with err=%d", handle->fd, reactor->id, err);
+        return -1;
+    }
+    handle->events = events;
+
+    return 0;
+}
+
+int8_t reactor_del(reactor_t* reactor, reactor_handle_t* handle)
+{
+    if(backend == REACTOR_BACKEND_URING) {
+        // Completions already on their way find the op detached and are dropped
+        reactor_op_t* op = handle->op;
+        if(op != NULL) {
+            op->handle = NULL;
+            handle->op = NULL;
+            struct io_uring_sqe* sqe = uring_get_sqe(reactor->ring);
+            uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, (uint64_t)(uintptr_t)op | URING_TAG_OP, 0, URING_TAG_CANCEL);
+        }
+        return 0;
+    }
+
+    if(epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, handle->fd, NULL) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to remove fd %d from reactor %u with err=%d", handle->fd, reactor->id, err);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Multishot recv into the reactor's provided buffers, handle->dataCb gets every chunk
+int8_t reactor_recv_start(reactor_t* reactor, reactor_handle_t* handle)
+{
+    return uring_start_op(reactor, handle, REACTOR_OP_RECV);
+}
+
+// Cancel the multishot recv but keep the handle attached, chunks already received still reach dataCb
+void reactor_recv_pause(reactor_t* reactor, reactor_handle_t* handle)
+{
+    reactor_op_t* op = handle->op;
+    if(op == NULL || op->isPaused) {
+        return;
+    }
+
+    op->isPaused = 1;
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor->ring);
+    uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, (uint64_t)(uintptr_t)op | URING_TAG_OP, 0, URING_TAG_CANCEL);
+}
+
+// Restart a paused recv, or let it carry on if its last completion hasn't come in yet
+int8_t reactor_recv_resume(reactor_t* reactor, reactor_handle_t* handle)
+{
+    if(handle->op != NULL) {
+        handle->op->isPaused = 0;
+        return 0;
+    }
+
+    return uring_start_op(reactor, handle, REACTOR_OP_RECV);
+}
+
+// Multishot accept, handle->acceptCb gets every new socket
+int8_t reactor_accept_start(reactor_t* reactor, reactor_handle_t* handle)
+{
+    return uring_start_op(reactor, handle, REACTOR_OP_ACCEPT);
+}
+
+// Goes out with the reactor's next io_uring_enter, batched with everything else queued this round
+void reactor_send(reactor_t* reactor, reactor_send_t* send)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor->ring);
+    uring_prep(sqe, IORING_OP_SENDMSG, send->fd, (uint64_t)(uintptr_t)&send->msg, 1,
+               (uint64_t)(uintptr_t)send | URING_TAG_SEND);
+    sqe->msg_flags = MSG_NOSIGNAL | send->flags;
+}
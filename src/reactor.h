@@ -0,0 +1,109 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "timerwheel.h"
+
+#define MAX_REACTORS        (64)
+
+typedef enum {
+    REACTOR_BACKEND_EPOLL,
+    REACTOR_BACKEND_URING,
+    NUM_REACTOR_BACKEND,
+} reactor_backend_t;
+
+typedef struct reactor_s reactor_t;
+typedef struct reactor_op_s reactor_op_t;
+struct uring_s;
+struct uring_buf_ring_s;
+
+// Called on the reactor thread with the epoll event mask
+typedef void (*reactor_cb_t)(reactor_t* reactor, void* ctx, uint32_t events);
+// io_uring backend only, data is only valid during the call, len is 0 on EOF and -errno on failure
+typedef void (*reactor_data_cb_t)(reactor_t* reactor, void* ctx, const char* data, int32_t len);
+// io_uring backend only, fd is -errno on failure
+typedef void (*reactor_accept_cb_t)(reactor_t* reactor, void* ctx, int fd);
+// io_uring backend only, bytes sent or -errno
+typedef void (*reactor_send_cb_t)(reactor_t* reactor, void* ctx, int32_t result);
+
+// Embedded in whatever owns the fd, epoll data points at it
+typedef struct reactor_handle_s {
+    int fd;
+    uint32_t events;
+    reactor_cb_t cb;
+    void* ctx;
+    reactor_data_cb_t dataCb;       // for reactor_recv_start
+    reactor_accept_cb_t acceptCb;   // for reactor_accept_start
+    reactor_op_t* op;               // io_uring request armed for the handle, detached by reactor_del
+} reactor_handle_t;
+
+// One sendmsg handed to io_uring, msg and what it points at must stay put until cb runs
+typedef struct reactor_send_s {
+    int fd;
+    struct msghdr msg;
+    int flags;      // on top of MSG_NOSIGNAL, e.g. MSG_MORE
+    reactor_send_cb_t cb;
+    void* ctx;
+} reactor_send_t;
+
+// Work handed to a reactor from another thread, runs on the reactor thread
+typedef struct reactor_task_s {
+    reactor_cb_t cb;
+    void* ctx;
+    struct reactor_task_s* next;
+} reactor_task_t;
+
+// Deadline owned by a reactor, only touched from the reactor thread
+typedef struct reactor_deadline_s {
+    timer_node_t node;  // first, the wheel hands the node back
+    reactor_cb_t cb;
+    void* ctx;
+} reactor_deadline_t;
+
+typedef struct reactor_s {
+    int epfd;
+    struct uring_s* ring;       // io_uring backend, replaces epfd
+    struct uring_buf_ring_s* recvBuffs;
+    uint64_t wakeCount;         // eventfd read target for the io_uring backend
+    uint8_t id;
+    int cpu;            // core the loop is pinned to, -1 if left to the scheduler
+    pthread_t tid;
+    reactor_handle_t wakeHandle;    // eventfd, signalled when tasks are posted
+    pthread_mutex_t taskMutex;
+    reactor_task_t* taskHead;
+    reactor_task_t* taskTail;
+    timer_wheel_t deadlines;    // 1ms ticks
+    uint64_t loopMs;            // taken when the wait returns
+} reactor_t;
+
+// Falls back to epoll when io_uring is asked for but the kernel can't do it
+int8_t reactor_start_all(uint8_t count, uint8_t pinToCores, reactor_backend_t backend);
+reactor_backend_t reactor_backend(void);
+uint8_t reactor_count(void);
+reactor_t* reactor_get(uint8_t id);
+reactor_t* reactor_pick(void);
+int8_t reactor_pin_thread(reactor_t* reactor, pthread_t tid);
+uint64_t reactor_now_ms(void);
+// No clock read, for callbacks that can live with the time their wakeup started
+uint64_t reactor_loop_ms(reactor_t* reactor);
+
+int8_t reactor_post(reactor_t* reactor, reactor_task_t* task);
+void reactor_deadline_arm(reactor_t* reactor, reactor_deadline_t* deadline, uint32_t timeoutMs);
+void reactor_deadline_cancel(reactor_t* reactor, reactor_deadline_t* deadline);
+
+// Readiness callbacks, with io_uring these are multishot polls and must be set up on the reactor thread
+int8_t reactor_add(reactor_t* reactor, reactor_handle_t* handle);
+int8_t reactor_mod(reactor_t* reactor, reactor_handle_t* handle, uint32_t events);
+int8_t reactor_del(reactor_t* reactor, reactor_handle_t* handle);
+
+// io_uring backend only, reactor thread only
+int8_t reactor_recv_start(reactor_t* reactor, reactor_handle_t* handle);
+void reactor_recv_pause(reactor_t* reactor, reactor_handle_t* handle);
+int8_t reactor_recv_resume(reactor_t* reactor, reactor_handle_t* handle);
+int8_t reactor_accept_start(reactor_t* reactor, reactor_handle_t* handle);
+void reactor_send(reactor_t* reactor, reactor_send_t* send);
+
+#endif
@@ -0,0 +1,683 @@
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "roomlog.h"
+
+#define SEGMENT_BYTES       (4*1024*1024)
+#define SEGMENT_HEADER_SIZE (64)
+#define SEGMENT_FOOTER_SIZE (64)
+#define SEGMENT_DATA_END    (SEGMENT_BYTES - SEGMENT_FOOTER_SIZE)  // records never run into the footer
+#define RECORD_HEADER_SIZE  (8)
+#define SEGMENT_NAME_LEN    (32)    // "/rrrrrrrr-ssssssss.seg" and then some
+#define SEGMENT_MAGIC       "YAKSEG1"
+#define FOOTER_MAGIC        "YAKEND1"
+#define LOG_MAX_NAME_LEN    (39)
+#define LOG_INDEX_BUCKETS   (4096)
+#define LOG_COMMIT_MS       (10)        // a group collects appends for at least this long before its sync
+#define LOG_MAX_PENDING     (1 << 16)   // appenders wait once the writer is this far behind
+#define LOG_PENDING_INIT_LEN    (64)
+
+// First bytes of every segment file
+typedef struct segment_header_s {
+    char magic[8];
+    uint32_t roomId;
+    uint32_t segNo;
+    uint64_t firstSeq;
+    char name[LOG_MAX_NAME_LEN+1];
+} segment_header_t;
+
+// Last bytes of a full segment, enough to index it without reading the records
+typedef struct segment_footer_s {
+    char magic[8];
+    uint64_t firstSeq;
+    uint32_t numMsgs;
+    uint32_t dataEnd;
+    uint8_t reserved[40];
+} segment_footer_t;
+
+_Static_assert(sizeof(segment_header_t) == SEGMENT_HEADER_SIZE, "segment header size");
+_Static_assert(sizeof(segment_footer_t) == SEGMENT_FOOTER_SIZE, "segment footer size");
+
+// Record is {len, checksum} then the frame bytes, padded to 8
+typedef struct record_header_s {
+    uint32_t len;
+    uint32_t checksum;
+} record_header_t;
+
+typedef struct log_segment_s {
+    uint32_t segNo;
+    uint64_t firstSeq;
+    uint32_t numMsgs;
+    uint32_t dataEnd;       // offset past the last record
+    uint8_t isSealed;       // footer written
+    uint8_t isOnDisk;       // file created, a room that never speaks leaves none
+} log_segment_t;
+
+struct room_log_s {
+    char name[LOG_MAX_NAME_LEN+1];
+    uint32_t hash;
+    uint32_t roomId;
+    uint64_t nextSeq;
+
+    // Segments and the tail mapping are only touched under ioMutex
+    pthread_mutex_t ioMutex;
+    log_segment_t* segments;    // by segNo, the last one takes appends
+    uint32_t numSegments;
+    uint32_t segmentsCap;
+    int tailFd;                 // -1 until the tail is mapped
+    char* tailMap;
+    uint32_t syncedEnd;         // tail bytes already on disk
+
+    // Appends waiting for the writer
+    pthread_mutex_t mutex;
+    pthread_cond_t drained;
+    msg_frame_t** pending;
+    uint32_t numPending;
+    uint32_t pendingCap;
+    msg_frame_t** writing;      // swapped with pending by the writer
+    uint32_t writingCap;
+    uint8_t isQueued;           // on the writer queue
+
+    struct room_log_s* hashNext;
+    struct room_log_s* queueNext;
+};
+
+static uint8_t isEnabled = 0;
+static char logDir[PATH_MAX - SEGMENT_NAME_LEN];
+static long pageSize;
+
+static pthread_mutex_t indexMutex = PTHREAD_MUTEX_INITIALIZER;
+static room_log_t* logBuckets[LOG_INDEX_BUCKETS];
+static uint32_t nextRoomId = 0;
+
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static room_log_t* queueHead = NULL;
+
+// FNV-1a
+static uint32_t fnv1a(const char* data, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t record_size(uint32_t len)
+{
+    return RECORD_HEADER_SIZE + ((len + 7) & ~7u);
+}
+
+static void segment_path(char* out, size_t outLen, uint32_t roomId, uint32_t segNo)
+{
+    snprintf(out, outLen, "%s/%08x-%08u.seg", logDir, roomId, segNo);
+}
+
+static room_log_t* find_log(const char* name, uint32_t hash)
+{
+    for(room_log_t* it = logBuckets[hash % LOG_INDEX_BUCKETS]; it != NULL; it = it->hashNext) {
+        if(it->hash == hash && strcmp(it->name, name) == 0) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+// Caller holds indexMutex
+static room_log_t* new_log(const char* name, uint32_t hash, uint32_t roomId)
+{
+    room_log_t* log = (room_log_t*)calloc(1, sizeof(room_log_t));
+    if(log == NULL) {
+        return NULL;
+    }
+
+    if(pthread_mutex_init(&log->ioMutex, NULL) != 0) {
+        free(log);
+        return NULL;
+    }
+    if(pthread_mutex_init(&log->mutex, NULL) != 0) {
+        pthread_mutex_destroy(&log->ioMutex);
+        free(log);
+        return NULL;
+    }
+    if(pthread_cond_init(&log->drained, NULL) != 0) {
+        pthread_mutex_destroy(&log->mutex);
+        pthread_mutex_destroy(&log->ioMutex);
+        free(log);
+        return NULL;
+    }
+
+    snprintf(log->name, sizeof(log->name), "%s", name);
+    log->hash = hash;
+    log->roomId = roomId;
+    log->tailFd = -1;
+    if(roomId >= nextRoomId) {
+        nextRoomId = roomId+1;
+    }
+
+    room_log_t** bucket = &logBuckets[hash % LOG_INDEX_BUCKETS];
+    log->hashNext = *bucket;
+    *bucket = log;
+
+    return log;
+}
+
+static int8_t add_segment(room_log_t* log, const log_segment_t* segment)
+{
+    if(log->numSegments == log->segmentsCap) {
+        uint32_t capacity = log->segmentsCap == 0 ? 4 : log->segmentsCap*2;
+        log_segment_t* segments = (log_segment_t*)realloc(log->segments, capacity * sizeof(log_segment_t));
+        if(segments == NULL) {
+            return -1;
+        }
+        log->segments = segments;
+        log->segmentsCap = capacity;
+    }
+
+    log->segments[log->numSegments++] = *segment;
+    return 0;
+}
+
+// Walk records from offset up to end, calling cb for those numbered at least fromSeq
+// Stops at the first zeroed or torn record, returns the offset it stopped at
+static uint32_t scan_records(const char* map, uint32_t offset, uint32_t end, uint64_t seq, uint64_t fromSeq,
+                             room_log_msg_cb_t cb, void* ctx, uint32_t* numMsgs)
+{
+    uint32_t count = 0;
+    while(offset + RECORD_HEADER_SIZE <= end) {
+        const record_header_t* record = (const record_header_t*)(map + offset);
+        if(record->len == 0 || offset + record_size(record->len) > end) {
+            break;
+        }
+        const char* data = map + offset + RECORD_HEADER_SIZE;
+        if(fnv1a(data, record->len) != record->checksum) {
+            break;
+        }
+
+        if(cb != NULL && seq + count >= fromSeq) {
+            cb(data, record->len, ctx);
+        }
+        count++;
+        offset += record_size(record->len);
+    }
+
+    if(numMsgs != NULL) {
+        *numMsgs = count;
+    }
+    return offset;
+}
+
+// Map the last segment for appends, creating it if it was never written
+// Caller holds ioMutex
+static int8_t map_tail(room_log_t* log, uint8_t isNew)
+{
+    log_segment_t* tail = &log->segments[log->numSegments-1];
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), log->roomId, tail->segNo);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        int err = errno;
+        LOG_ERROR("Failed to open room log segment %s with err=%d", path, err);
+        return -1;
+    }
+    if(isNew && ftruncate(fd, SEGMENT_BYTES) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to size room log segment %s with err=%d", path, err);
+        close(fd);
+        return -1;
+    }
+
+    char* map = (char*)mmap(NULL, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        int err = errno;
+        LOG_ERROR("Failed to map room log segment %s with err=%d", path, err);
+        close(fd);
+        return -1;
+    }
+
+    if(isNew) {
+        segment_header_t* header = (segment_header_t*)map;
+        memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+        header->roomId = log->roomId;
+        header->segNo = tail->segNo;
+        header->firstSeq = tail->firstSeq;
+        snprintf(header->name, sizeof(header->name), "%s", log->name);
+        tail->dataEnd = SEGMENT_HEADER_SIZE;
+        log->syncedEnd = 0;
+    } else {
+        log->syncedEnd = tail->dataEnd;
+    }
+
+    tail->isOnDisk = 1;
+    log->tailFd = fd;
+    log->tailMap = map;
+    return 0;
+}
+
+static void unmap_tail(room_log_t* log)
+{
+    munmap(log->tailMap, SEGMENT_BYTES);
+    close(log->tailFd);
+    log->tailMap = NULL;
+    log->tailFd = -1;
+}
+
+// Flush everything written to the tail since the last sync in one go
+// Caller holds ioMutex
+static void sync_tail(room_log_t* log)
+{
+    if(log->tailMap == NULL) {
+        return;
+    }
+
+    uint32_t dataEnd = log->segments[log->numSegments-1].dataEnd;
+    if(dataEnd <= log->syncedEnd) {
+        return;
+    }
+
+    uint32_t start = log->syncedEnd & ~(uint32_t)(pageSize-1);
+    if(msync(log->tailMap + start, dataEnd - start, MS_SYNC) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to sync room log %s with err=%d", log->name, err);
+        return;
+    }
+    log->syncedEnd = dataEnd;
+    metrics_add(METRIC_LOG_SYNCS, 1);
+}
+
+// Footer the full tail and start the next segment
+// Caller holds ioMutex
+static int8_t roll_tail(room_log_t* log)
+{
+    log_segment_t* tail = &log->segments[log->numSegments-1];
+    segment_footer_t* footer = (segment_footer_t*)(log->tailMap + SEGMENT_DATA_END);
+    memset(footer, 0, sizeof(*footer));
+    memcpy(footer->magic, FOOTER_MAGIC, sizeof(footer->magic));
+    footer->firstSeq = tail->firstSeq;
+    footer->numMsgs = tail->numMsgs;
+    footer->dataEnd = tail->dataEnd;
+    if(msync(log->tailMap, SEGMENT_BYTES, MS_SYNC) != 0) {
+        int err = errno;
+        LOG_ERROR("Failed to sync room log %s footer with err=%d", log->name, err);
+    }
+    tail->isSealed = 1;
+    unmap_tail(log);
+
+    log_segment_t next = {tail->segNo+1, log->nextSeq, 0, SEGMENT_HEADER_SIZE, 0, 0};
+    if(add_segment(log, &next) != 0) {
+        return -1;
+    }
+    return map_tail(log, 1);
+}
+
+// Caller holds ioMutex
+static void write_record(room_log_t* log, msg_frame_t* frame)
+{
+    if(log->tailMap == NULL && map_tail(log, !log->segments[log->numSegments-1].isOnDisk) != 0) {
+        return;
+    }
+
+    log_segment_t* tail = &log->segments[log->numSegments-1];
+    if(tail->dataEnd + record_size(frame->size) > SEGMENT_DATA_END) {
+        if(roll_tail(log) != 0) {
+            LOG_ERROR("Failed to start a new segment for room log %s", log->name);
+            return;
+        }
+        tail = &log->segments[log->numSegments-1];
+    }
+
+    record_header_t* record = (record_header_t*)(log->tailMap + tail->dataEnd);
+    memcpy(log->tailMap + tail->dataEnd + RECORD_HEADER_SIZE, frame->data, frame->size);
+    record->checksum = fnv1a(frame->data, frame->size);
+    record->len = frame->size;
+    tail->dataEnd += record_size(frame->size);
+    tail->numMsgs++;
+    log->nextSeq++;
+    metrics_add(METRIC_LOG_BYTES, frame->size);
+}
+
+// Copy out everything appended so far and let go of the frames
+// Caller holds ioMutex
+static void write_pending(room_log_t* log)
+{
+    pthread_mutex_lock(&log->mutex);
+    msg_frame_t** frames = log->pending;
+    uint32_t numFrames = log->numPending;
+    uint32_t capacity = log->pendingCap;
+    log->pending = log->writing;
+    log->pendingCap = log->writingCap;
+    log->numPending = 0;
+    log->writing = frames;
+    log->writingCap = capacity;
+    log->isQueued = 0;
+    pthread_cond_broadcast(&log->drained);
+    pthread_mutex_unlock(&log->mutex);
+
+    for(uint32_t i = 0; i < numFrames; i++) {
+        write_record(log, frames[i]);
+        frame_unref(frames[i]);
+    }
+}
+
+static uint64_t roomlog_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Writes every queued log, then syncs each once for the whole group
+static void* roomlog_writer(void* input)
+{
+    while(1) {
+        pthread_mutex_lock(&queueMutex);
+        while(queueHead == NULL) {
+            pthread_cond_wait(&queueCond, &queueMutex);
+        }
+        room_log_t* log = queueHead;
+        queueHead = NULL;
+        pthread_mutex_unlock(&queueMutex);
+
+        uint64_t start = roomlog_now_ms();
+        while(log != NULL) {
+            // An appender may requeue the log as soon as its pending list is taken
+            room_log_t* next = log->queueNext;
+            pthread_mutex_lock(&log->ioMutex);
+            write_pending(log);
+            sync_tail(log);
+            pthread_mutex_unlock(&log->ioMutex);
+            log = next;
+        }
+
+        // Let the next group build up instead of syncing every msg on its own
+        uint64_t elapsed = roomlog_now_ms() - start;
+        if(elapsed < LOG_COMMIT_MS) {
+            usleep((LOG_COMMIT_MS - elapsed) * 1000);
+        }
+    }
+
+    return NULL;
+}
+
+void roomlog_append(room_log_t* log, msg_frame_t* frame)
+{
+    pthread_mutex_lock(&log->mutex);
+    while(log->numPending >= LOG_MAX_PENDING) {
+        pthread_cond_wait(&log->drained, &log->mutex);
+    }
+    if(log->numPending == log->pendingCap) {
+        uint32_t capacity = log->pendingCap == 0 ? LOG_PENDING_INIT_LEN : log->pendingCap*2;
+        msg_frame_t** pending = (msg_frame_t**)realloc(log->pending, capacity * sizeof(msg_frame_t*));
+        if(pending == NULL) {
+            pthread_mutex_unlock(&log->mutex);
+            LOG_ERROR("Failed to grow pending appends for room log %s", log->name);
+            return;
+        }
+        log->pending = pending;
+        log->pendingCap = capacity;
+    }
+
+    frame_ref(frame);
+    log->pending[log->numPending++] = frame;
+    uint8_t needsQueue = !log->isQueued;
+    log->isQueued = 1;
+    pthread_mutex_unlock(&log->mutex);
+
+    if(needsQueue) {
+        pthread_mutex_lock(&queueMutex);
+        log->queueNext = queueHead;
+        queueHead = log;
+        pthread_cond_signal(&queueCond);
+        pthread_mutex_unlock(&queueMutex);
+    }
+}
+
+uint32_t roomlog_read_tail(room_log_t* log, uint32_t maxMsgs, room_log_msg_cb_t cb, void* ctx)
+{
+    pthread_mutex_lock(&log->ioMutex);
+    write_pending(log);
+
+    uint64_t fromSeq = log->nextSeq > maxMsgs ? log->nextSeq - maxMsgs : 0;
+    uint32_t first = log->numSegments;
+    while(first > 0 && log->segments[first-1].firstSeq + log->segments[first-1].numMsgs > fromSeq) {
+        first--;
+    }
+
+    uint32_t numRead = 0;
+    for(uint32_t i = first; i < log->numSegments; i++) {
+        log_segment_t* segment = &log->segments[i];
+        if(segment->numMsgs == 0) {
+            continue;
+        }
+
+        const char* map = NULL;
+        uint8_t isTail = i == log->numSegments-1 && log->tailMap != NULL;
+        if(isTail) {
+            map = log->tailMap;
+        } else {
+            char path[PATH_MAX];
+            segment_path(path, sizeof(path), log->roomId, segment->segNo);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if(fd < 0) {
+                LOG_ERROR("Failed to open room log segment %s for reading", path);
+                continue;
+            }
+            map = (const char*)mmap(NULL, SEGMENT_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if(map == MAP_FAILED) {
+                LOG_ERROR("Failed to map room log segment %s for reading", path);
+                continue;
+            }
+        }
+
+        uint32_t count = 0;
+        scan_records(map, SEGMENT_HEADER_SIZE, segment->dataEnd, segment->firstSeq, fromSeq, cb, ctx, &count);
+        numRead += count;
+        if(!isTail) {
+            munmap((void*)map, SEGMENT_BYTES);
+        }
+    }
+    pthread_mutex_unlock(&log->ioMutex);
+
+    return numRead;
+}
+
+void roomlog_release(room_log_t* log)
+{
+    pthread_mutex_lock(&log->ioMutex);
+    write_pending(log);
+    sync_tail(log);
+    if(log->tailMap != NULL) {
+        unmap_tail(log);
+    }
+    pthread_mutex_unlock(&log->ioMutex);
+}
+
+room_log_t* roomlog_open(const char* name)
+{
+    uint32_t hash = fnv1a(name, strlen(name));
+    pthread_mutex_lock(&indexMutex);
+    room_log_t* log = find_log(name, hash);
+    if(log == NULL) {
+        log = new_log(name, hash, nextRoomId);
+        log_segment_t first = {0, 0, 0, SEGMENT_HEADER_SIZE, 0, 0};
+        if(log == NULL || add_segment(log, &first) != 0) {
+            LOG_ERROR("Failed to create room log %s", name);
+            log = NULL;
+        }
+    }
+    pthread_mutex_unlock(&indexMutex);
+
+    return log;
+}
+
+// Index one segment file from its header and footer alone
+static void recover_segment(const char* path, uint32_t roomId, uint32_t segNo)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return;
+    }
+
+    segment_header_t header;
+    segment_footer_t footer;
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+       memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) != 0 ||
+       header.roomId != roomId || header.segNo != segNo) {
+        LOG_WARN("Skipping room log segment %s with a bad header", path);
+        close(fd);
+        return;
+    }
+    header.name[LOG_MAX_NAME_LEN] = '\0';
+
+    log_segment_t segment = {segNo, header.firstSeq, 0, SEGMENT_HEADER_SIZE, 0, 1};
+    if(pread(fd, &footer, sizeof(footer), SEGMENT_DATA_END) == sizeof(footer) &&
+       memcmp(footer.magic, FOOTER_MAGIC, sizeof(footer.magic)) == 0 && footer.dataEnd <= SEGMENT_DATA_END) {
+        segment.numMsgs = footer.numMsgs;
+        segment.dataEnd = footer.dataEnd;
+        segment.isSealed = 1;
+    }
+    close(fd);
+
+    uint32_t hash = fnv1a(header.name, strlen(header.name));
+    room_log_t* log = find_log(header.name, hash);
+    if(log == NULL) {
+        log = new_log(header.name, hash, roomId);
+    }
+    if(log == NULL || log->roomId != roomId || add_segment(log, &segment) != 0) {
+        LOG_WARN("Skipping room log segment %s", path);
+    }
+}
+
+// Only the open tail has no footer, find its end by walking its records
+// A record torn by a crash is zeroed so appends can carry on after the last good one
+static void recover_tail(room_log_t* log)
+{
+    log_segment_t* tail = &log->segments[log->numSegments-1];
+    if(tail->isSealed) {
+        // Crashed right after the footer, appends go to a fresh segment
+        log_segment_t next = {tail->segNo+1, tail->firstSeq + tail->numMsgs, 0, SEGMENT_HEADER_SIZE, 0, 0};
+        add_segment(log, &next);
+        return;
+    }
+
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), log->roomId, tail->segNo);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0) {
+        return;
+    }
+    char* map = (char*)mmap(NULL, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return;
+    }
+
+    tail->dataEnd = scan_records(map, SEGMENT_HEADER_SIZE, SEGMENT_DATA_END, 0, 0, NULL, NULL, &tail->numMsgs);
+    const record_header_t* record = (const record_header_t*)(map + tail->dataEnd);
+    if(tail->dataEnd + RECORD_HEADER_SIZE <= SEGMENT_DATA_END && record->len != 0) {
+        uint32_t torn = SEGMENT_DATA_END - tail->dataEnd;
+        if(record_size(record->len) < torn) {
+            torn = record_size(record->len);
+        }
+        LOG_WARN("Dropping a torn record at the end of room log %s", log->name);
+        memset(map + tail->dataEnd, 0, torn);
+        msync(map, SEGMENT_BYTES, MS_SYNC);
+    }
+    munmap(map, SEGMENT_BYTES);
+}
+
+static int compare_segments(const void* a, const void* b)
+{
+    uint32_t segA = ((const log_segment_t*)a)->segNo;
+    uint32_t segB = ((const log_segment_t*)b)->segNo;
+    return segA < segB ? -1 : (segA > segB);
+}
+
+// Caller holds indexMutex
+static void recover_logs(void)
+{
+    DIR* dir = opendir(logDir);
+    if(dir == NULL) {
+        return;
+    }
+
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        uint32_t roomId, segNo;
+        char path[PATH_MAX], suffix[5];
+        if(sscanf(entry->d_name, "%8x-%8u.%4s", &roomId, &segNo, suffix) != 3 || strcmp(suffix, "seg") != 0) {
+            continue;
+        }
+        segment_path(path, sizeof(path), roomId, segNo);
+        recover_segment(path, roomId, segNo);
+    }
+    closedir(dir);
+
+    uint32_t numLogs = 0;
+    uint64_t numMsgs = 0;
+    for(uint32_t b = 0; b < LOG_INDEX_BUCKETS; b++) {
+        for(room_log_t* log = logBuckets[b]; log != NULL; log = log->hashNext) {
+            qsort(log->segments, log->numSegments, sizeof(log_segment_t), compare_segments);
+            recover_tail(log);
+            log_segment_t* tail = &log->segments[log->numSegments-1];
+            log->nextSeq = tail->firstSeq + tail->numMsgs;
+            numLogs++;
+            numMsgs += log->nextSeq - log->segments[0].firstSeq;
+        }
+    }
+
+    if(numLogs > 0) {
+        LOG_INFO("Recovered %u room log(s) holding %" PRIu64 " msgs", numLogs, numMsgs);
+    }
+}
+
+uint8_t roomlog_enabled(void)
+{
+    return isEnabled;
+}
+
+int8_t roomlog_start(const char* dir)
+{
+    if(snprintf(logDir, sizeof(logDir), "%s", dir) >= (int)sizeof(logDir)) {
+        LOG_ERROR("Room log dir %s is too long", dir);
+        return -1;
+    }
+    if(mkdir(logDir, 0755) != 0 && errno != EEXIST) {
+        int err = errno;
+        LOG_ERROR("Failed to create room log dir %s with err=%d", logDir, err);
+        return -1;
+    }
+    pageSize = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&indexMutex);
+    recover_logs();
+    pthread_mutex_unlock(&indexMutex);
+
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, roomlog_writer, NULL) != 0) {
+        LOG_ERROR("Failed to start room log writer thread");
+        return -1;
+    }
+    pthread_detach(tid);
+    isEnabled = 1;
+
+    LOG_INFO("Logging room broadcasts to %s", logDir);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef ROOMLOG_H
+#define ROOMLOG_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+// Durable per-room broadcast stream, kept in fixed size memory-mapped segments
+// A room's log outlives the room, so a recreated room carries on where it left off
+typedef struct room_log_s room_log_t;
+
+typedef void (*room_log_msg_cb_t)(const char* data, uint32_t len, void* ctx);
+
+// Rebuilds the index from the segments already in dir and starts the log writer
+int8_t roomlog_start(const char* dir);
+uint8_t roomlog_enabled(void);
+
+// Returns the room's log, created on first use, or NULL on failure
+room_log_t* roomlog_open(const char* name);
+
+// Takes a reference on the frame, the log writer copies it out and syncs it with the rest of its group
+void roomlog_append(room_log_t* log, msg_frame_t* frame);
+
+// Calls cb with up to maxMsgs of the newest msgs, oldest first
+uint32_t roomlog_read_tail(room_log_t* log, uint32_t maxMsgs, room_log_msg_cb_t cb, void* ctx);
+
+// Room is going away, write and sync what it appended and drop the tail mapping until the next use
+void roomlog_release(room_log_t* log);
+
+#endif
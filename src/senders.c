@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "logger.h"
+#include "senders.h"
+
+// Each sender takes its tasks in the order they were scheduled
+typedef struct sender_s {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    sender_task_t* head;
+    sender_task_t* tail;
+} sender_t;
+
+static sender_t senders[MAX_SENDERS];
+static uint32_t numSenders = 0;
+
+static void* sender_loop(void* input)
+{
+    sender_t* sender = (sender_t*)input;
+
+    while(1) {
+        pthread_mutex_lock(&sender->mutex);
+        while(sender->head == NULL) {
+            pthread_cond_wait(&sender->ready, &sender->mutex);
+        }
+        sender_task_t* task = sender->head;
+        sender->head = task->next;
+        if(sender->head == NULL) {
+            sender->tail = NULL;
+        }
+        pthread_mutex_unlock(&sender->mutex);
+
+        // Pairs with the fence in senders_schedule, work published from here on queues the task again
+        atomic_store_explicit(&task->isQueued, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        task->fn(task->ctx);
+    }
+
+    return NULL;
+}
+
+int8_t senders_start(uint32_t count)
+{
+    if(count == 0 || count > MAX_SENDERS) {
+        LOG_ERROR("Invalid number of senders %u", count);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < count; i++) {
+        sender_t* sender = &senders[i];
+        if(pthread_mutex_init(&sender->mutex, NULL) != 0 || pthread_cond_init(&sender->ready, NULL) != 0) {
+            LOG_ERROR("Failed to initialize sender %u", i);
+            return -1;
+        }
+        sender->head = NULL;
+        sender->tail = NULL;
+        if(pthread_create(&sender->tid, NULL, sender_loop, sender) != 0) {
+            LOG_ERROR("Failed to start sender %u", i);
+            return -1;
+        }
+        pthread_detach(sender->tid);
+        numSenders++;
+    }
+
+    LOG_INFO("Started %u room sender(s)", numSenders);
+    return 0;
+}
+
+uint32_t senders_count(void)
+{
+    return numSenders;
+}
+
+pthread_t senders_tid(uint32_t senderId)
+{
+    return senders[senderId].tid;
+}
+
+void senders_schedule(sender_task_t* task)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&task->isQueued, memory_order_relaxed) ||
+       atomic_exchange_explicit(&task->isQueued, 1, memory_order_relaxed)) {
+        return;
+    }
+
+    sender_t* sender = &senders[task->senderId];
+    task->next = NULL;
+    pthread_mutex_lock(&sender->mutex);
+    if(sender->tail == NULL) {
+        sender->head = task;
+    } else {
+        sender->tail->next = task;
+    }
+    sender->tail = task;
+    pthread_cond_signal(&sender->ready);
+    pthread_mutex_unlock(&sender->mutex);
+}
+
+uint8_t senders_is_queued(sender_task_t* task)
+{
+    return atomic_load_explicit(&task->isQueued, memory_order_seq_cst) != 0;
+}
@@ -0,0 +1,30 @@
+#ifndef SENDERS_H
+#define SENDERS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_SENDERS         (64)
+
+typedef void (*sender_fn_t)(void* ctx);
+
+// Work that runs on one of the shared sender threads whenever it is scheduled
+// Bound to a single sender so its runs never overlap
+typedef struct sender_task_s {
+    sender_fn_t fn;
+    void* ctx;
+    uint32_t senderId;
+    atomic_int isQueued;    // cleared just before each run, scheduling while it runs queues it again
+    struct sender_task_s* next;
+} sender_task_t;
+
+int8_t senders_start(uint32_t count);
+uint32_t senders_count(void);
+pthread_t senders_tid(uint32_t senderId);
+
+// Cheap when it is already queued, callers publish their work before scheduling
+void senders_schedule(sender_task_t* task);
+uint8_t senders_is_queued(sender_task_t* task);
+
+#endif
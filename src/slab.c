@@ -0,0 +1,192 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define SLAB_CHUNK_SIZE     (64*1024)
+#define SLAB_BATCH_BYTES    (16*1024)   // moved between a thread cache and the shared list at once
+
+typedef struct slab_block_s {
+    struct slab_block_s* next;
+} slab_block_t;
+
+typedef struct slab_class_s {
+    pthread_mutex_t mutex;
+    slab_block_t* freeList;
+} slab_class_t;
+
+typedef struct slab_cache_s {
+    slab_block_t* head;
+    uint32_t count;
+} slab_cache_t;
+
+static slab_class_t classes[SLAB_NUM_CLASSES] = {
+    [0 ... SLAB_NUM_CLASSES-1] = { .mutex = PTHREAD_MUTEX_INITIALIZER, .freeList = NULL },
+};
+static atomic_uint_fast64_t reservedBytes;
+
+static __thread slab_cache_t threadCache[SLAB_NUM_CLASSES];
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+uint32_t slab_class_size(uint8_t sizeClass)
+{
+    return 1u << (SLAB_MIN_SHIFT + sizeClass);
+}
+
+static uint32_t batch_len(uint8_t sizeClass)
+{
+    uint32_t len = SLAB_BATCH_BYTES / slab_class_size(sizeClass);
+    return len == 0 ? 1 : len;
+}
+
+static uint8_t size_to_class(uint32_t size)
+{
+    uint8_t sizeClass = 0;
+    while(sizeClass < SLAB_NUM_CLASSES && slab_class_size(sizeClass) < size) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+// Give cached blocks back so exiting threads don't strand them
+static void release_thread_cache(void* unused)
+{
+    for(uint8_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_cache_t* cache = &threadCache[i];
+        if(cache->head == NULL) {
+            continue;
+        }
+
+        slab_block_t* tail = cache->head;
+        while(tail->next != NULL) {
+            tail = tail->next;
+        }
+
+        pthread_mutex_lock(&classes[i].mutex);
+        tail->next = classes[i].freeList;
+        classes[i].freeList = cache->head;
+        pthread_mutex_unlock(&classes[i].mutex);
+
+        cache->head = NULL;
+        cache->count = 0;
+    }
+}
+
+static void create_cache_key(void)
+{
+    pthread_key_create(&cacheKey, release_thread_cache);
+}
+
+// Only the value matters, it arms the destructor for this thread
+static void arm_cache_release(void)
+{
+    pthread_once(&cacheKeyOnce, create_cache_key);
+    if(pthread_getspecific(cacheKey) == NULL) {
+        pthread_setspecific(cacheKey, threadCache);
+    }
+}
+
+// Fill an empty thread cache from the shared list, carving a new chunk if needed
+static int8_t refill_thread_cache(uint8_t sizeClass)
+{
+    slab_cache_t* cache = &threadCache[sizeClass];
+    slab_class_t* slabClass = &classes[sizeClass];
+    uint32_t want = batch_len(sizeClass);
+
+    arm_cache_release();
+
+    pthread_mutex_lock(&slabClass->mutex);
+    while(cache->count < want && slabClass->freeList != NULL) {
+        slab_block_t* block = slabClass->freeList;
+        slabClass->freeList = block->next;
+        block->next = cache->head;
+        cache->head = block;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&slabClass->mutex);
+
+    if(cache->count > 0) {
+        return 0;
+    }
+
+    uint32_t blockSize = slab_class_size(sizeClass);
+    uint32_t chunkSize = blockSize > SLAB_CHUNK_SIZE/4 ? blockSize*4 : SLAB_CHUNK_SIZE;
+    char* chunk = (char*)malloc(chunkSize);
+    if(chunk == NULL) {
+        return -1;
+    }
+    atomic_fetch_add_explicit(&reservedBytes, chunkSize, memory_order_relaxed);
+
+    for(uint32_t offset = 0; offset + blockSize <= chunkSize; offset += blockSize) {
+        slab_block_t* block = (slab_block_t*)(chunk + offset);
+        block->next = cache->head;
+        cache->head = block;
+        cache->count++;
+    }
+
+    return 0;
+}
+
+void* slab_alloc(uint32_t size, uint8_t* sizeClass)
+{
+    uint8_t cls = size_to_class(size);
+    *sizeClass = cls;
+    if(cls == SLAB_LARGE_CLASS) {
+        return malloc(size);
+    }
+
+    slab_cache_t* cache = &threadCache[cls];
+    if(cache->head == NULL && refill_thread_cache(cls) != 0) {
+        return NULL;
+    }
+
+    slab_block_t* block = cache->head;
+    cache->head = block->next;
+    cache->count--;
+
+    return block;
+}
+
+void slab_free(void* ptr, uint8_t sizeClass)
+{
+    if(sizeClass == SLAB_LARGE_CLASS) {
+        free(ptr);
+        return;
+    }
+
+    slab_cache_t* cache = &threadCache[sizeClass];
+    slab_block_t* block = (slab_block_t*)ptr;
+    block->next = cache->head;
+    cache->head = block;
+    cache->count++;
+    if(cache->count == 1) {
+        arm_cache_release();
+    }
+
+    // Threads that mostly free (room senders) hand surplus back in one batch
+    uint32_t batch = batch_len(sizeClass);
+    if(cache->count < batch*2) {
+        return;
+    }
+
+    slab_block_t* first = cache->head;
+    slab_block_t* last = first;
+    for(uint32_t i = 1; i < batch; i++) {
+        last = last->next;
+    }
+    cache->head = last->next;
+    cache->count -= batch;
+
+    slab_class_t* slabClass = &classes[sizeClass];
+    pthread_mutex_lock(&slabClass->mutex);
+    last->next = slabClass->freeList;
+    slabClass->freeList = first;
+    pthread_mutex_unlock(&slabClass->mutex);
+}
+
+uint64_t slab_reserved_bytes(void)
+{
+    return atomic_load_explicit(&reservedBytes, memory_order_relaxed);
+}
@@ -0,0 +1,20 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+
+#define SLAB_MIN_SHIFT      (6)     // 64 byte smallest class
+#define SLAB_NUM_CLASSES    (10)    // largest class is 32 KB
+#define SLAB_LARGE_CLASS    (SLAB_NUM_CLASSES) // above the largest class, plain malloc
+
+// Size classed allocator for msg storage
+// Threads keep a small cache per class and trade batches with a shared free list,
+// so the common alloc/free never takes a lock
+void* slab_alloc(uint32_t size, uint8_t* sizeClass);
+void slab_free(void* ptr, uint8_t sizeClass);
+uint32_t slab_class_size(uint8_t sizeClass);
+
+// Bytes carved from the system for slab classes
+uint64_t slab_reserved_bytes(void);
+
+#endif
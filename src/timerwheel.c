@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK   ((uint64_t)TIMER_WHEEL_SLOTS-1)
+
+// Ticks covered by one slot of the level
+static uint64_t level_span(uint32_t level)
+{
+    return 1ull << (TIMER_WHEEL_BITS*level);
+}
+
+static uint32_t slot_index(uint64_t tick, uint32_t level)
+{
+    return (tick >> (TIMER_WHEEL_BITS*level)) & SLOT_MASK;
+}
+
+// Slots are indexed by absolute time, so a level only has to be looked at as time enters its next slot
+static void link_node(timer_wheel_t* wheel, timer_node_t* node)
+{
+    uint64_t expires = node->expiresTick < wheel->nowTick ? wheel->nowTick : node->expiresTick;
+    uint64_t delta = expires - wheel->nowTick;
+    uint32_t level = 0;
+    while(level < TIMER_WHEEL_LEVELS-1 && delta >= level_span(level+1)) {
+        level++;
+    }
+    if(delta >= level_span(TIMER_WHEEL_LEVELS)) {
+        // Waits in the farthest slot and is placed again from there
+        expires = wheel->nowTick + level_span(TIMER_WHEEL_LEVELS) - 1;
+    }
+
+    uint32_t slot = slot_index(expires, level);
+    node->level = level;
+    node->slot = slot;
+    node->prev = NULL;
+    node->next = wheel->slots[level][slot];
+    if(node->next != NULL) {
+        node->next->prev = node;
+    }
+    wheel->slots[level][slot] = node;
+    wheel->busy[level] |= 1ull << slot;
+}
+
+static void unlink_node(timer_wheel_t* wheel, timer_node_t* node)
+{
+    if(node->prev == NULL) {
+        wheel->slots[node->level][node->slot] = node->next;
+        if(node->next == NULL) {
+            wheel->busy[node->level] &= ~(1ull << node->slot);
+        }
+    } else {
+        node->prev->next = node->next;
+    }
+    if(node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    node->next = NULL;
+    node->prev = NULL;
+}
+
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t nowTick)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->nowTick = nowTick;
+}
+
+void timer_wheel_arm(timer_wheel_t* wheel, timer_node_t* node, uint64_t expiresTick)
+{
+    if(node->isArmed) {
+        unlink_node(wheel, node);
+    } else {
+        node->isArmed = 1;
+        wheel->numArmed++;
+    }
+
+    node->expiresTick = expiresTick;
+    link_node(wheel, node);
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_node_t* node)
+{
+    if(!node->isArmed) {
+        return;
+    }
+
+    unlink_node(wheel, node);
+    node->isArmed = 0;
+    wheel->numArmed--;
+}
+
+// Time entered the slot, its timers move down to the levels below
+static void cascade(timer_wheel_t* wheel, uint32_t level)
+{
+    uint32_t slot = slot_index(wheel->nowTick, level);
+    timer_node_t* node = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->busy[level] &= ~(1ull << slot);
+    while(node != NULL) {
+        timer_node_t* next = node->next;
+        link_node(wheel, node);
+        node = next;
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t tick, timer_expire_cb_t cb, void* ctx)
+{
+    while(wheel->nowTick <= tick) {
+        if(wheel->numArmed == 0) {
+            wheel->nowTick = tick+1;
+            return;
+        }
+
+        // Each level whose next slot starts at this tick drops it a level down
+        for(uint32_t level = 1; level < TIMER_WHEEL_LEVELS && (wheel->nowTick & (level_span(level)-1)) == 0; level++) {
+            cascade(wheel, level);
+        }
+
+        // Skip empty ticks up to the next busy slot, or the start of the next block where a cascade may be due
+        uint32_t idx = slot_index(wheel->nowTick, 0);
+        uint64_t ahead = wheel->busy[0] >> idx;
+        uint64_t skip = ahead == 0 ? TIMER_WHEEL_SLOTS - idx : (uint64_t)__builtin_ctzll(ahead);
+        if(skip > 0) {
+            wheel->nowTick = wheel->nowTick + skip <= tick ? wheel->nowTick + skip : tick+1;
+            continue;
+        }
+
+        // Timers armed for this tick from a callback are picked up in the same pass
+        timer_node_t* node;
+        while((node = wheel->slots[0][idx]) != NULL) {
+            unlink_node(wheel, node);
+            if(node->expiresTick > wheel->nowTick) {
+                // Was parked in the farthest slot
+                link_node(wheel, node);
+                continue;
+            }
+            node->isArmed = 0;
+            wheel->numArmed--;
+            cb(node, ctx);
+        }
+        wheel->nowTick++;
+    }
+}
+
+int64_t timer_wheel_next(const timer_wheel_t* wheel)
+{
+    if(wheel->numArmed == 0) {
+        return -1;
+    }
+
+    int64_t next = -1;
+    for(uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t busy = wheel->busy[level];
+        if(busy == 0) {
+            continue;
+        }
+
+        // Slots ahead of the current one in this turn, then the ones after the wrap
+        uint32_t idx = slot_index(wheel->nowTick, level);
+        uint64_t ahead = busy >> idx;
+        uint64_t k = ahead != 0 ? (uint64_t)__builtin_ctzll(ahead) : __builtin_ctzll(busy) + TIMER_WHEEL_SLOTS - idx;
+        int64_t ticks = (int64_t)k;
+        if(level > 0) {
+            // Above level 0 the current slot was already cascaded, unless time is right at its start
+            if(k == 0 && (wheel->nowTick & (level_span(level)-1)) != 0) {
+                k = TIMER_WHEEL_SLOTS;
+            }
+            uint32_t shift = TIMER_WHEEL_BITS*level;
+            ticks = (int64_t)((((wheel->nowTick >> shift) + k) << shift) - wheel->nowTick);
+        }
+        if(next < 0 || ticks < next) {
+            next = ticks;
+        }
+    }
+
+    return next;
+}
@@ -0,0 +1,41 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS    (6)
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  (4)     // 1ms ticks reach 64^4 ms, about 4.6 hours, later timers wait at the top
+
+// Embedded in whatever the timer belongs to
+typedef struct timer_node_s {
+    uint64_t expiresTick;
+    uint8_t isArmed;
+    uint8_t level;      // slot it is linked in
+    uint8_t slot;
+    struct timer_node_s* next;
+    struct timer_node_s* prev;
+} timer_node_t;
+
+typedef void (*timer_expire_cb_t)(timer_node_t* node, void* ctx);
+
+// Hierarchical wheel, level n slots each span 64^n ticks and drop their timers a level down as time reaches them
+// Arming and cancelling are O(1), a bitmap per level finds the next busy slot without scanning
+// Not thread safe, owned by one loop
+typedef struct timer_wheel_s {
+    uint64_t nowTick;   // next tick to run, every earlier one has been
+    timer_node_t* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t busy[TIMER_WHEEL_LEVELS];
+    uint32_t numArmed;
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t nowTick);
+// A tick already run expires on the next advance
+void timer_wheel_arm(timer_wheel_t* wheel, timer_node_t* node, uint64_t expiresTick);
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_node_t* node);
+// Runs every timer due up to and including tick, cb may arm and cancel timers
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t tick, timer_expire_cb_t cb, void* ctx);
+// Ticks from nowTick until the wheel next has work, may be early but never late, -1 if nothing is armed
+int64_t timer_wheel_next(const timer_wheel_t* wheel);
+
+#endif
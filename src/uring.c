@@ -0,0 +1,248 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static int uring_enter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags, void* arg, size_t argSize)
+{
+    int ret = syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+    return ret < 0 ? -errno : ret;
+}
+
+int8_t uring_init(uring_t* ring, uint32_t sqEntries, uint32_t cqEntries)
+{
+    memset(ring, 0, sizeof(*ring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cqEntries;
+    ring->fd = syscall(__NR_io_uring_setup, sqEntries, &params);
+    if(ring->fd < 0) {
+        return -1;
+    }
+
+    // Timed waits go through the extended enter args
+    if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sqRing == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        if(ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = (char*)ring->sqRing;
+    char* cq = (char*)ring->cqRing;
+    ring->sqEntries = params.sq_entries;
+    ring->sqHead = (uint32_t*)(sq + params.sq_off.head);
+    ring->sqTail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sqMask = (uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (uint32_t*)(sq + params.sq_off.array);
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (uint32_t*)(cq + params.cq_off.head);
+    ring->cqTail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cqMask = (uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_free(uring_t* ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    if(ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Returns 0 if the kernel knows every op
+int8_t uring_supports_ops(uring_t* ring, const uint8_t* ops, uint32_t numOps)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+    if(probe == NULL) {
+        return -1;
+    }
+
+    int8_t ret = 0;
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        ret = -1;
+    }
+    for(uint32_t i = 0; i < numOps && ret == 0; i++) {
+        if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            ret = -1;
+        }
+    }
+
+    free(probe);
+    return ret;
+}
+
+// Returns how many entries were prepared since the last publish
+// The kernel skips the wait unless exactly that many are asked for
+static uint32_t uring_publish(uring_t* ring)
+{
+    uint32_t toSubmit = ring->sqLocalTail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    return toSubmit;
+}
+
+int uring_submit(uring_t* ring)
+{
+    uint32_t toSubmit = uring_publish(ring);
+    return uring_enter(ring->fd, toSubmit, 0, 0, NULL, 0);
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring)
+{
+    while(ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        uring_submit(ring);
+    }
+
+    uint32_t idx = ring->sqLocalTail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[idx] = idx;
+    ring->sqLocalTail++;
+
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t* ring, int timeoutMs)
+{
+    uint32_t toSubmit = uring_publish(ring);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if(timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    return uring_enter(ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring)
+{
+    uint32_t head = *ring->cqHead;
+    if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+void uring_cqe_seen(uring_t* ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_buf_add(uring_buf_ring_t* buffs, uint16_t bid)
+{
+    struct io_uring_buf* buf = &buffs->ring->bufs[buffs->tail & (buffs->numBuffs-1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf_get(buffs, bid);
+    buf->len = buffs->buffSize;
+    buf->bid = bid;
+    buffs->tail++;
+}
+
+int8_t uring_buf_ring_init(uring_t* ring, uring_buf_ring_t* buffs, uint16_t groupId, uint32_t numBuffs, uint32_t buffSize)
+{
+    memset(buffs, 0, sizeof(*buffs));
+    buffs->numBuffs = numBuffs;
+    buffs->buffSize = buffSize;
+    buffs->groupId = groupId;
+
+    size_t ringSize = numBuffs * sizeof(struct io_uring_buf);
+    void* mem;
+    if(posix_memalign(&mem, sysconf(_SC_PAGESIZE), ringSize) != 0) {
+        return -1;
+    }
+    memset(mem, 0, ringSize);
+    buffs->ring = (struct io_uring_buf_ring*)mem;
+
+    buffs->buffs = (char*)malloc((size_t)numBuffs * buffSize);
+    if(buffs->buffs == NULL) {
+        free(mem);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = numBuffs;
+    reg.bgid = groupId;
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free(buffs->buffs);
+        free(mem);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < numBuffs; i++) {
+        uring_buf_add(buffs, i);
+    }
+    __atomic_store_n(&buffs->ring->tail, buffs->tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Only once the ring that registered it is gone
+void uring_buf_ring_free(uring_buf_ring_t* buffs)
+{
+    free(buffs->buffs);
+    free(buffs->ring);
+}
+
+char* uring_buf_get(uring_buf_ring_t* buffs, uint16_t bid)
+{
+    return buffs->buffs + (size_t)bid * buffs->buffSize;
+}
+
+void uring_buf_recycle(uring_buf_ring_t* buffs, uint16_t bid)
+{
+    uring_buf_add(buffs, bid);
+    __atomic_store_n(&buffs->ring->tail, buffs->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// Just enough of io_uring on raw syscalls, no liburing
+// Single issuer, only the owning thread touches the rings
+typedef struct uring_s {
+    int fd;
+    uint32_t sqEntries;
+    uint32_t sqLocalTail;       // prepared but not yet published
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t* sqMask;
+    uint32_t* sqArray;
+    struct io_uring_sqe* sqes;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} uring_t;
+
+// Provided buffers the kernel picks from for multishot recv
+typedef struct uring_buf_ring_s {
+    struct io_uring_buf_ring* ring;
+    char* buffs;
+    uint32_t numBuffs;          // power of 2
+    uint32_t buffSize;
+    uint16_t groupId;
+    uint16_t tail;
+} uring_buf_ring_t;
+
+int8_t uring_init(uring_t* ring, uint32_t sqEntries, uint32_t cqEntries);
+void uring_free(uring_t* ring);
+int8_t uring_supports_ops(uring_t* ring, const uint8_t* ops, uint32_t numOps);
+
+// Never NULL, submits to make space when the queue is full
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+// Submits everything prepared and waits for at least one completion or the timeout, -1 waits forever
+// Returns -errno on failure, -ETIME on timeout
+int uring_submit_and_wait(uring_t* ring, int timeoutMs);
+int uring_submit(uring_t* ring);
+
+// Returns NULL when the completion queue is empty
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+void uring_cqe_seen(uring_t* ring);
+
+int8_t uring_buf_ring_init(uring_t* ring, uring_buf_ring_t* buffs, uint16_t groupId, uint32_t numBuffs, uint32_t buffSize);
+void uring_buf_ring_free(uring_buf_ring_t* buffs);
+char* uring_buf_get(uring_buf_ring_t* buffs, uint16_t bid);
+// Hand a buffer back to the kernel once its data has been consumed
+void uring_buf_recycle(uring_buf_ring_t* buffs, uint16_t bid);
+
+#endif
@@ -0,0 +1,443 @@
+// Load generator speaking the JOIN/line protocol
+// Every msg carries its send time, recipients turn it into a delivery latency sample
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT        (1234)
+#define DEFAULT_ROOMS       (4)
+#define DEFAULT_MEMBERS     (50)
+#define DEFAULT_RATE        (200)   // msgs/s per room
+#define DEFAULT_DURATION    (5)
+#define MAX_BENCH_MSG_SIZE  (19000)
+#define STAMP_LEN           (17)    // 'T' + 16 hex digits of CLOCK_MONOTONIC ns
+#define CONN_BUFF_SIZE      (1 << 16)
+#define BENCH_MAX_EVENTS    (256)
+#define JOIN_SETTLE_MS      (500)
+#define DRAIN_MS            (1000)
+#define USAGE               "Usage: yak_bench [-H host] [-p port] [-R rooms] [-m members] [-r msgs_per_sec_per_room] " \
+                            "[-d secs] [-s size|min-max[,large@pct]]\n"
+
+// Msg body sizes, a uniform range plus an optional share of large pastes
+typedef struct size_dist_s {
+    uint32_t min;
+    uint32_t max;
+    uint32_t large;
+    uint32_t largePct;
+} size_dist_t;
+
+typedef struct bench_conn_s {
+    int fd;
+    uint32_t room;
+    char recvBuff[CONN_BUFF_SIZE];
+    uint32_t recvLen;
+    char sendBuff[CONN_BUFF_SIZE];
+    uint32_t sendHead;
+    uint32_t sendLen;
+    uint8_t isWritable;
+} bench_conn_t;
+
+typedef struct bench_stats_s {
+    uint64_t sent;
+    uint64_t sentBytes;
+    uint64_t skipped;       // send buffer full, the server isn't keeping up
+    uint64_t delivered;
+    uint64_t deliveredBytes;
+    uint64_t* latencyNs;
+    uint64_t numLatency;
+    uint64_t latencyCap;
+    uint8_t isMeasuring;
+} bench_stats_t;
+
+static bench_stats_t stats;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int8_t parse_size_dist(const char* spec, size_dist_t* dist)
+{
+    memset(dist, 0, sizeof(*dist));
+    char* end = NULL;
+    dist->min = strtoul(spec, &end, 10);
+    dist->max = dist->min;
+    if(*end == '-') {
+        dist->max = strtoul(end+1, &end, 10);
+    }
+    if(*end == ',') {
+        dist->large = strtoul(end+1, &end, 10);
+        if(*end != '@') {
+            return -1;
+        }
+        dist->largePct = strtoul(end+1, &end, 10);
+    }
+
+    if(*end != '\0' || dist->min < STAMP_LEN+1 || dist->max < dist->min || dist->max > MAX_BENCH_MSG_SIZE ||
+       dist->large > MAX_BENCH_MSG_SIZE || dist->largePct > 100 || (dist->largePct > 0 && dist->large < STAMP_LEN+1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t pick_size(const size_dist_t* dist)
+{
+    if(dist->largePct > 0 && (uint32_t)(rand() % 100) < dist->largePct) {
+        return dist->large;
+    }
+    return dist->min + rand() % (dist->max - dist->min + 1);
+}
+
+static void record_latency(uint64_t ns)
+{
+    if(stats.numLatency == stats.latencyCap) {
+        uint64_t cap = stats.latencyCap == 0 ? (1 << 20) : stats.latencyCap*2;
+        uint64_t* samples = (uint64_t*)realloc(stats.latencyNs, cap * sizeof(uint64_t));
+        if(samples == NULL) {
+            return;
+        }
+        stats.latencyNs = samples;
+        stats.latencyCap = cap;
+    }
+    stats.latencyNs[stats.numLatency++] = ns;
+}
+
+static int8_t flush_conn(bench_conn_t* conn)
+{
+    while(conn->sendLen > 0) {
+        ssize_t numBytes = send(conn->fd, conn->sendBuff+conn->sendHead, conn->sendLen, MSG_NOSIGNAL);
+        if(numBytes < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->isWritable = 0;
+                return 0;
+            } else if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        conn->sendHead += numBytes;
+        conn->sendLen -= numBytes;
+    }
+    conn->sendHead = 0;
+
+    return 0;
+}
+
+// Append a line to the connection, dropped if the server has fallen that far behind
+static void queue_line(bench_conn_t* conn, const char* line, uint32_t len)
+{
+    if(conn->sendHead + conn->sendLen + len > CONN_BUFF_SIZE) {
+        memmove(conn->sendBuff, conn->sendBuff+conn->sendHead, conn->sendLen);
+        conn->sendHead = 0;
+    }
+    if(conn->sendLen + len > CONN_BUFF_SIZE) {
+        stats.skipped++;
+        return;
+    }
+
+    memcpy(conn->sendBuff+conn->sendHead+conn->sendLen, line, len);
+    conn->sendLen += len;
+}
+
+static void send_msg(bench_conn_t* conn, uint32_t size)
+{
+    static char line[MAX_BENCH_MSG_SIZE+2];
+    sprintf(line, "T%016lx", (unsigned long)now_ns());
+    memset(line+STAMP_LEN, 'x', size-STAMP_LEN);
+    line[size] = '\n';
+
+    uint64_t skipped = stats.skipped;
+    queue_line(conn, line, size+1);
+    if(stats.skipped == skipped && stats.isMeasuring) {
+        stats.sent++;
+        stats.sentBytes += size+1;
+    }
+}
+
+// Lines look like "name:T<stamp>xxx", join and leave notices carry no stamp
+static void handle_line(const char* line, uint32_t len, uint64_t now)
+{
+    const char* colon = memchr(line, ':', len);
+    if(colon == NULL || (uint32_t)(colon - line) + 1 + STAMP_LEN > len || colon[1] != 'T') {
+        return;
+    }
+
+    char stamp[STAMP_LEN];
+    memcpy(stamp, colon+2, STAMP_LEN-1);
+    stamp[STAMP_LEN-1] = '\0';
+    uint64_t sentNs = strtoull(stamp, NULL, 16);
+
+    if(stats.isMeasuring) {
+        stats.delivered++;
+        stats.deliveredBytes += len+1;
+        record_latency(now - sentNs);
+    }
+}
+
+static int8_t read_conn(bench_conn_t* conn)
+{
+    while(1) {
+        ssize_t numBytes = recv(conn->fd, conn->recvBuff+conn->recvLen, CONN_BUFF_SIZE-conn->recvLen, 0);
+        if(numBytes < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if(numBytes == 0) {
+            return -1;
+        }
+
+        uint64_t now = now_ns();
+        uint32_t end = conn->recvLen + numBytes;
+        uint32_t start = 0;
+        char* newline;
+        while((newline = memchr(conn->recvBuff+start, '\n', end-start)) != NULL) {
+            uint32_t lineLen = newline - (conn->recvBuff+start);
+            handle_line(conn->recvBuff+start, lineLen, now);
+            start += lineLen+1;
+        }
+        memmove(conn->recvBuff, conn->recvBuff+start, end-start);
+        conn->recvLen = end-start;
+        if(conn->recvLen == CONN_BUFF_SIZE) {
+            printf("ERROR: Line longer than %u bytes from server\n", CONN_BUFF_SIZE);
+            return -1;
+        }
+    }
+}
+
+static int connect_member(struct sockaddr_in* addr, uint32_t room, uint32_t member)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr*)addr, sizeof(*addr)) != 0) {
+        int err = errno;
+        printf("ERROR: Failed to connect member %u of room %u with err=%d\n", member, room, err);
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char join[64];
+    int len = sprintf(join, "JOIN bench%u m%u\n", room, member);
+    if(send(fd, join, len, MSG_NOSIGNAL) != len) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    return fd;
+}
+
+// Service sockets until the deadline, sending msgs as they come due
+static int8_t run_loop(int epfd, bench_conn_t* conns, uint32_t numRooms, uint32_t numMembers,
+                       uint32_t rate, const size_dist_t* dist, uint64_t untilNs, uint8_t isSending)
+{
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    uint64_t startNs = now_ns();
+    uint64_t sentPerRoom = 0;
+    uint32_t nextMember = 0;
+
+    while(1) {
+        uint64_t now = now_ns();
+        if(now >= untilNs) {
+            return 0;
+        }
+
+        if(isSending && rate > 0) {
+            // Catch up with the schedule, one msg per room per tick
+            uint64_t due = (now - startNs) * rate / 1000000000ull;
+            while(sentPerRoom < due) {
+                for(uint32_t r = 0; r < numRooms; r++) {
+                    bench_conn_t* conn = &conns[r*numMembers + nextMember];
+                    send_msg(conn, pick_size(dist));
+                    if(conn->isWritable && flush_conn(conn) != 0) {
+                        printf("ERROR: Send failed on room %u\n", r);
+                        return -1;
+                    }
+                }
+                nextMember = (nextMember+1) % numMembers;
+                sentPerRoom++;
+            }
+        }
+
+        int timeoutMs = 1;
+        if(!isSending) {
+            timeoutMs = (int)((untilNs - now) / 1000000) + 1;
+        }
+        int numEvents = epoll_wait(epfd, events, BENCH_MAX_EVENTS, timeoutMs);
+        if(numEvents < 0 && errno != EINTR) {
+            return -1;
+        }
+
+        for(int i = 0; i < numEvents; i++) {
+            bench_conn_t* conn = (bench_conn_t*)events[i].data.ptr;
+            if(events[i].events & EPOLLOUT) {
+                conn->isWritable = 1;
+                if(flush_conn(conn) != 0) {
+                    return -1;
+                }
+            }
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if(read_conn(conn) != 0) {
+                    printf("ERROR: Server closed a connection in room %u\n", conn->room);
+                    return -1;
+                }
+            }
+        }
+    }
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+static double percentile_us(double pct)
+{
+    if(stats.numLatency == 0) {
+        return 0;
+    }
+    uint64_t idx = (uint64_t)(pct * (stats.numLatency-1));
+    return stats.latencyNs[idx] / 1000.0;
+}
+
+static void report(uint32_t durationSecs)
+{
+    qsort(stats.latencyNs, stats.numLatency, sizeof(uint64_t), compare_u64);
+    printf("sent       %" PRIu64 " msgs  %.0f msgs/s  %.2f MB/s  (%" PRIu64 " skipped, send buffer full)\n",
+            stats.sent, (double)stats.sent/durationSecs, stats.sentBytes/1e6/durationSecs, stats.skipped);
+    printf("delivered  %" PRIu64 " msgs  %.0f msgs/s  %.2f MB/s\n",
+            stats.delivered, (double)stats.delivered/durationSecs, stats.deliveredBytes/1e6/durationSecs);
+    printf("latency us p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+            percentile_us(0.5), percentile_us(0.99), percentile_us(0.999), percentile_us(1.0));
+}
+
+int main(int argc, char* argv[])
+{
+    const char* host = "127.0.0.1";
+    uint32_t port = DEFAULT_PORT;
+    uint32_t numRooms = DEFAULT_ROOMS;
+    uint32_t numMembers = DEFAULT_MEMBERS;
+    uint32_t rate = DEFAULT_RATE;
+    uint32_t durationSecs = DEFAULT_DURATION;
+    size_dist_t dist;
+    parse_size_dist("64", &dist);
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:R:m:r:d:s:")) != -1) {
+        switch(opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = strtoul(optarg, NULL, 10); break;
+        case 'R': numRooms = strtoul(optarg, NULL, 10); break;
+        case 'm': numMembers = strtoul(optarg, NULL, 10); break;
+        case 'r': rate = strtoul(optarg, NULL, 10); break;
+        case 'd': durationSecs = strtoul(optarg, NULL, 10); break;
+        case 's':
+            if(parse_size_dist(optarg, &dist) != 0) {
+                printf("ERROR: Invalid size distribution %s, sizes go from %u to %u\n",
+                        optarg, STAMP_LEN+1, MAX_BENCH_MSG_SIZE);
+                return -1;
+            }
+            break;
+        default:
+            printf(USAGE);
+            return -1;
+        }
+    }
+    if(numRooms == 0 || numMembers == 0 || durationSecs == 0) {
+        printf(USAGE);
+        return -1;
+    }
+
+    // One fd per member
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        printf("ERROR: Invalid host %s\n", host);
+        return -1;
+    }
+
+    int epfd = epoll_create1(0);
+    bench_conn_t* conns = (bench_conn_t*)calloc((size_t)numRooms*numMembers, sizeof(bench_conn_t));
+    if(epfd < 0 || conns == NULL) {
+        printf("ERROR: Failed to set up %u connections\n", numRooms*numMembers);
+        return -1;
+    }
+
+    for(uint32_t r = 0; r < numRooms; r++) {
+        for(uint32_t m = 0; m < numMembers; m++) {
+            bench_conn_t* conn = &conns[r*numMembers + m];
+            conn->room = r;
+            conn->isWritable = 1;
+            conn->fd = connect_member(&addr, r, m);
+            if(conn->fd < 0) {
+                return -1;
+            }
+
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            ev.data.ptr = conn;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+        }
+    }
+    printf("INFO: %u rooms x %u members joined, %u msgs/s per room, sizes %u-%u",
+            numRooms, numMembers, rate, dist.min, dist.max);
+    if(dist.largePct > 0) {
+        printf(" with %u%% at %u", dist.largePct, dist.large);
+    }
+    printf(", running %us\n", durationSecs);
+
+    // Let the join notices settle before measuring
+    if(run_loop(epfd, conns, numRooms, numMembers, rate, &dist, now_ns() + JOIN_SETTLE_MS*1000000ull, 0) != 0) {
+        return -1;
+    }
+
+    stats.isMeasuring = 1;
+    uint64_t endNs = now_ns() + (uint64_t)durationSecs*1000000000ull;
+    if(run_loop(epfd, conns, numRooms, numMembers, rate, &dist, endNs, 1) != 0) {
+        return -1;
+    }
+    // Count what was still in flight when sending stopped
+    if(run_loop(epfd, conns, numRooms, numMembers, rate, &dist, now_ns() + DRAIN_MS*1000000ull, 0) != 0) {
+        return -1;
+    }
+
+    report(durationSecs);
+    uint64_t expected = stats.sent * numMembers;
+    if(stats.delivered < expected) {
+        printf("WARN: %" PRIu64 " of %" PRIu64 " deliveries missing\n", expected - stats.delivered, expected);
+    }
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+
+// MSG_ZEROCOPY sends leave their pages to the kernel until it reports them done on the socket's error queue
+// Each send that took bytes is numbered, from 0 per socket, and a completion covers a range of them
+
+// Sends lo through hi are done, isCopied if the kernel copied them after all, e.g. over loopback
+typedef void (*zerocopy_done_cb_t)(uint32_t lo, uint32_t hi, uint8_t isCopied, void* ctx);
+
+int8_t zerocopy_enable(int fd);
+// Drains the error queue without blocking, returns the number of completions or -1
+int32_t zerocopy_reap(int fd, zerocopy_done_cb_t cb, void* ctx);
+
+#endif